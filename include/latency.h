@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Latency histograms shared by fsstress, fsx and aio-stress.
+ *
+ * Buckets are exact below 8ns, then four to each power of two, so a
+ * percentile read off them is within 25%.
+ */
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#define	LAT_BUCKETS	160
+
+static inline int
+lat_bucket(unsigned long long ns)
+{
+	int	msb;
+
+	if (ns < 8)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	if (msb > (LAT_BUCKETS - 8) / 4 + 2)
+		return LAT_BUCKETS - 1;
+	return 8 + (msb - 3) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/* The lowest latency that goes into bucket b. */
+static inline unsigned long long
+lat_bucket_ns(int b)
+{
+	if (b < 8)
+		return b;
+	b -= 8;
+	return (4ULL | (b & 3)) << (b / 4 + 1);
+}
+
+/*
+ * The latency below which permille thousandths of the count samples in
+ * hist finished, to the resolution of the histogram.
+ */
+static inline unsigned long long
+lat_hist_percentile(const unsigned long long *hist, unsigned long long count,
+		    unsigned long long max_ns, int permille)
+{
+	unsigned long long	need;
+	unsigned long long	sum = 0;
+	int			b;
+
+	need = (count * permille + 999) / 1000;
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		sum += hist[b];
+		if (sum >= need)
+			break;
+	}
+	if (b < LAT_BUCKETS - 1 && lat_bucket_ns(b + 1) - 1 < max_ns)
+		return lat_bucket_ns(b + 1) - 1;
+	return max_ns;
+}
+
+#endif /* _LATENCY_H_ */
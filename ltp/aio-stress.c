@@ -35,12 +35,21 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <libaio.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "latency.h"
+#ifdef URING
+#include <liburing.h>
+#endif
 
 #define IO_FREE 0
 #define IO_PENDING 1
@@ -55,6 +64,7 @@ enum {
     READ,
     RWRITE,
     RREAD,
+    MIXED,
     LAST_STAGE,
 };
 
@@ -62,6 +72,17 @@ enum {
 #define USE_SHM 1
 #define USE_SHMFS 2
 
+/* -A thread placement */
+#define PIN_NONE 0
+#define PIN_CPU 1
+#define PIN_NODE 2
+
+/* -Q options for the io_uring engine */
+#define URING_FIXED_BUFS	1
+#define URING_FIXED_FILES	2
+#define URING_SQPOLL		4
+#define URING_IOPOLL		8
+
 /* 
  * various globals, these are effectively read only by the time the threads
  * are started
@@ -72,6 +93,7 @@ int o_direct = 0;
 int o_sync = 0;
 int latency_stats = 0;
 int completion_latency_stats = 0;
+FILE *json_fp = NULL;
 int io_iter = 8;
 int iterations = RUN_FOREVER;
 int max_io_submit = 0;
@@ -88,12 +110,69 @@ char *aligned_buffer = NULL;
 int padded_reclen = 0;
 int stonewall = 1;
 int verify = 0;
-char *verify_buf = NULL;
+uint64_t verify_run;
+uint64_t verify_salt[512 / sizeof(uint64_t)];	/* VERIFY_WORDS */
 int unlink_files = 0;
+int use_uring = 0;
+int uring_flags = 0;
+
+/* the mixed stage: percent of reads, and of random rather than sequential */
+int mixed_reads = 50;
+int mixed_random = 100;
+
+/* skew_ios percent of random ios go to the first skew_area percent of a file */
+int skew_ios = 0;
+int skew_area = 100;
+
+/* fsync (or fdatasync) a file after every sync_interval writes to it */
+int sync_interval = 0;
+int sync_data = 0;
+
+/* 
+ * -A pins threads round robin to the cpus or nodes in pin_list (all
+ * online ones by default), and gives each its own node local buffers.
+ * -H puts those buffers in hugepages
+ */
+int pin_mode = PIN_NONE;
+char *pin_list = NULL;
+int use_hugepages = 0;
 
 struct io_unit;
 struct thread_info;
 
+/*
+ * -v writes every VERIFY_BLOCK of a file with a pattern that says which
+ * block it is: its offset, the file's number on the command line, how
+ * many times the block has been written (the pass), a magic number and
+ * a stamp for this run, followed by words derived from all but the
+ * stamp.  A read that finds another block's data, an older pass or
+ * another run's data says so.  A block not written yet in this run must
+ * be zeroes or hold any pass from an earlier -v run over the same files
+ * in the same order, so a read only stage can check what one left.
+ *
+ * Each file keeps the pass it expects in every block, and how many ios
+ * are in flight over it.  An io that overlaps one already in flight
+ * can't know what it will find, so reads like that aren't checked and
+ * writes like that leave their blocks unknown until the next write.
+ */
+#define VERIFY_BLOCK 512
+#define VERIFY_WORDS (VERIFY_BLOCK / sizeof(uint64_t))
+#define VERIFY_MAX_PASS 254
+#define VERIFY_UNKNOWN 255		/* pass 0 is never written */
+#define VERIFY_MAGIC 0x61696f7374726573ULL	/* "aiostres" */
+#define VERIFY_HDR_WORDS 4
+
+struct verify_file {
+    unsigned int id;
+    long nblocks;
+    unsigned char *pass;
+    unsigned short *busy;
+
+    /* only taken when contexts on several threads share the file */
+    int shared;
+    pthread_mutex_t lock;
+};
+
 /* pthread mutexes and other globals for keeping the threads in sync */
 pthread_cond_t stage_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -103,17 +182,17 @@ struct timeval global_stage_start_time;
 struct thread_info *global_thread_info;
 
 /* 
- * latencies during io_submit are measured, these are the 
- * granularities for deviations 
+ * latencies during io_submit and until completion are measured in ns
+ * and kept in log-linear histograms: exact below 8ns, then four buckets
+ * per power of two, the last one open ended.  Same scheme as fsstress
+ * and fsx, so histograms from any of them can be added up.
  */
-#define DEVIATIONS 6
-int deviations[DEVIATIONS] = { 100, 250, 500, 1000, 5000, 10000 };
 struct io_latency {
-    double max;
-    double min;
-    double total_io;
-    double total_lat;
-    double deviations[DEVIATIONS]; 
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long min_ns;
+    unsigned long long max_ns;
+    unsigned long long hist[LAT_BUCKETS];
 };
 
 /* container for a series of operations to a file */
@@ -157,6 +236,18 @@ struct io_oper {
     /* stonewalled = 1 when we got cut off before submitting all our ios */
     int stonewalled;
 
+    /* reads started in the mixed stage, the rest of started_ios are writes */
+    int mixed_reads;
+
+    /* a file size seen in the mixed stage, it only grows from there */
+    off_t size_seen;
+
+    /* writes sent since the last fsync for sync_interval */
+    int writes_since_sync;
+
+    /* block state for -v, shared by all the contexts on this file */
+    struct verify_file *vfile;
+
     /* list management */
     struct io_oper *next;
     struct io_oper *prev;
@@ -164,6 +255,9 @@ struct io_oper {
     struct timeval start_time;
 
     char *file_name;
+
+    /* slot in the thread's registered file table (-Q fixedfiles) */
+    int file_index;
 };
 
 /* a single io, and all the tracking needed for it */
@@ -186,13 +280,29 @@ struct io_unit {
     /* result of last operation */
     long res;
 
+    /* -v: this io overlapped another when it was sent */
+    int verify_skip;
+
+    /*
+     * the file was at least this big when the read was sent, or -1 to
+     * fstat when it completes.  Set in the mixed stage, where writes
+     * racing with the read can extend the file after it hit EOF.
+     */
+    off_t submit_size;
+
     struct io_unit *next;
 
-    struct timeval io_start_time;		/* time of io_submit */
+    struct timespec io_start_time;		/* time of io_submit */
 };
 
 struct thread_info {
     io_context_t io_ctx;
+#ifdef URING
+    struct io_uring ring;
+
+    /* completions reaped in one go by uring_getevents */
+    struct io_uring_cqe **cqes;
+#endif
     pthread_t tid;
 
     /* allocated array of io_unit structs */
@@ -231,6 +341,10 @@ struct thread_info {
 
     /* latency completion stats i/o time from io_submit until io_getevents */
     struct io_latency io_completion_latency;
+
+    /* where -A put this thread, -1 for anywhere */
+    int cpu;
+    int node;
 };
 
 /*
@@ -262,29 +376,47 @@ static double time_since_now(struct timeval *start_tv)
     return time_since(start_tv, &stop_time);
 }
 
+static unsigned long long lat_percentile(struct io_latency *lat, int permille)
+{
+    return lat_hist_percentile(lat->hist, lat->count, lat->max_ns, permille);
+}
+
 /*
  * Add latency info to latency struct 
  */
-static void calc_latency(struct timeval *start_tv, struct timeval *stop_tv,
+static void calc_latency(struct timespec *start_ts, struct timespec *stop_ts,
 			struct io_latency *lat)
 {
-    double delta;
-    int i;
-    delta = time_since(start_tv, stop_tv);
-    delta = delta * 1000;
-
-    if (delta > lat->max)
-    	lat->max = delta;
-    if (!lat->min || delta < lat->min)
-    	lat->min = delta;
-    lat->total_io++;
-    lat->total_lat += delta;
-    for (i = 0 ; i < DEVIATIONS ; i++) {
-        if (delta < deviations[i]) {
-	    lat->deviations[i]++;
-	    break;
-	}
-    }
+    long long delta;
+
+    delta = (stop_ts->tv_sec - start_ts->tv_sec) * 1000000000LL +
+	    stop_ts->tv_nsec - start_ts->tv_nsec;
+    if (delta < 0)
+	delta = 0;
+
+    if (delta > lat->max_ns)
+    	lat->max_ns = delta;
+    if (!lat->count || delta < lat->min_ns)
+    	lat->min_ns = delta;
+    lat->count++;
+    lat->total_ns += delta;
+    lat->hist[lat_bucket(delta)]++;
+}
+
+static void merge_latency(struct io_latency *dst, struct io_latency *src)
+{
+    int b;
+
+    if (!src->count)
+	return;
+    if (!dst->count || src->min_ns < dst->min_ns)
+	dst->min_ns = src->min_ns;
+    if (src->max_ns > dst->max_ns)
+	dst->max_ns = src->max_ns;
+    dst->count += src->count;
+    dst->total_ns += src->total_ns;
+    for (b = 0 ; b < LAT_BUCKETS ; b++)
+	dst->hist[b] += src->hist[b];
 }
 
 static void oper_list_add(struct io_oper *oper, struct io_oper **list)
@@ -313,19 +445,197 @@ static void oper_list_del(struct io_oper *oper, struct io_oper **list)
         *list = oper->next;
 }
 
+static inline uint64_t verify_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * the pattern for one block.  The body words are the key xor a per word
+ * salt, so gcc vectorises this and verify_block_bad
+ */
+static void verify_fill(uint64_t *w, uint64_t off, uint64_t id)
+{
+    uint64_t key = verify_mix(off ^ verify_mix(id ^ VERIFY_MAGIC));
+    size_t i;
+
+    w[0] = off;
+    w[1] = id;
+    w[2] = VERIFY_MAGIC;
+    w[3] = verify_run;
+    for (i = VERIFY_HDR_WORDS ; i < VERIFY_WORDS ; i++)
+	w[i] = key ^ verify_salt[i];
+}
+
+/*
+ * returns the index of the first word in the block that isn't as block
+ * off, id, written by run, would have it, or -1
+ */
+static int verify_block_bad(uint64_t *w, uint64_t off, uint64_t id,
+			    uint64_t run)
+{
+    uint64_t key = verify_mix(off ^ verify_mix(id ^ VERIFY_MAGIC));
+    uint64_t hdr[VERIFY_HDR_WORDS] = { off, id, VERIFY_MAGIC, run };
+    uint64_t diff = 0;
+    size_t i;
+
+    for (i = 0 ; i < VERIFY_HDR_WORDS ; i++)
+	diff |= w[i] ^ hdr[i];
+    for (i = VERIFY_HDR_WORDS ; i < VERIFY_WORDS ; i++)
+	diff |= w[i] ^ key ^ verify_salt[i];
+    if (!diff)
+	return -1;
+    for (i = 0 ; i < VERIFY_HDR_WORDS ; i++)
+	if (w[i] != hdr[i])
+	    return i;
+    for (i = VERIFY_HDR_WORDS ; i < VERIFY_WORDS ; i++)
+	if (w[i] != (key ^ verify_salt[i]))
+	    break;
+    return i;
+}
+
+static int verify_block_zero(uint64_t *w)
+{
+    uint64_t any = 0;
+    size_t i;
+
+    for (i = 0 ; i < VERIFY_WORDS ; i++)
+	any |= w[i];
+    return !any;
+}
+
+static inline uint64_t verify_id(struct verify_file *vf, int pass)
+{
+    return ((uint64_t)vf->id << 32) | pass;
+}
+
+/* the blocks an io covers, zero if it doesn't fit the file's table */
+static int verify_range(struct io_unit *io, long *first, long *n)
+{
+    struct verify_file *vf = io->io_oper->vfile;
+
+    *first = io->iocb.u.c.offset / VERIFY_BLOCK;
+    *n = io->iocb.u.c.nbytes / VERIFY_BLOCK;
+    return *first + *n <= vf->nblocks;
+}
+
+/*
+ * called as an io is built: marks its blocks busy and, for a write,
+ * moves them on to the next pass and fills the buffer with it
+ */
+static void verify_prep(struct io_unit *io)
+{
+    struct verify_file *vf = io->io_oper->vfile;
+    uint64_t *w = (uint64_t *)io->buf;
+    long first, n, b;
+    int busy = 0;
+    int pass;
+
+    if (!verify_range(io, &first, &n)) {
+	io->verify_skip = 1;
+	return;
+    }
+    if (vf->shared)
+	pthread_mutex_lock(&vf->lock);
+    for (b = first ; b < first + n ; b++)
+	busy |= vf->busy[b]++;
+    io->verify_skip = busy;
+    if (io->iocb.aio_lio_opcode == IO_CMD_PWRITE) {
+	for (b = first ; b < first + n ; b++, w += VERIFY_WORDS) {
+	    pass = vf->pass[b] >= VERIFY_MAX_PASS ? 1 : vf->pass[b] + 1;
+	    verify_fill(w, b * VERIFY_BLOCK, verify_id(vf, pass));
+	    vf->pass[b] = busy ? VERIFY_UNKNOWN : pass;
+	}
+    }
+    if (vf->shared)
+	pthread_mutex_unlock(&vf->lock);
+}
+
+/*
+ * called as an io completes: checks what a read found against the
+ * pass each block should be on, forgets what a failed write was to
+ * leave, and drops the busy counts
+ */
+static void verify_complete(struct io_unit *io)
+{
+    struct io_oper *oper = io->io_oper;
+    struct verify_file *vf = oper->vfile;
+    uint64_t *w = (uint64_t *)io->buf;
+    long first, n, b;
+    int pass;
+    int bad;
+
+    if (!verify_range(io, &first, &n))
+	return;
+    if (vf->shared)
+	pthread_mutex_lock(&vf->lock);
+    if (io->iocb.aio_lio_opcode == IO_CMD_PREAD && !io->verify_skip &&
+	io->res == io->iocb.u.c.nbytes) {
+	for (b = first ; b < first + n ; b++, w += VERIFY_WORDS) {
+	    pass = vf->pass[b];
+	    if (pass == VERIFY_UNKNOWN)
+		continue;
+	    if (pass)
+		bad = verify_block_bad(w, b * VERIFY_BLOCK,
+				       verify_id(vf, pass), verify_run);
+	    else if (!verify_block_zero(w))
+		/* left by an earlier run: any pass of that run will do */
+		bad = verify_block_bad(w, b * VERIFY_BLOCK,
+				       verify_id(vf, w[1] & 0xffffffff), w[3]);
+	    else
+		continue;
+	    if (bad < 0)
+		continue;
+	    fprintf(stderr, "verify error, file %s offset %llu: expected "
+		    "file %u pass %d, found file %llu offset %llu pass %llu"
+		    "%s, first bad byte %d\n", oper->file_name,
+		    (unsigned long long)b * VERIFY_BLOCK, vf->id, pass,
+		    (unsigned long long)(w[1] >> 32),
+		    (unsigned long long)w[0],
+		    (unsigned long long)(w[1] & 0xffffffff),
+		    w[2] != VERIFY_MAGIC ? " not written by -v" :
+		    w[3] != verify_run ? " from another run" : "",
+		    bad * (int)sizeof(uint64_t));
+	    oper->last_err = -EIO;
+	    oper->num_err++;
+	    break;
+	}
+    }
+    /* a write that failed or came up short left its blocks unknown */
+    if (io->iocb.aio_lio_opcode == IO_CMD_PWRITE &&
+	io->res != io->iocb.u.c.nbytes) {
+	for (b = first ; b < first + n ; b++)
+	    vf->pass[b] = VERIFY_UNKNOWN;
+    }
+    for (b = first ; b < first + n ; b++)
+	vf->busy[b]--;
+    if (vf->shared)
+	pthread_mutex_unlock(&vf->lock);
+}
+
 /* worker func to check error fields in the io unit */
 static int check_finished_io(struct io_unit *io) {
-    int i;
+    if (verify)
+	verify_complete(io);
     if (io->res != io->buf_size) {
 
   		 struct stat s;
-  		 fstat(io->io_oper->fd, &s);
+
+  		 if (io->submit_size >= 0)
+  		 		 s.st_size = io->submit_size;
+  		 else
+  		 		 fstat(io->io_oper->fd, &s);
   
   		 /*
   		  * If file size is large enough for the read, then this short
   		  * read is an error.
   		  */
-  		 if ((io->io_oper->rw == READ || io->io_oper->rw == RREAD) &&
+  		 if (io->iocb.aio_lio_opcode == IO_CMD_PREAD &&
   		     s.st_size > (io->iocb.u.c.offset + io->res)) {
   
   		 		 fprintf(stderr, "io err %lu (%s) op %d, off %Lu size %d\n",
@@ -336,20 +646,6 @@ static int check_finished_io(struct io_unit *io) {
   		 		 return -1;
   		 }
     }
-    if (verify && io->io_oper->rw == READ) {
-        if (memcmp(io->buf, verify_buf, io->io_oper->reclen)) {
-	    fprintf(stderr, "verify error, file %s offset %Lu contents (offset:bad:good):\n", 
-	            io->io_oper->file_name, io->iocb.u.c.offset);
-	    
-	    for (i = 0 ; i < io->io_oper->reclen ; i++) {
-	        if (io->buf[i] != verify_buf[i]) {
-		    fprintf(stderr, "%d:%c:%c ", i, io->buf[i], verify_buf[i]);
-		}
-	    }
-	    fprintf(stderr, "\n");
-	}
-
-    }
     return 0;
 }
 
@@ -374,6 +670,8 @@ char *stage_name(int rw) {
         return "random write";
     case RREAD:
         return "random read";
+    case MIXED:
+        return "mixed";
     }
     return "unknown";
 }
@@ -387,29 +685,72 @@ static void print_time(struct io_oper *oper) {
     double runtime;
     double tput;
     double mb;
+    char mix[64] = "";
 
     runtime = time_since_now(&oper->start_time); 
     mb = oper_mb_trans(oper);
     tput = mb / runtime;
-    fprintf(stderr, "%s on %s (%.2f MB/s) %.2f MB in %.2fs\n", 
-	    stage_name(oper->rw), oper->file_name, tput, mb, runtime);
+    if (oper->rw == MIXED)
+	snprintf(mix, sizeof(mix), " %d reads %d writes", oper->mixed_reads,
+		 oper->started_ios - oper->mixed_reads);
+    fprintf(stderr, "%s on %s (%.2f MB/s) %.2f MB in %.2fs%s\n", 
+	    stage_name(oper->rw), oper->file_name, tput, mb, runtime, mix);
 }
 
 static void print_lat(char *str, struct io_latency *lat) {
-    double avg = lat->total_lat / lat->total_io;
-    int i;
-    double total_counted = 0;
+    double avg = lat->count ? (double)lat->total_ns / lat->count : 0;
+
     fprintf(stderr, "%s min %.2f avg %.2f max %.2f\n\t", 
-            str, lat->min, avg, lat->max);
+            str, lat->min_ns / 1e6, avg / 1e6, lat->max_ns / 1e6);
+    fprintf(stderr, " p50 %.3f p99 %.3f p99.9 %.3f ms\n",
+	    lat_percentile(lat, 500) / 1e6, lat_percentile(lat, 990) / 1e6,
+	    lat_percentile(lat, 999) / 1e6);
+}
 
-    for (i = 0 ; i < DEVIATIONS ; i++) {
-	fprintf(stderr, " %.0f < %d", lat->deviations[i], deviations[i]);
-	total_counted += lat->deviations[i];
+/*
+ * json for one latency histogram.  count, total_ns and the sparse
+ * [bucket floor, count] pairs are enough to merge runs after the fact
+ */
+static void json_lat(FILE *fp, char *name, struct io_latency *lat) {
+    char *sep = "";
+    int b;
+
+    fprintf(fp, "\"%s\": {\"count\": %llu, \"total_ns\": %llu, "
+	    "\"min_ns\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+	    "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, "
+	    "\"hist\": [",
+	    name, lat->count, lat->total_ns, lat->min_ns,
+	    lat->count ? lat->total_ns / lat->count : 0,
+	    lat_percentile(lat, 500), lat_percentile(lat, 990),
+	    lat_percentile(lat, 999), lat->max_ns);
+    for (b = 0 ; b < LAT_BUCKETS ; b++) {
+	if (!lat->hist[b])
+	    continue;
+	fprintf(fp, "%s[%llu, %llu]", sep, lat_bucket_ns(b), lat->hist[b]);
+	sep = ", ";
     }
-    if (total_counted && lat->total_io - total_counted)
-        fprintf(stderr, " < %.0f", lat->total_io - total_counted);
-    fprintf(stderr, "\n");
-    memset(lat, 0, sizeof(*lat));
+    fprintf(fp, "]}");
+}
+
+/*
+ * one line of json with a stage's submit and completion latencies,
+ * thread is -1 for all the threads added together
+ */
+static void json_stage(int thread, char *stage, struct io_latency *submit,
+		       struct io_latency *completion)
+{
+    flockfile(json_fp);
+    if (thread < 0)
+	fprintf(json_fp, "{\"thread\": \"all\", ");
+    else
+	fprintf(json_fp, "{\"thread\": %d, ", thread);
+    fprintf(json_fp, "\"stage\": \"%s\", ", stage);
+    json_lat(json_fp, "submit", submit);
+    fprintf(json_fp, ", ");
+    json_lat(json_fp, "completion", completion);
+    fprintf(json_fp, "}\n");
+    fflush(json_fp);
+    funlockfile(json_fp);
 }
 
 static void print_latency(struct thread_info *t)
@@ -429,10 +770,10 @@ static void print_completion_latency(struct thread_info *t)
  * io unit, and make the io unit reusable again
  */
 void finish_io(struct thread_info *t, struct io_unit *io, long result,
-		struct timeval *tv_now) {
+		struct timespec *ts_now) {
     struct io_oper *oper = io->io_oper;
 
-    calc_latency(&io->io_start_time, tv_now, &t->io_completion_latency);
+    calc_latency(&io->io_start_time, ts_now, &t->io_completion_latency);
     io->res = result;
     io->busy = IO_FREE;
     io->next = t->free_ious;
@@ -447,26 +788,128 @@ void finish_io(struct thread_info *t, struct io_unit *io, long result,
     } 
 }
 
+#ifdef URING
+/*
+ * turn the iocb built for an io unit into an sqe.  The buffer index
+ * for -Q fixedbufs is the io unit's slot in t->ios, see uring_setup
+ */
+static void uring_prep(struct thread_info *t, struct io_uring_sqe *sqe,
+		       struct io_unit *io)
+{
+    struct iocb *iocb = &io->iocb;
+    int fd = iocb->aio_fildes;
+    int write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+
+    if (uring_flags & URING_FIXED_FILES)
+        fd = io->io_oper->file_index;
+    if (uring_flags & URING_FIXED_BUFS) {
+	if (write)
+	    io_uring_prep_write_fixed(sqe, fd, iocb->u.c.buf,
+				      iocb->u.c.nbytes, iocb->u.c.offset,
+				      io - t->ios);
+	else
+	    io_uring_prep_read_fixed(sqe, fd, iocb->u.c.buf,
+				     iocb->u.c.nbytes, iocb->u.c.offset,
+				     io - t->ios);
+    } else if (write) {
+	io_uring_prep_write(sqe, fd, iocb->u.c.buf, iocb->u.c.nbytes,
+			    iocb->u.c.offset);
+    } else {
+	io_uring_prep_read(sqe, fd, iocb->u.c.buf, iocb->u.c.nbytes,
+			   iocb->u.c.offset);
+    }
+    if (uring_flags & URING_FIXED_FILES)
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    io_uring_sqe_set_data(sqe, io);
+}
+
+/* io_submit for the ring: returns how many got queued, or -errno */
+static int uring_submit(struct thread_info *t, int nr, struct iocb **my_iocbs)
+{
+    struct io_uring_sqe *sqe;
+    int i;
+    int ret;
+
+    for (i = 0 ; i < nr ; i++) {
+	sqe = io_uring_get_sqe(&t->ring);
+	if (!sqe)
+	    break;
+	uring_prep(t, sqe, (struct io_unit *)my_iocbs[i]);
+    }
+    if (i == 0)
+        return -EAGAIN;
+    ret = io_uring_submit(&t->ring);
+    if (ret < 0)
+        return ret;
+    return i;
+}
+
+/*
+ * io_getevents for the ring: wait for min_nr completions, then take
+ * everything that is ready (up to nr) with one pass over the cq
+ */
+static int uring_getevents(struct thread_info *t, int min_nr, int nr,
+			   struct io_event *events)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+    int i;
+
+    if (min_nr) {
+	ret = io_uring_wait_cqe_nr(&t->ring, &cqe, min_nr);
+	if (ret < 0)
+	    return ret;
+    }
+    nr = io_uring_peek_batch_cqe(&t->ring, t->cqes, nr);
+    for (i = 0 ; i < nr ; i++) {
+	events[i].obj = io_uring_cqe_get_data(t->cqes[i]);
+	events[i].res = t->cqes[i]->res;	/* signed, see finish_io */
+    }
+    io_uring_cq_advance(&t->ring, nr);
+    return nr;
+}
+#endif
+
+/* send the iocbs down whichever engine the thread is using */
+static int submit_ios(struct thread_info *t, int nr, struct iocb **my_iocbs)
+{
+#ifdef URING
+    if (use_uring)
+	return uring_submit(t, nr, my_iocbs);
+#endif
+    return io_submit(t->io_ctx, nr, my_iocbs);
+}
+
+static int get_events(struct thread_info *t, int min_nr, int nr,
+		      struct io_event *events)
+{
+#ifdef URING
+    if (use_uring)
+	return uring_getevents(t, min_nr, nr, events);
+#endif
+#ifdef NEW_GETEVENTS
+    return io_getevents(t->io_ctx, min_nr, nr, events, NULL);
+#else
+    return io_getevents(t->io_ctx, nr, events, NULL);
+#endif
+}
+
 int read_some_events(struct thread_info *t) {
     struct io_unit *event_io;
     struct io_event *event;
     int nr;
     int i; 
     int min_nr = io_iter;
-    struct timeval stop_time;
+    struct timespec stop_time;
 
     if (t->num_global_pending < io_iter)
         min_nr = t->num_global_pending;
 
-#ifdef NEW_GETEVENTS
-    nr = io_getevents(t->io_ctx, min_nr, t->num_global_events, t->events,NULL);
-#else
-    nr = io_getevents(t->io_ctx, t->num_global_events, t->events, NULL);
-#endif
+    nr = get_events(t, min_nr, t->num_global_events, t->events);
     if (nr <= 0)
         return nr;
 
-    gettimeofday(&stop_time, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stop_time);
     for (i = 0 ; i < nr ; i++) {
 	event = t->events + i;
 	event_io = (struct io_unit *)((unsigned long)event->obj); 
@@ -519,16 +962,12 @@ static int io_oper_wait(struct thread_info *t, struct io_oper *oper) {
     /* this func is not speed sensitive, no need to go wild reading
      * more than one event at a time
      */
-#ifdef NEW_GETEVENTS
-    while(io_getevents(t->io_ctx, 1, 1, &event, NULL) > 0) {
-#else
-    while(io_getevents(t->io_ctx, 1, &event, NULL) > 0) {
-#endif
-	struct timeval tv_now;
+    while(get_events(t, 1, 1, &event) > 0) {
+	struct timespec ts_now;
         event_io = (struct io_unit *)((unsigned long)event.obj); 
 
-	gettimeofday(&tv_now, NULL);
-	finish_io(t, event_io, event.res, &tv_now);
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	finish_io(t, event_io, event.res, &ts_now);
 
 	if (oper->num_pending == 0)
 	    break;
@@ -541,13 +980,18 @@ done:
     return 0;
 }
 
-off_t random_byte_offset(struct io_oper *oper) {
+static int percent_chance(int pct) {
+    return (int)(100.0 * rand() / (RAND_MAX + 1.0)) < pct;
+}
+
+/* a random page aligned offset for a record between start and end */
+static off_t random_offset_in(struct io_oper *oper, off_t start, off_t end) {
     off_t num;
-    off_t rand_byte = oper->start;
+    off_t rand_byte = start;
     off_t range;
     off_t offset = 1;
 
-    range = (oper->end - oper->start) / (1024 * 1024);
+    range = (end - start) / (1024 * 1024);
     if ((page_size_mask+1) > (1024 * 1024))
         offset = (page_size_mask+1) / (1024 * 1024);
     if (range < offset)
@@ -566,12 +1010,49 @@ off_t random_byte_offset(struct io_oper *oper) {
     num = (num + page_size_mask) & ~page_size_mask;
     rand_byte += num;
 
-    if (rand_byte + oper->reclen > oper->end) {
+    if (rand_byte + oper->reclen > end) {
 	rand_byte -= oper->reclen;
     }
     return rand_byte;
 }
 
+/*
+ * a page aligned offset anywhere in start..end that leaves room for a
+ * whole record, or start when there is no room
+ */
+static off_t random_page_in(struct io_oper *oper, off_t start, off_t end) {
+    off_t slots;
+
+    if (end - start < oper->reclen)
+	return start;
+    slots = (end - start - oper->reclen) / (page_size_mask + 1) + 1;
+    slots = (off_t)((double)slots * rand() / (RAND_MAX + 1.0));
+    return start + slots * (page_size_mask + 1);
+}
+
+/* 
+ * with -k, skew_ios percent of the random offsets land in the first
+ * skew_area percent of the oper's range and the rest in what's after it.
+ * The hot area ends on a record and page boundary so both stay aligned.
+ */
+off_t random_byte_offset(struct io_oper *oper) {
+    off_t hot_len;
+    off_t len = oper->end - oper->start;
+
+    if (!skew_ios)
+	return random_offset_in(oper, oper->start, oper->end);
+    hot_len = len / 100 * skew_area;
+    hot_len -= hot_len % oper->reclen;
+    hot_len &= ~(off_t)page_size_mask;
+    if (hot_len < oper->reclen)
+	hot_len = (oper->reclen + page_size_mask) & ~(off_t)page_size_mask;
+    if (hot_len > len)
+	hot_len = len;
+    if (percent_chance(skew_ios))
+	return random_page_in(oper, oper->start, oper->start + hot_len);
+    return random_page_in(oper, oper->start + hot_len, oper->end);
+}
+
 /* 
  * build an aio iocb for an operation, based on oper->rw and the
  * last offset used.  This finds the struct io_unit that will be attached
@@ -591,6 +1072,7 @@ static struct io_unit *build_iocb(struct thread_info *t, struct io_oper *oper)
 	return NULL;
     }
 
+    io->submit_size = -1;
     switch(oper->rw) {
     case WRITE:
         io_prep_pwrite(&io->iocb,oper->fd, io->buf, oper->reclen, 
@@ -615,6 +1097,48 @@ static struct io_unit *build_iocb(struct thread_info *t, struct io_oper *oper)
 	              rand_byte);
         
         break;
+    case MIXED:
+	/* the sequential ios carry on from each other, wrapping at the end */
+	if (percent_chance(mixed_random)) {
+	    rand_byte = random_byte_offset(oper);
+	} else {
+	    if (oper->last_offset + oper->reclen > oper->end)
+		oper->last_offset = oper->start;
+	    rand_byte = oper->last_offset;
+	    oper->last_offset += oper->reclen;
+	}
+	if (percent_chance(mixed_reads)) {
+	    io_prep_pread(&io->iocb, oper->fd, io->buf, oper->reclen,
+			  rand_byte);
+	    oper->mixed_reads++;
+	    if (rand_byte + oper->reclen > oper->size_seen) {
+		struct stat s;
+
+		if (fstat(oper->fd, &s) == 0 && s.st_size > oper->size_seen)
+		    oper->size_seen = s.st_size;
+	    }
+	    io->submit_size = oper->size_seen;
+	} else {
+	    io_prep_pwrite(&io->iocb, oper->fd, io->buf, oper->reclen,
+			   rand_byte);
+	}
+	break;
+    }
+
+    if (verify)
+	verify_prep(io);
+
+    /* 
+     * the sync goes out before this write is submitted, so it covers
+     * the sync_interval writes sent ahead of it
+     */
+    if (sync_interval && io->iocb.aio_lio_opcode == IO_CMD_PWRITE &&
+	++oper->writes_since_sync >= sync_interval) {
+	if (sync_data)
+	    fdatasync(oper->fd);
+	else
+	    fsync(oper->fd);
+	oper->writes_since_sync = 0;
     }
 
     return io;
@@ -703,7 +1227,7 @@ int build_oper(struct thread_info *t, struct io_oper *oper, int num_ios,
  * counters in the associated oper struct
  */
 static void update_iou_counters(struct iocb **my_iocbs, int nr,
-	struct timeval *tv_now) 
+	struct timespec *ts_now) 
 {
     struct io_unit *io;
     int i;
@@ -711,7 +1235,7 @@ static void update_iou_counters(struct iocb **my_iocbs, int nr,
 	io = (struct io_unit *)(my_iocbs[i]);
 	io->io_oper->num_pending++;
 	io->io_oper->started_ios++;
-	io->io_start_time = *tv_now;	/* set time of io_submit */
+	io->io_start_time = *ts_now;	/* set time of io_submit */
     }
 }
 
@@ -719,13 +1243,13 @@ static void update_iou_counters(struct iocb **my_iocbs, int nr,
 int run_built(struct thread_info *t, int num_ios, struct iocb **my_iocbs) 
 {
     int ret;
-    struct timeval start_time;
-    struct timeval stop_time;
+    struct timespec start_time;
+    struct timespec stop_time;
 
 resubmit:
-    gettimeofday(&start_time, NULL);
-    ret = io_submit(t->io_ctx, num_ios, my_iocbs);
-    gettimeofday(&stop_time, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    ret = submit_ios(t, num_ios, my_iocbs);
+    clock_gettime(CLOCK_MONOTONIC, &stop_time);
     calc_latency(&start_time, &stop_time, &t->io_submit_latency);
 
     if (ret != num_ios) {
@@ -778,12 +1302,17 @@ static int restart_oper(struct io_oper *oper) {
     case RWRITE:
 	if (!new_rw && stages & (1 << RREAD))
 	    new_rw = RREAD;
+    case RREAD:
+	if (!new_rw && stages & (1 << MIXED))
+	    new_rw = MIXED;
     }
 
     if (new_rw) {
 	oper->started_ios = 0;
 	oper->last_offset = oper->start;
 	oper->stonewalled = 0;
+	oper->mixed_reads = 0;
+	oper->size_seen = 0;
 
 	/* 
 	 * we're restarting an operation with pending requests, so the
@@ -903,6 +1432,309 @@ void aio_setup(io_context_t *io_ctx, int n)
     }
 }
 
+#ifdef URING
+/*
+ * one ring per thread, big enough for every io unit the thread owns.
+ * Each io unit's buffer is registered at its index in t->ios, and each
+ * oper's fd at oper->file_index
+ */
+void uring_setup(struct thread_info *t)
+{
+    struct io_uring_params p;
+    struct io_oper *oper;
+    int res;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if (uring_flags & URING_SQPOLL)
+	p.flags |= IORING_SETUP_SQPOLL;
+    if (uring_flags & URING_IOPOLL)
+	p.flags |= IORING_SETUP_IOPOLL;
+    res = io_uring_queue_init_params(t->num_global_ios, &t->ring, &p);
+    if (res) {
+	fprintf(stderr, "io_uring_queue_init_params(%d) returned %d (%s)\n",
+		t->num_global_ios, res, strerror(-res));
+	exit(3);
+    }
+    t->cqes = malloc(sizeof(*t->cqes) * t->num_global_events);
+    if (!t->cqes) {
+	fprintf(stderr, "unable to allocate ram for cqes\n");
+	exit(3);
+    }
+
+    if (uring_flags & URING_FIXED_BUFS) {
+	struct iovec *iov = malloc(sizeof(*iov) * t->num_global_ios);
+
+	if (!iov) {
+	    fprintf(stderr, "unable to allocate iovecs\n");
+	    exit(3);
+	}
+	for (i = 0 ; i < t->num_global_ios ; i++) {
+	    iov[i].iov_base = t->ios[i].buf;
+	    iov[i].iov_len = t->ios[i].buf_size;
+	}
+	res = io_uring_register_buffers(&t->ring, iov, t->num_global_ios);
+	free(iov);
+	if (res) {
+	    fprintf(stderr, "io_uring_register_buffers returned %d (%s)\n",
+		    res, strerror(-res));
+	    exit(3);
+	}
+    }
+
+    if (uring_flags & URING_FIXED_FILES) {
+	int *fds = malloc(sizeof(*fds) * t->num_files);
+
+	if (!fds) {
+	    fprintf(stderr, "unable to allocate file table\n");
+	    exit(3);
+	}
+	i = 0;
+	oper = t->active_opers;
+	do {
+	    oper->file_index = i;
+	    fds[i++] = oper->fd;
+	    oper = oper->next;
+	} while (oper != t->active_opers);
+	res = io_uring_register_files(&t->ring, fds, i);
+	free(fds);
+	if (res) {
+	    fprintf(stderr, "io_uring_register_files returned %d (%s)\n",
+		    res, strerror(-res));
+	    exit(3);
+	}
+    }
+}
+#endif
+
+/* parses a list like 0-3,8,10-11 into ids, returns how many there were */
+static int parse_id_list(char *list, int *ids, int max)
+{
+    char *p = list;
+    int lo, hi;
+    int n = 0;
+
+    while (*p && n < max) {
+	lo = hi = strtol(p, &p, 10);
+	if (*p == '-')
+	    hi = strtol(p + 1, &p, 10);
+	while (lo <= hi && n < max)
+	    ids[n++] = lo++;
+	if (*p != ',')
+	    break;
+	p++;
+    }
+    return n;
+}
+
+static int read_id_list(char *path, int *ids, int max)
+{
+    char buf[4096];
+    FILE *f;
+    int n = 0;
+
+    f = fopen(path, "r");
+    if (!f)
+	return 0;
+    if (fgets(buf, sizeof(buf), f))
+	n = parse_id_list(buf, ids, max);
+    fclose(f);
+    return n;
+}
+
+/*
+ * -A cpu=list or node=list: the list has to parse all the way through
+ * and name only online cpus or nodes.  Returns an error message or NULL.
+ */
+static char *check_pin_list(char *list)
+{
+    static char msg[64];
+    int ids[CPU_SETSIZE], online[CPU_SETSIZE];
+    char *p = list;
+    char *end;
+    long lo, hi;
+    int n, nonline;
+    int i, j;
+
+    while (1) {
+	lo = hi = strtol(p, &end, 10);
+	if (end == p || lo < 0)
+	    return "bad list";
+	if (*end == '-') {
+	    p = end + 1;
+	    hi = strtol(p, &end, 10);
+	    if (end == p || hi < lo)
+		return "bad range";
+	}
+	if (hi >= CPU_SETSIZE)
+	    return "id too large";
+	if (*end != ',')
+	    break;
+	p = end + 1;
+    }
+    if (*end)
+	return "bad list";
+
+    n = parse_id_list(list, ids, CPU_SETSIZE);
+    nonline = read_id_list(pin_mode == PIN_CPU ?
+			   "/sys/devices/system/cpu/online" :
+			   "/sys/devices/system/node/online",
+			   online, CPU_SETSIZE);
+    /* nothing to check against */
+    if (nonline <= 0)
+	return NULL;
+    for (i = 0 ; i < n ; i++) {
+	for (j = 0 ; j < nonline && online[j] != ids[i] ; j++)
+	    ;
+	if (j == nonline) {
+	    snprintf(msg, sizeof(msg), "%s %d is not online",
+		     pin_mode == PIN_CPU ? "cpu" : "node", ids[i]);
+	    return msg;
+	}
+    }
+    return NULL;
+}
+
+static int cpu_node(int cpu)
+{
+    char path[64];
+    int node;
+
+    for (node = 0 ; node < CPU_SETSIZE ; node++) {
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d",
+		 cpu, node);
+	if (access(path, F_OK) == 0)
+	    return node;
+    }
+    return 0;
+}
+
+/* decides the cpu or node for each thread, worker() does the pinning */
+void setup_placement(struct thread_info *t, int num_threads)
+{
+    int ids[CPU_SETSIZE];
+    int n;
+    int i;
+
+    for (i = 0 ; i < num_threads ; i++)
+	t[i].cpu = t[i].node = -1;
+    if (pin_mode == PIN_NONE)
+	return;
+
+    if (pin_list)
+	n = parse_id_list(pin_list, ids, CPU_SETSIZE);
+    else if (pin_mode == PIN_CPU)
+	n = read_id_list("/sys/devices/system/cpu/online", ids, CPU_SETSIZE);
+    else if (!(n = read_id_list("/sys/devices/system/node/has_cpu", ids,
+				CPU_SETSIZE)))
+	n = read_id_list("/sys/devices/system/node/online", ids, CPU_SETSIZE);
+    if (n <= 0) {
+	fprintf(stderr, "no %ss to run threads on\n",
+		pin_mode == PIN_CPU ? "cpu" : "node");
+	exit(1);
+    }
+
+    for (i = 0 ; i < num_threads ; i++) {
+	if (pin_mode == PIN_CPU) {
+	    t[i].cpu = ids[i % n];
+	    t[i].node = cpu_node(t[i].cpu);
+	    fprintf(stderr, "thread %d on cpu %d node %d\n", i, t[i].cpu,
+		    t[i].node);
+	} else {
+	    t[i].node = ids[i % n];
+	    fprintf(stderr, "thread %d on node %d\n", i, t[i].node);
+	}
+    }
+}
+
+static void pin_thread(struct thread_info *t)
+{
+    int ids[CPU_SETSIZE];
+    char path[64];
+    cpu_set_t cpus;
+    int ret;
+    int n;
+    int i;
+
+    CPU_ZERO(&cpus);
+    if (t->cpu >= 0) {
+	CPU_SET(t->cpu, &cpus);
+    } else {
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 t->node);
+	n = read_id_list(path, ids, CPU_SETSIZE);
+	for (i = 0 ; i < n ; i++)
+	    CPU_SET(ids[i], &cpus);
+    }
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret) {
+	fprintf(stderr, "pthread_setaffinity_np thread %d: %s\n",
+		(int)(t - global_thread_info), strerror(ret));
+	exit(1);
+    }
+}
+
+static long hugepage_size(void)
+{
+    char buf[64];
+    long kb = 0;
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (!f)
+	return 2 * 1024 * 1024;
+    while (fgets(buf, sizeof(buf), f))
+	if (sscanf(buf, "Hugepagesize: %ld kB", &kb) == 1)
+	    break;
+    fclose(f);
+    return kb ? kb * 1024 : 2 * 1024 * 1024;
+}
+
+/*
+ * a thread's own io buffers for -A and -H.  The memory policy is set
+ * before anything touches the pages, so they land on the thread's node
+ * even though setup_ious runs on the main thread.  Without hugetlb pages
+ * reserved, -H settles for transparent hugepages
+ */
+static char *thread_buffers(struct thread_info *t, size_t bytes)
+{
+    unsigned long mask[CPU_SETSIZE / (8 * sizeof(long))];
+    char *p = MAP_FAILED;
+    long huge;
+
+    if (use_hugepages) {
+	huge = hugepage_size();
+	bytes = (bytes + huge - 1) / huge * huge;
+	p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p == MAP_FAILED) {
+	    fprintf(stderr, "no hugetlb pages (%s), using transparent "
+		    "hugepages\n", strerror(errno));
+	    p = mmap(NULL, bytes + huge, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (p != MAP_FAILED) {
+		p = (char *)(((uintptr_t)p + huge - 1) & ~(huge - 1));
+		madvise(p, bytes, MADV_HUGEPAGE);
+	    }
+	}
+    } else {
+	p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+	perror("mmap io buffers");
+	return NULL;
+    }
+
+    if (t->node >= 0 && t->node < CPU_SETSIZE) {
+	memset(mask, 0, sizeof(mask));
+	mask[t->node / (8 * sizeof(long))] |= 1UL << (t->node % (8 * sizeof(long)));
+	if (syscall(__NR_mbind, p, bytes, MPOL_BIND, mask, CPU_SETSIZE, 0))
+	    fprintf(stderr, "mbind node %d: %s\n", t->node, strerror(errno));
+    }
+    return p;
+}
+
 /*
  * allocate io operation and event arrays for a given thread
  */
@@ -919,21 +1751,23 @@ int setup_ious(struct thread_info *t,
     }
     memset(t->ios, 0, bytes);
 
+    if (pin_mode != PIN_NONE || use_hugepages) {
+	aligned_buffer = thread_buffers(t, (size_t)num_files * depth *
+					padded_reclen);
+	if (!aligned_buffer) {
+	    free(t->ios);
+	    return -1;
+	}
+    }
+
     for (i = 0 ; i < depth * num_files; i++) {
 	t->ios[i].buf = aligned_buffer;
 	aligned_buffer += padded_reclen;
 	t->ios[i].buf_size = reclen;
-	if (verify)
-	    memset(t->ios[i].buf, 'b', reclen);
-	else
-	    memset(t->ios[i].buf, 0, reclen);
+	memset(t->ios[i].buf, 0, reclen);
 	t->ios[i].next = t->free_ious;
 	t->free_ious = t->ios + i;
     }
-    if (verify) {
-        verify_buf = aligned_buffer;
-        memset(verify_buf, 'b', reclen);
-    }
 
     t->iocbs = malloc(sizeof(struct iocb *) * max_io_submit);
     if (!t->iocbs) {
@@ -980,8 +1814,6 @@ int setup_shared_mem(int num_threads, int num_files, int depth,
     padded_reclen = (reclen + page_size_mask) / (page_size_mask+1);
     padded_reclen = padded_reclen * (page_size_mask+1);
     total_ram = num_files * depth * padded_reclen + num_threads;
-    if (verify)
-    	total_ram += padded_reclen;
 
     if (use_shm == USE_MALLOC) {
 	p = malloc(total_ram + page_size_mask);
@@ -1036,6 +1868,28 @@ free_buffers:
     return -1;
 }
 
+/* what the threads on each node moved in the stage, for -A */
+static void node_throughput(char *this_stage, double runtime) {
+    struct thread_info *t = global_thread_info;
+    double mb;
+    int i;
+    int j;
+
+    for (i = 0 ; i < num_threads ; i++) {
+	for (j = 0 ; j < i ; j++)
+	    if (t[j].node == t[i].node)
+		break;
+	if (j < i)
+	    continue;
+	mb = 0;
+	for (j = i ; j < num_threads ; j++)
+	    if (t[j].node == t[i].node)
+		mb += t[j].stage_mb_trans;
+	fprintf(stderr, "node %d %s throughput (%.2f MB/s) %.2f MB\n",
+		t[i].node, this_stage, mb / runtime, mb);
+    }
+}
+
 /*
  * runs through all the thread_info structs and calculates a combined
  * throughput
@@ -1059,9 +1913,30 @@ void global_thread_throughput(struct thread_info *t, char *this_stage) {
 	    fprintf(stderr, " min transfer %.2fMB", min_trans);
         fprintf(stderr, "\n");
     }
+    if (total_mb && pin_mode != PIN_NONE)
+	node_throughput(this_stage, runtime);
 }
 
 
+/*
+ * adds up every thread's latencies for the stage that just finished,
+ * called with stage_mutex held by the last thread to get there
+ */
+void json_all_threads(char *this_stage) {
+    struct io_latency submit;
+    struct io_latency completion;
+    int i;
+
+    memset(&submit, 0, sizeof(submit));
+    memset(&completion, 0, sizeof(completion));
+    for (i = 0 ; i < num_threads ; i++) {
+	merge_latency(&submit, &global_thread_info[i].io_submit_latency);
+	merge_latency(&completion,
+		      &global_thread_info[i].io_completion_latency);
+    }
+    json_stage(-1, this_stage ? this_stage : "none", &submit, &completion);
+}
+
 /* this is the meat of the state machine.  There is a list of
  * active operations structs, and as each one finishes the required
  * io it is moved to a list of finished operations.  Once they have
@@ -1080,6 +1955,14 @@ int worker(struct thread_info *t)
     int iteration = 0;
     int cnt;
 
+    if (pin_mode != PIN_NONE)
+	pin_thread(t);
+
+#ifdef URING
+    if (use_uring)
+	uring_setup(t);
+    else
+#endif
     aio_setup(&t->io_ctx, 512);
 
 restart:
@@ -1114,11 +1997,6 @@ restart:
         }
 	cnt++;
     }
-    if (latency_stats)
-        print_latency(t);
-
-    if (completion_latency_stats)
-	print_completion_latency(t);
 
     /* then we wait for all the operations to finish */
     oper = t->finished_opers;
@@ -1129,6 +2007,16 @@ restart:
 	oper = oper->next;
     } while(oper != t->finished_opers);
 
+    if (latency_stats)
+        print_latency(t);
+
+    if (completion_latency_stats)
+	print_completion_latency(t);
+
+    if (json_fp)
+	json_stage(t - global_thread_info, this_stage ? this_stage : "none",
+		   &t->io_submit_latency, &t->io_completion_latency);
+
     /* then we do an fsync to get the timing for any future operations
      * right, and check to see if any of these need to get restarted
      */
@@ -1162,11 +2050,15 @@ restart:
 	    threads_starting = 0;
 	    pthread_cond_broadcast(&stage_cond);
 	    global_thread_throughput(t, this_stage);
+	    if (json_fp)
+		json_all_threads(this_stage);
 	}
 	while(threads_ending != num_threads)
 	    pthread_cond_wait(&stage_cond, &stage_mutex);
 	pthread_mutex_unlock(&stage_mutex);
     }
+    memset(&t->io_submit_latency, 0, sizeof(t->io_submit_latency));
+    memset(&t->io_completion_latency, 0, sizeof(t->io_completion_latency));
     
     /* someone got restarted, go back to the beginning */
     if (t->active_opers && (cnt < iterations || iterations == RUN_FOREVER)) {
@@ -1178,38 +2070,58 @@ restart:
     while(t->finished_opers) {
 	oper = t->finished_opers;
 	oper_list_del(oper, &t->finished_opers);
-	status = finish_oper(t, oper);
+	if (finish_oper(t, oper))
+	    status = 1;
     }
 
     if (t->num_global_pending) {
         fprintf(stderr, "global num pending is %d\n", t->num_global_pending);
     }
+#ifdef URING
+    if (use_uring) {
+	io_uring_queue_exit(&t->ring);
+	free(t->cqes);
+    } else
+#endif
     io_queue_release(t->io_ctx);
     
     return status;
 }
 
-typedef void * (*start_routine)(void *);
+/* run worker() as a thread, handing back its status through pthread_join */
+static void *worker_thread(void *arg)
+{
+    return (void *)(long)worker(arg);
+}
+
+/*
+ * run num_threads workers and wait for them all.  returns nonzero if
+ * any of them hit an error
+ */
 int run_workers(struct thread_info *t, int num_threads)
 {
+    void *res;
+    int status = 0;
     int ret;
     int i;
 
     for(i = 0 ; i < num_threads ; i++) {
-        ret = pthread_create(&t[i].tid, NULL, (start_routine)worker, t + i);
+        ret = pthread_create(&t[i].tid, NULL, worker_thread, t + i);
 	if (ret) {
 	    perror("pthread_create");
 	    exit(1);
 	}
     }
     for(i = 0 ; i < num_threads ; i++) {
-        ret = pthread_join(t[i].tid, NULL);
+        ret = pthread_join(t[i].tid, &res);
         if (ret) {
 	    perror("pthread_join");
 	    exit(1);
 	}
+	if (res)
+	    status = 1;
     }
-    return 0;
+    return status;
 }
 
 off_t parse_size(char *size_arg, off_t mult) {
@@ -1245,7 +2157,9 @@ off_t parse_size(char *size_arg, off_t mult) {
 
 void print_usage(void) {
     printf("usage: aio-stress [-s size] [-r size] [-a size] [-d num] [-b num]\n");
-    printf("                  [-i num] [-t num] [-c num] [-C size] [-nxhOS ]\n");
+    printf("                  [-i num] [-t num] [-c num] [-C size] [-nxhOSU ]\n");
+    printf("                  [-Q opt] [-J file] [-M pct] [-R pct] [-k ios/area]\n");
+    printf("                  [-f num] [-F num] [-A cpu|node[=list]] [-H]\n");
     printf("                  file1 [file2 ...]\n");
     printf("\t-a size in KB at which to align buffers\n");
     printf("\t-b max number of iocbs to give io_submit at once\n");
@@ -1259,16 +2173,40 @@ void print_usage(void) {
     printf("\t-O Use O_DIRECT (not available in 2.4 kernels),\n");
     printf("\t-S Use O_SYNC for writes\n");
     printf("\t-o add an operation to the list: write=0, read=1,\n"); 
-    printf("\t   random write=2, random read=3.\n");
+    printf("\t   random write=2, random read=3, mixed=4.\n");
     printf("\t   repeat -o to specify multiple ops: -o 0 -o 1 etc.\n");
+    printf("\t-M percent of reads in the mixed stage, default 50\n");
+    printf("\t-R percent of random ios in the mixed stage, the rest are\n");
+    printf("\t   sequential, default 100\n");
+    printf("\t-k ios/area send ios percent of random ios to the first area\n");
+    printf("\t   percent of each file, -k 80/20 for an 80/20 skew\n");
+    printf("\t-f fsync each file after every num writes to it\n");
+    printf("\t-F like -f but with fdatasync\n");
+    printf("\t-A cpu pin thread n to the nth online cpu, round robin\n");
+    printf("\t-A node run thread n on the cpus of the nth node with cpus\n");
+    printf("\t   -A cpu=0-3,8 or -A node=1 picks from a list instead; either\n");
+    printf("\t   way each thread's buffers come from its own node, and\n");
+    printf("\t   throughput is reported per node\n");
+    printf("\t-H allocate each thread's io buffers from hugepages\n");
     printf("\t-m shm use ipc shared memory for io buffers instead of malloc\n");
     printf("\t-m shmfs mmap a file in /dev/shm for io buffers\n");
     printf("\t-n no fsyncs between write stage and read stage\n");
     printf("\t-l print io_submit latencies after each stage\n");
     printf("\t-L print io completion latencies after each stage\n");
+    printf("\t-J file write each stage's submit and completion latency\n");
+    printf("\t   histograms per thread as lines of json to file, - for stdout\n");
+    printf("\t-U use io_uring instead of libaio\n");
+    printf("\t-Q fixedbufs register the io buffers with io_uring\n");
+    printf("\t-Q fixedfiles register the files with io_uring\n");
+    printf("\t-Q sqpoll have a kernel thread poll the submission queue\n");
+    printf("\t-Q iopoll poll for completions, needs -O\n");
+    printf("\t   repeat -Q to combine them, each one implies -U\n");
     printf("\t-t number of threads to run\n");
     printf("\t-u unlink files after completion\n");
-    printf("\t-v verification of bytes written\n");
+    printf("\t-v verification of bytes written, every 512 byte block\n");
+    printf("\t   says which file, offset and pass it was written for;\n");
+    printf("\t   blocks this run hasn't written must be zeroes or be left\n");
+    printf("\t   by an earlier -v run on the same files in the same order\n");
     printf("\t-x turn off thread stonewalling\n");
     printf("\t-h this message\n");
     printf("\n\t   the size options (-a -s and -r) allow modifiers -s 400{k,m,g}\n");
@@ -1290,11 +2228,12 @@ int main(int ac, char **av)
     int num_files = 0;
     int open_fds = 0;
     struct thread_info *t;
+    struct verify_file *vfiles = NULL;
 
     page_size_mask = getpagesize() - 1;
 
     while(1) {
-	c = getopt(ac, av, "a:b:c:C:m:s:r:d:i:I:o:t:lLnhOSxvu");
+	c = getopt(ac, av, "a:b:c:C:m:s:r:d:i:I:o:t:lLnhOSxvuUQ:J:M:R:k:f:F:A:H");
 	if  (c < 0)
 	    break;
 
@@ -1335,6 +2274,16 @@ int main(int ac, char **av)
 	case 'L':
 	    completion_latency_stats = 1;
 	    break;
+	case 'J':
+	    if (!strcmp(optarg, "-"))
+		json_fp = stdout;
+	    else
+		json_fp = fopen(optarg, "w");
+	    if (!json_fp) {
+		perror(optarg);
+		exit(1);
+	    }
+	    break;
 	case 'm':
 	    if (!strcmp(optarg, "shm")) {
 		fprintf(stderr, "using ipc shm\n");
@@ -1367,6 +2316,72 @@ int main(int ac, char **av)
 	case 'v':
 	    verify = 1;
 	    break;
+	case 'M':
+	    mixed_reads = atoi(optarg);
+	    break;
+	case 'R':
+	    mixed_random = atoi(optarg);
+	    break;
+	case 'k':
+	    if (sscanf(optarg, "%d/%d", &skew_ios, &skew_area) != 2 ||
+		skew_ios < 0 || skew_ios > 100 ||
+		skew_area <= 0 || skew_area >= 100) {
+		fprintf(stderr, "-k wants ios/area, both percentages\n");
+		exit(1);
+	    }
+	    break;
+	case 'A':
+	    /* the whole keyword, then the end or =list */
+	    if (!strncmp(optarg, "cpu", 3) && strchr("=", optarg[3]))
+		pin_mode = PIN_CPU;
+	    else if (!strncmp(optarg, "node", 4) && strchr("=", optarg[4]))
+		pin_mode = PIN_NODE;
+	    else {
+		print_usage();
+		exit(1);
+	    }
+	    if (strchr(optarg, '=')) {
+		char *err;
+
+		pin_list = strchr(optarg, '=') + 1;
+		err = check_pin_list(pin_list);
+		if (err) {
+		    fprintf(stderr, "-A %s: %s\n", optarg, err);
+		    print_usage();
+		    exit(1);
+		}
+	    }
+	    break;
+	case 'H':
+	    use_hugepages = 1;
+	    break;
+	case 'F':
+	    sync_data = 1;
+	    /* fall through */
+	case 'f':
+	    sync_interval = atoi(optarg);
+	    break;
+	case 'Q':
+	    if (!strcmp(optarg, "fixedbufs"))
+		uring_flags |= URING_FIXED_BUFS;
+	    else if (!strcmp(optarg, "fixedfiles"))
+		uring_flags |= URING_FIXED_FILES;
+	    else if (!strcmp(optarg, "sqpoll"))
+		uring_flags |= URING_SQPOLL;
+	    else if (!strcmp(optarg, "iopoll"))
+		uring_flags |= URING_IOPOLL;
+	    else {
+		print_usage();
+		exit(1);
+	    }
+	    /* fall through */
+	case 'U':
+#ifndef URING
+	    fprintf(stderr, "io_uring support not compiled in\n");
+	    exit(1);
+#endif
+	    use_uring = 1;
+	    break;
 	case 'h':
 	default:
 	    print_usage();
@@ -1388,6 +2403,16 @@ int main(int ac, char **av)
 	exit(1);
     }
 
+    if ((pin_mode != PIN_NONE || use_hugepages) && use_shm != USE_MALLOC) {
+	fprintf(stderr, "-A and -H allocate their own buffers, not with -m\n");
+	exit(1);
+    }
+
+    if ((uring_flags & URING_IOPOLL) && !o_direct) {
+	fprintf(stderr, "-Q iopoll needs O_DIRECT (-O)\n");
+	exit(1);
+    }
+
     num_files = ac - optind;
 
     if (num_threads > (num_files * num_contexts)) {
@@ -1402,6 +2427,7 @@ int main(int ac, char **av)
 	exit(1);
     }
     global_thread_info = t;
+    setup_placement(t, num_threads);
 
     /* by default, allow a huge number of iocbs to be sent towards
      * io_submit
@@ -1435,6 +2461,34 @@ int main(int ac, char **av)
 	exit(1);
     }
 
+    if (verify) {
+	if (rec_len % VERIFY_BLOCK || context_offset % VERIFY_BLOCK) {
+	    fprintf(stderr, "-v needs -r and -C to be multiples of %d bytes\n",
+		    VERIFY_BLOCK);
+	    exit(1);
+	}
+	verify_run = ((uint64_t)time(NULL) << 32) ^ getpid();
+	for (i = 0 ; i < VERIFY_WORDS ; i++)
+	    verify_salt[i] = i * 0x9e3779b97f4a7c15ULL;
+	vfiles = calloc(num_files, sizeof(*vfiles));
+	if (!vfiles) {
+	    perror("calloc");
+	    exit(1);
+	}
+	for (i = 0 ; i < num_files ; i++) {
+	    vfiles[i].id = i;
+	    vfiles[i].nblocks = file_size / VERIFY_BLOCK;
+	    vfiles[i].pass = calloc(vfiles[i].nblocks, 1);
+	    vfiles[i].busy = calloc(vfiles[i].nblocks, sizeof(short));
+	    if (!vfiles[i].pass || !vfiles[i].busy) {
+		perror("calloc");
+		exit(1);
+	    }
+	    vfiles[i].shared = num_contexts > 1 && num_threads > 1;
+	    pthread_mutex_init(&vfiles[i].lock, NULL);
+	}
+    }
+
     fprintf(stderr, "file size %LuMB, record size %luKB, depth %d, ios per iteration %d\n",
 	    (unsigned long long)file_size / (1024 * 1024),
 	    rec_len / 1024, depth, io_iter);
@@ -1444,6 +2498,18 @@ int main(int ac, char **av)
             num_threads, num_files, num_contexts, 
 	    (unsigned long long)context_offset / (1024 * 1024),
 	    verify ? "on" : "off");
+    if (verify)
+	fprintf(stderr, "verification run %llx\n",
+		(unsigned long long)verify_run);
+    if (stages & (1 << MIXED))
+	fprintf(stderr, "mixed stage %d%% reads %d%% random\n",
+		mixed_reads, mixed_random);
+    if (use_uring)
+	fprintf(stderr, "io engine io_uring%s%s%s%s\n",
+		uring_flags & URING_FIXED_BUFS ? " fixedbufs" : "",
+		uring_flags & URING_FIXED_FILES ? " fixedfiles" : "",
+		uring_flags & URING_SQPOLL ? " sqpoll" : "",
+		uring_flags & URING_IOPOLL ? " iopoll" : "");
     /* open all the files and do any required setup for them */
     for (i = optind ; i < ac ; i++) {
 	int thread_index;
@@ -1461,11 +2527,16 @@ int main(int ac, char **av)
 		fprintf(stderr, "error in create_oper\n");
 		exit(-1);
 	    }
+	    if (verify)
+		oper->vfile = &vfiles[i - optind];
 	    oper_list_add(oper, &t[thread_index].active_opers);
 	    t[thread_index].num_files++;
 	}
     }
-    if (setup_shared_mem(num_threads, num_files * num_contexts, 
+    if (pin_mode != PIN_NONE || use_hugepages) {
+	/* each thread gets its own buffers from setup_ious */
+	padded_reclen = (rec_len + page_size_mask) & ~page_size_mask;
+    } else if (setup_shared_mem(num_threads, num_files * num_contexts, 
                          depth, rec_len, max_io_submit))
     {
         exit(1);
@@ -1476,7 +2547,7 @@ int main(int ac, char **av)
     }
     if (num_threads > 1){
         printf("Running multi thread version num_threads:%d\n", num_threads);
-        run_workers(t, num_threads);
+        status = run_workers(t, num_threads);
     } else {
         printf("Running single thread version \n");
 	status = worker(t);
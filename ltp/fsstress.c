@@ -4,13 +4,17 @@
  * All Rights Reserved.
  */
 
+#include <ctype.h>
 #include <linux/fs.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <sys/uio.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include "global.h"
+#include "latency.h"
 
 #ifdef HAVE_BTRFSUTIL_H
 #include <btrfsutil.h>
@@ -24,13 +28,13 @@
 #ifdef AIO
 #include <libaio.h>
 #define AIO_ENTRIES	1
-io_context_t	io_ctx;
+__thread io_context_t	io_ctx;
 #endif
 #ifdef URING
 #include <liburing.h>
 #define URING_ENTRIES	1
-struct io_uring	ring;
-bool have_io_uring;			/* to indicate runtime availability */
+__thread struct io_uring	ring;
+__thread bool have_io_uring;		/* to indicate runtime availability */
 #endif
 #include <sys/syscall.h>
 #include <sys/xattr.h>
@@ -167,10 +171,62 @@ typedef void (*opfnc_t)(opnum_t, long);
 typedef struct opdesc {
 	char	*name;
 	opfnc_t	func;
-	int	freq;
+	double	freq;
 	int	iswrite;
 } opdesc_t;
 
+/*
+ * One column of the alias table used to pick ops by weight: a column is
+ * chosen uniformly, then it yields op with probability thresh / (range of
+ * the remaining random bits) and alias otherwise.
+ */
+typedef struct freqent {
+	opty_t	op;
+	opty_t	alias;
+	long	thresh;
+} freqent_t;
+
+/*
+ * A distribution to draw sizes or offsets from (--io-size, --file-size,
+ * --offset).  a and b are its parameters; an empirical one is n values
+ * and their cumulative probabilities.
+ */
+enum {
+	DIST_NONE,
+	DIST_FIXED,		/* a */
+	DIST_UNIFORM,		/* a to b */
+	DIST_ZIPF,		/* exponent a over b items (or all) */
+	DIST_LOGNORMAL,		/* median a, sigma b */
+	DIST_EMPIRICAL,
+};
+
+typedef struct dist {
+	int	type;
+	double	a;
+	double	b;
+	int	n;
+	double	*val;
+	double	*cdf;
+} dist_t;
+
+/*
+ * One phase of a --profile: when it ends, which workers take part, the
+ * longest read or write it does, the sizes it draws and the op mix it
+ * picks from.
+ */
+typedef struct phase {
+	char		name[32];
+	opnum_t		ops;		/* per worker, or 0 */
+	int		duration;	/* seconds, or 0 */
+	int		workers;	/* the first this many, or all if 0 */
+	int		maxlen;		/* or FILELEN_MAX if 0 */
+	double		rate;		/* ops/sec in all, or --rate if 0 */
+	dist_t		io_dist;	/* or --io-size if DIST_NONE */
+	dist_t		fsize_dist;	/* or --file-size if DIST_NONE */
+	freqent_t	*freq_table;
+	int		freq_table_size;
+} phase_t;
+
 typedef struct fent {
 	int	id;
 	int	ft;
@@ -185,11 +241,156 @@ typedef struct flist {
 	fent_t	*fents;
 } flist_t;
 
+/*
+ * Index of file entries by id.  Each index entry also holds the ids of
+ * the entries whose parent it is, so that subtrees can be walked without
+ * scanning every flist.  An id which is not (or no longer) on any flist
+ * keeps its index entry, with ft == -1, for as long as it has children.
+ */
+typedef struct findex {
+	int	id;
+	int	ft;
+	int	slot;		/* index into flist[ft].fents */
+	int	pidx;		/* index into parent's children */
+	int	nchildren;
+	int	nchslots;
+	int	*children;
+	char	*path;		/* cached pathname of a directory */
+	int	pathgen;	/* dirpath_gen when path was built */
+	int	dirfd;		/* cached O_PATH fd of a directory */
+	int	dfslot;		/* index into dirfds */
+} findex_t;
+
+/*
+ * When dirfd is not -1 it is an O_PATH fd for the parent directory and
+ * path + leaf is the last component of the name, usable with *at() calls.
+ * Any change to the path invalidates it.
+ */
 typedef struct pathname {
 	int	len;
 	char	*path;
+	int	dirfd;
+	int	leaf;
 } pathname_t;
 
+/*
+ * What a worker has done of one op type.  These are kept in memory
+ * shared by all the workers so that the parent can report on them.
+ */
+typedef struct opstat {
+	unsigned long long	count;
+	unsigned long long	ns;		/* total latency */
+	unsigned long long	max_ns;
+	unsigned long long	hist[LAT_BUCKETS];
+} opstat_t;
+
+/*
+ * An op trace (--record-ops) is one file per worker: a header naming the
+ * worker's directory and the ops by name, then one record per op with the
+ * pathnames it used following it.  seq is global to the whole run so that
+ * a replay can put the workers' ops back in the order they were done.
+ */
+#define	TRACE_MAGIC	"FSSTRAC1"
+#define	TRACE_CLEANUP	OP_LAST		/* the -c rm -rf between loops */
+#define	TRACE_ALIGN(n)	(((n) + 7) & ~7)
+
+typedef struct trace_hdr {
+	char		magic[8];
+	uint32_t	dir;		/* worker's directory, p<dir> */
+	uint32_t	nops;		/* op names following */
+} trace_hdr_t;
+
+typedef struct trace_rec {
+	int64_t		seq;
+	int64_t		opno;
+	int64_t		off;
+	int64_t		off2;		/* or iovcnt, or gid */
+	int64_t		len;
+	int32_t		flags;		/* op's mode, or fill byte of a write */
+	int32_t		err;		/* errno it got, or 0 */
+	uint32_t	plen;		/* length of path, with its NUL */
+	uint32_t	plen2;
+	uint32_t	op;
+	uint32_t	pad;
+} trace_rec_t;
+
+/*
+ * What a worker saves with --state besides the tree itself, which is
+ * scanned to rebuild the file lists when it carries on.
+ */
+#define	STATE_MAGIC	"fsstress-state-1"
+#define	RNG_STATE_LEN	128		/* random() state kept in rng_state */
+
+typedef struct wstate {
+	int		nameseq;
+	int		namerand;
+	unsigned long	seed;
+	int32_t		rng[RNG_STATE_LEN / sizeof(int32_t)];
+} wstate_t;
+
+/*
+ * The --live-stats segment, /dev/shm/fsstress.<pid>, which --stats=<pid>
+ * reads from another process while the run goes on.  Each worker only
+ * ever writes its own live_worker_t, so sampling it costs them nothing.
+ */
+#define	LIVE_MAGIC	"FSSLIVE1"
+#define	LIVE_ERRNOS	134		/* errno 0 counts any above these */
+
+typedef struct live_worker {
+	uint64_t	ops;
+	uint64_t	errors;
+	int64_t		last_ns;	/* CLOCK_MONOTONIC at its last op */
+	int64_t		nfiles;		/* on its file lists */
+	int64_t		ndirs;
+	uint64_t	op_count[OP_LAST];
+	uint64_t	op_errors[OP_LAST];
+	uint64_t	err_count[LIVE_ERRNOS];
+} live_worker_t;
+
+typedef struct live_hdr {
+	char		magic[8];
+	uint32_t	nproc;
+	uint32_t	nops;
+	int64_t		start_ns;	/* CLOCK_MONOTONIC at start */
+	live_worker_t	workers[];
+} live_hdr_t;
+
+/*
+ * With --verify every block fsstress writes describes itself: where and
+ * by which write it went, and a checksum of the rest of it.  Reads check
+ * the blocks they get whole, as does a sweep of all the files at the end.
+ */
+#define	VERIFY_BLOCK	512
+#define	VERIFY_MAGIC	0x31565346	/* "FSV1" */
+#define	VERIFY_SWEEP_LEN	(1 << 20)
+
+typedef union vblock {
+	struct {
+		uint32_t	magic;
+		uint32_t	gen;		/* writer's count of blocks */
+		uint64_t	ino;
+		uint64_t	off;
+		uint64_t	csum;
+	}		h;
+	uint64_t	w[VERIFY_BLOCK / sizeof(uint64_t)];
+} vblock_t;
+
+#define	VERIFY_CSUM_WORD	(offsetof(vblock_t, h.csum) / sizeof(uint64_t))
+
+/*
+ * What each worker expects of the blocks of its files: the gen of the
+ * last write to each that it knows went out, 0 if it can't know.  An
+ * entry at VERIFY_MOVED marks a file that clone, copy, exchange, splice,
+ * collapse or insert moved blocks into, whose blocks may be anywhere.
+ */
+#define	VERIFY_MOVED	UINT64_MAX
+
+typedef struct vgen {
+	uint64_t	ino;
+	uint64_t	blk;
+	uint32_t	gen;
+} vgen_t;
+
 struct print_flags {
 	unsigned long mask;
 	const char *name;
@@ -220,13 +421,56 @@ struct print_string {
 #define	FT_ANYDIR	(FT_DIRm | FT_SUBVOLm)
 
 #define	FLIST_SLOT_INCR	16
-#define	NDCACHE	64
+#define	FINDEX_EMPTY	INT_MIN
+#define	FINDEX_SHIFT_MIN	8
+#define	NDIRFD		128
 
 #define	MAXFSIZE	((1ULL << 63) - 1ULL)
 #define	MAXFSIZE32	((1ULL << 40) - 1ULL)
 
 #define XATTR_NAME_BUF_SIZE 18
 
+#ifdef URING
+#define	AOP_BATCH	32
+
+/*
+ * With --uring-depth each worker keeps up to that many ops in flight
+ * through io_uring.  An op on names is a single request; one on file
+ * data opens the file, stats it if it needs the size, does the I/O and
+ * closes it again, each step issued from the completion of the last.
+ */
+typedef enum {
+	AOP_OPEN,
+	AOP_STAT,
+	AOP_IO,
+	AOP_CLOSE,
+} aop_stage_t;
+
+typedef struct aop {
+	opnum_t		opno;
+	opty_t		op;
+	aop_stage_t	stage;
+	int		v;
+	int		fd;
+	int		ft;
+	int		id;		/* entry operated on */
+	int		newid;		/* entry created, or exchanged with */
+	int		parid;
+	int		xattr_counter;
+	int		mode;		/* open, rename, xattr or falloc flags */
+	int		err;		/* first errno it hit */
+	pathname_t	f;
+	pathname_t	newf;
+	char		*buf;
+	size_t		len;
+	off64_t		off;
+	char		xname[XATTR_NAME_BUF_SIZE];
+	struct statx	stx;
+	struct timespec	start;
+	struct aop	*next;
+} aop_t;
+#endif
+
 void	afsync_f(opnum_t, long);
 void	aread_f(opnum_t, long);
 void	attr_remove_f(opnum_t, long);
@@ -365,93 +609,255 @@ struct opdesc	ops[OP_LAST]	= {
 	[OP_EXCHANGE_RANGE]= {"exchangerange", exchangerange_f,	2, 1 },
 }, *ops_end;
 
-flist_t	flist[FT_nft] = {
-	{ 0, 0, 'd', NULL },
-	{ 0, 0, 'f', NULL },
-	{ 0, 0, 'l', NULL },
-	{ 0, 0, 'c', NULL },
-	{ 0, 0, 'r', NULL },
-	{ 0, 0, 's', NULL },
+/*
+ * The files a worker knows about.  Each worker has its own, except that
+ * with --shared-namespace all the threads work on a single one.
+ */
+typedef struct nspace {
+	flist_t		flist[FT_nft];
+	findex_t	*findex;
+	int		findex_shift;
+	int		findex_used;
+	int		ftcount[FT_ANYm + 1];	/* files matching each mask */
+	int		dirpath_gen;
+	int		nameseq;
+	int		namerand;
+} nspace_t;
+
+nspace_t	nspace = {
+	.flist = {
+		{ 0, 0, 'd', NULL },
+		{ 0, 0, 'f', NULL },
+		{ 0, 0, 'l', NULL },
+		{ 0, 0, 'c', NULL },
+		{ 0, 0, 'r', NULL },
+		{ 0, 0, 's', NULL },
+	},
 };
-
-int		dcache[NDCACHE];
+__thread nspace_t	*nsp = &nspace;
+
+int		use_dirfds;
+__thread struct {
+	int	id;		/* directory holding this cached fd */
+	int	epoch;		/* dirfd_epoch when last handed out */
+}		dirfds[NDIRFD];
+__thread int	dirfd_next;
+__thread int	dirfd_epoch;
+int		use_threads;
+int		shared_nspace;
+int		uring_depth;
+#ifdef URING
+__thread aop_t	*aops;
+__thread aop_t	*aop_free;
+__thread int	aop_busy;
+#endif
+pthread_mutex_t	*nspace_locks;	/* one stripe per thread */
+pthread_mutex_t	dirpath_lock = PTHREAD_MUTEX_INITIALIZER;
 int		errrange;
 int		errtag;
-opty_t		*freq_table;
+freqent_t	*freq_table;
 int		freq_table_size;
+char		*profile_name;
+phase_t		*phases;
+int		nphases;
+__thread phase_t	*phase;		/* that this worker is in */
+__thread opnum_t	phase_opno;	/* its first op */
+__thread long long	phase_end;	/* CLOCK_MONOTONIC ns it ends at */
 struct xfs_fsop_geom	geom;
-char		*homedir;
+__thread char	*homedir;
 int		*ilist;
 int		ilistlen;
 off64_t		maxfsize;
 char		*myprog;
 int		namerand;
-int		nameseq;
 int		nops;
 int		nproc = 1;
+int		loops = 1;
 opnum_t		operations = 1;
 unsigned int	idmodulo = XFS_IDMODULO_MAX;
 unsigned int	attr_mask = ~0;
-int		procid;
+__thread int	procid;
 int		rtpct;
 unsigned long	seed = 0;
-ino_t		top_ino;
+__thread ino_t	top_ino;
 int		cleanup = 0;
 int		verbose = 0;
 int		verifiable_log = 0;
 sig_atomic_t	should_stop = 0;
-sigjmp_buf	*sigbus_jmp = NULL;
+__thread sigjmp_buf	*sigbus_jmp = NULL;
 char		*execute_cmd = NULL;
 int		execute_freq = 1;
-struct print_string	flag_str = {0};
+__thread struct print_string	flag_str = {0};
+opstat_t	*opstats;	/* OP_LAST of them per worker */
+__thread opstat_t	*my_opstats;
+opstat_t	*lagstats;	/* with --rate, how late ops were issued */
+__thread opstat_t	*my_lagstats;
+double		rate;		/* --rate: ops/sec over all the workers, */
+double		op_rate[OP_LAST];	/* or of each op type */
+int		rate_by_op;
+int		rate_limited;	/* any of the above, or a phase rate */
+int		rate_poisson;	/* exponential gaps, not even ones */
+__thread long long	rate_due;	/* when the next op is due, in ns */
+__thread long long	op_due[OP_LAST];
+__thread long long	rate_issued;	/* when the op being run was due */
+FILE		*report_fp;
+int		report_interval;
+struct timespec	report_start;
+int		report_done;
+pthread_mutex_t	report_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	report_cond = PTHREAD_COND_INITIALIZER;
+char		*trace_name;	/* --record-ops prefix */
+char		*replay_name;	/* --replay-ops prefix */
+int		replay_order;
+int64_t		*trace_seq;	/* shared by all the workers */
+__thread FILE	*trace_fp;
+char		*state_name;	/* --state prefix */
+int32_t		rng_state[RNG_STATE_LEN / sizeof(int32_t)];
+__thread wstate_t	*resume;	/* saved state to carry on from */
+int		pop_dirs;	/* --populate: directories per worker, */
+int		pop_fanout;	/* subdirectories of each, */
+int		pop_files;	/* regular files per worker, */
+int		pop_size;	/* their largest size, */
+int		pop_xattrs;	/* and percentage with an xattr */
+int		live_stats;
+char		live_name[32];	/* its shm name, once it is made */
+live_hdr_t	*live;
+__thread live_worker_t	*my_live;
+__thread int	op_errno;	/* what the running op failed with */
+int		verify;
+__thread uint32_t	verify_gen;
+__thread vgen_t	*vgens;		/* hash of (ino, blk), open addressing */
+__thread size_t	vgen_size;
+__thread size_t	vgen_count;
+__thread int	verify_errors;
+dist_t		io_dist;	/* --io-size */
+dist_t		fsize_dist;	/* --file-size */
+dist_t		off_dist;	/* --offset */
+double		hot_files;	/* --hot-files zipf exponent, or 0 */
 
 struct timespec deadline = { 0 };
 
 void	add_to_flist(int, int, int, int);
+#ifdef URING
+bool	aop_capable(opty_t);
+void	aop_complete(aop_t *, int);
+void	aop_drain(void);
+fent_t	*aop_fent(int, int);
+void	aop_finish(aop_t *, int);
+void	aop_init(void);
+void	aop_issue(aop_t *);
+bool	aop_prep(aop_t *, long);
+bool	aop_prep_io(aop_t *);
+void	aop_put(aop_t *);
+void	aop_reap(bool);
+bool	aop_start(opty_t, opnum_t, long);
+#endif
 void	append_pathname(pathname_t *, char *);
 int	attr_list_path(pathname_t *, char *, const int);
 int	attr_remove_path(pathname_t *, const char *);
-int	attr_set_path(pathname_t *, const char *, const char *, const int);
+int	attr_set_path(pathname_t *, const char *, const char *, const int,
+		      int);
 void	check_cwd(void);
 void	cleanup_flist(void);
 int	creat_path(pathname_t *, mode_t);
-void	dcache_enter(int, int);
-void	dcache_init(void);
-fent_t	*dcache_lookup(int);
-void	dcache_purge(int, int);
 void	del_from_flist(int, int);
+void	dirfd_close(findex_t *);
+void	dirfd_init(void);
+int	dirid_to_fd(int);
 int	dirid_to_name(char *, int);
+char	*dirid_to_path(int);
+int	dist_num(const char *, double *);
+void	dist_parse(dist_t *, char *, const char *);
+double	dist_sample(dist_t *, double, uint64_t);
 void	doproc(void);
 int	fent_to_name(pathname_t *, fent_t *);
 bool	fents_ancestor_check(fent_t *, fent_t *);
+off64_t	file_limit(off64_t, uint64_t);
+void	fill_buf(char *, off64_t, size_t, uint64_t);
+int	findex_add_child(int, int);
+void	findex_del_child(int, int);
+findex_t	*findex_get(int);
+void	findex_grow(void);
+findex_t	*findex_lookup(int);
+void	findex_release(findex_t *);
 void	fix_parent(int, int, bool);
 void	free_pathname(pathname_t *);
 int	generate_fname(fent_t *, int, pathname_t *, int *, int *);
 int	generate_xattr_name(int, char *, int);
 int	get_fname(int, long, pathname_t *, flist_t **, fent_t **, int *);
 void	init_pathname(pathname_t *);
+unsigned long long	lat_percentile(opstat_t *, int);
 int	lchown_path(pathname_t *, uid_t, gid_t);
 int	link_path(pathname_t *, pathname_t *);
+int	live_init(void);
+void	live_op(opty_t, int);
+int	live_print(pid_t);
 int	lstat64_path(pathname_t *, struct stat64 *);
 void	make_freq_table(void);
 int	mkdir_path(pathname_t *, mode_t);
 int	mknod_path(pathname_t *, mode_t, dev_t);
 void	namerandpad(int, char *, int);
+bool	nspace_changing_op(opty_t);
+void	nspace_lock(opty_t);
+void	nspace_unlock(opty_t);
+bool	phase_next(opnum_t);
+size_t	pick_len(void);
+off64_t	pick_off(int64_t, off64_t);
+opdesc_t	*pick_op(long);
+int	op_failed(int);
 int	open_file_or_dir(pathname_t *, int);
 int	open_path(pathname_t *, int);
 DIR	*opendir_path(pathname_t *);
-void	process_freq(char *);
+void	opstat_add(opty_t, struct timespec *);
+void	opstat_count(opstat_t *, unsigned long long);
+void	opstat_lag(opty_t);
+void	populate(void);
+void	populate_parse(char *);
+void	process_freq(char *, const char *);
+void	profile_read(const char *);
+long long	rate_gap(double);
+opdesc_t	*rate_next(void);
+void	rate_parse(char *);
+void	rate_reset(void);
 int	readlink_path(pathname_t *, char *, size_t);
 int	rename_path(pathname_t *, pathname_t *, int);
+void	report_print(bool);
+void	*report_worker(void *);
 int	rmdir_path(pathname_t *);
 void	separate_pathname(pathname_t *, char *, pathname_t *);
 void	show_ops(int, char *);
 int	stat64_path(pathname_t *, struct stat64 *);
+wstate_t	*state_read(void);
+void	state_restore(wstate_t *, bool);
+void	state_rng(int32_t *);
+void	state_save(void);
+int	state_scan(int);
+int	state_xattr_count(const char *);
 int	symlink_path(const char *, pathname_t *);
+void	trace_close(void);
+void	trace_op(opty_t, opnum_t, const char *, const char *, off64_t,
+		 off64_t, off64_t, int, int);
+int	trace_open(void);
+char	*trace_path(const char *);
 int	truncate64_path(pathname_t *, off64_t);
 int	unlink_path(pathname_t *);
 void	usage(void);
+void	verify_check(opnum_t, const char *, uint64_t, const char *, off64_t,
+		     ssize_t);
+uint64_t	verify_csum(const vblock_t *);
+void	verify_forget(uint64_t, off64_t, size_t);
+void	verify_moved(uint64_t);
+void	verify_sweep(opnum_t);
+void	verify_wrote(const char *, uint64_t, off64_t, size_t, ssize_t);
+vgen_t	*vgen_find(uint64_t, uint64_t, bool);
+double	zipf_rank(double, double, double);
 void	read_freq(void);
+int	replay_op(opty_t, trace_rec_t *, const char *, const char *);
+int	replay_ops(void);
+void	replay_wait(int64_t);
+void	run_op(opdesc_t *, opnum_t, long);
+int	run_worker(void);
+void	*thread_worker(void *);
 void	write_freq(void);
 void	zero_freq(void);
 void	non_btrfs_freq(const char *);
@@ -459,6 +865,7 @@ void	non_btrfs_freq(const char *);
 void sg_handler(int signum)
 {
 	switch (signum) {
+	case SIGINT:
 	case SIGTERM:
 	case SIGPIPE:
 		should_stop = 1;
@@ -509,6 +916,26 @@ keep_looping(int i, int loops)
 
 static struct option longopts[] = {
 	{"duration", optional_argument, 0, 256},
+	{"dirfds", no_argument, 0, 257},
+	{"threads", no_argument, 0, 258},
+	{"shared-namespace", no_argument, 0, 259},
+	{"uring-depth", required_argument, 0, 260},
+	{"report", optional_argument, 0, 261},
+	{"report-interval", required_argument, 0, 262},
+	{"record-ops", required_argument, 0, 263},
+	{"replay-ops", required_argument, 0, 264},
+	{"replay-order", no_argument, 0, 265},
+	{"state", required_argument, 0, 266},
+	{"populate", required_argument, 0, 267},
+	{"live-stats", no_argument, 0, 268},
+	{"stats", required_argument, 0, 269},
+	{"verify", no_argument, 0, 270},
+	{"profile", required_argument, 0, 271},
+	{"rate", required_argument, 0, 272},
+	{"io-size", required_argument, 0, 273},
+	{"file-size", required_argument, 0, 274},
+	{"offset", required_argument, 0, 275},
+	{"hot-files", required_argument, 0, 276},
 	{ }
 };
 
@@ -518,18 +945,20 @@ int main(int argc, char **argv)
 	int		c;
 	char		*dirname = NULL;
 	char		*logname = NULL;
+	char		*report_name = NULL;
+	pthread_t	reporter;
 	char		rpath[PATH_MAX];
 	int		fd;
 	int		i;
 	int		j;
 	char		*p;
 	int		stat;
+	int		status = 0;
 	struct timeval	t;
 	ptrdiff_t	srval;
 	int             nousage = 0;
 	xfs_error_injection_t	        err_inj;
 	struct sigaction action;
-	int		loops = 1;
 	const char	*allopts = "cd:e:f:i:l:m:M:n:o:p:rRs:S:vVwx:X:zH";
 	long long	duration;
 
@@ -561,7 +990,7 @@ int main(int argc, char **argv)
 			}
 			break;
 		case 'f':
-			process_freq(optarg);
+			process_freq(optarg, "-f");
 			break;
 		case 'i':
 			ilist = realloc(ilist, ++ilistlen * sizeof(*ilist));
@@ -653,6 +1082,86 @@ int main(int argc, char **argv)
 			deadline.tv_sec += duration;
 			deadline.tv_nsec = 1;
 			break;
+		case 257:  /* --dirfds */
+			use_dirfds = 1;
+			break;
+		case 258:  /* --threads */
+			use_threads = 1;
+			break;
+		case 259:  /* --shared-namespace */
+			shared_nspace = 1;
+			break;
+		case 260:  /* --uring-depth */
+#ifndef URING
+			fprintf(stderr, "fsstress built without io_uring support\n");
+			exit(1);
+#endif
+			uring_depth = strtol(optarg, &p, 0);
+			if (*p || uring_depth < 1) {
+				fprintf(stderr, "%s: invalid uring depth\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 261:  /* --report */
+			report_name = optarg ? optarg : "-";
+			break;
+		case 262:  /* --report-interval */
+			report_interval = strtol(optarg, &p, 0);
+			if (*p || report_interval < 1) {
+				fprintf(stderr, "%s: invalid report interval\n",
+					optarg);
+				exit(1);
+			}
+			if (!report_name)
+				report_name = "-";
+			break;
+		case 263:  /* --record-ops */
+			trace_name = trace_path(optarg);
+			break;
+		case 264:  /* --replay-ops */
+			replay_name = trace_path(optarg);
+			break;
+		case 265:  /* --replay-order */
+			replay_order = 1;
+			break;
+		case 266:  /* --state */
+			state_name = trace_path(optarg);
+			break;
+		case 267:  /* --populate */
+			populate_parse(optarg);
+			break;
+		case 268:  /* --live-stats */
+			live_stats = 1;
+			break;
+		case 269:  /* --stats */
+			exit(live_print(atoi(optarg)));
+		case 270:  /* --verify */
+			verify = 1;
+			break;
+		case 271:  /* --profile */
+			profile_name = trace_path(optarg);
+			break;
+		case 272:  /* --rate */
+			rate_parse(optarg);
+			break;
+		case 273:  /* --io-size */
+			dist_parse(&io_dist, optarg, "--io-size");
+			break;
+		case 274:  /* --file-size */
+			dist_parse(&fsize_dist, optarg, "--file-size");
+			break;
+		case 275:  /* --offset */
+			dist_parse(&off_dist, optarg, "--offset");
+			break;
+		case 276:  /* --hot-files */
+			hot_files = strtod(optarg, NULL);
+			if (!(hot_files > 0) || isinf(hot_files)) {
+				fprintf(stderr, "bad --hot-files '%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
 		case '?':
 			fprintf(stderr, "%s - invalid parameters\n",
 				myprog);
@@ -668,8 +1177,106 @@ int main(int argc, char **argv)
             if (!nousage) usage();
             exit(1);
         }
+	if (shared_nspace && !use_threads) {
+		fprintf(stderr, "--shared-namespace requires --threads\n");
+		exit(1);
+	}
+	if (shared_nspace && use_dirfds) {
+		fprintf(stderr, "--shared-namespace can't be used with --dirfds\n");
+		exit(1);
+	}
+	if (shared_nspace && uring_depth) {
+		fprintf(stderr, "--shared-namespace can't be used with --uring-depth\n");
+		exit(1);
+	}
+	if (trace_name && replay_name) {
+		fprintf(stderr, "--record-ops can't be used with --replay-ops\n");
+		exit(1);
+	}
+	if (replay_order && !replay_name) {
+		fprintf(stderr, "--replay-order requires --replay-ops\n");
+		exit(1);
+	}
+	if (state_name && replay_name) {
+		fprintf(stderr, "--state can't be used with --replay-ops\n");
+		exit(1);
+	}
+	if ((pop_dirs || pop_files) && replay_name) {
+		fprintf(stderr, "--populate can't be used with --replay-ops\n");
+		exit(1);
+	}
+	if (profile_name && replay_name) {
+		fprintf(stderr, "--profile can't be used with --replay-ops\n");
+		exit(1);
+	}
+	/* the phases say how long to go on for */
+	if (profile_name)
+		operations = LLONG_MAX;
+	/* verify blocks must not be read or written by two ops at once */
+	if (verify && (shared_nspace || uring_depth || replay_name)) {
+		fprintf(stderr, "--verify can't be used with --shared-namespace, "
+			"--uring-depth or --replay-ops\n");
+		exit(1);
+	}
+	if (replay_name) {
+		/* one worker for each trace file there is */
+		char	path[PATH_MAX];
+
+		for (nproc = 0; ; nproc++) {
+			snprintf(path, sizeof(path), "%s.%d", replay_name,
+				 nproc);
+			if (access(path, R_OK) < 0)
+				break;
+		}
+		if (!nproc) {
+			fprintf(stderr, "%s.0: no op trace to replay\n",
+				replay_name);
+			exit(1);
+		}
+	}
+	if (trace_name || replay_name) {
+		/* the next op's number, then each worker's next op to replay */
+		trace_seq = mmap(NULL, (nproc + 1) * sizeof(*trace_seq),
+				 PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (trace_seq == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		for (i = 1; i <= nproc; i++)
+			trace_seq[i] = -1;
+	}
 
 	non_btrfs_freq(dirname);
+	if (profile_name)
+		profile_read(dirname);
+	if (report_name) {
+		report_fp = strcmp(report_name, "-") ?
+			fopen(report_name, "a") : stdout;
+		if (!report_fp) {
+			perror(report_name);
+			exit(1);
+		}
+		opstats = mmap(NULL, nproc * OP_LAST * sizeof(*opstats),
+			       PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (opstats == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		if (rate_limited) {
+			lagstats = mmap(NULL, nproc * OP_LAST *
+					sizeof(*lagstats),
+					PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+			if (lagstats == MAP_FAILED) {
+				perror("mmap");
+				exit(1);
+			}
+		}
+	}
+	if (live_stats && live_init() < 0)
+		exit(1);
 	(void)mkdir(dirname, 0777);
 	if (logname && logname[0] != '/') {
 		if (!getcwd(rpath, sizeof(rpath))){
@@ -698,7 +1305,7 @@ int main(int argc, char **argv)
 	else
 		maxfsize = (off64_t)MAXFSIZE;
 	make_freq_table();
-	dcache_init();
+	dirfd_init();
 	setlinebuf(stdout);
 	if (!seed) {
 		gettimeofday(&t, (void *)NULL);
@@ -756,7 +1363,87 @@ int main(int argc, char **argv)
 		perror("sigaction failed");
 		exit(1);
 	}
+	/* stop cleanly on ^C too, so that the state gets saved */
+	if (state_name && sigaction(SIGINT, &action, 0)) {
+		perror("sigaction failed");
+		exit(1);
+	}
 
+	if (use_threads) {
+		pthread_t	*threads;
+		void		*ret;
+
+		if (sigaction(SIGBUS, &action, 0)) {
+			perror("sigaction failed");
+			exit(1);
+		}
+		/* the threads share the random() state, seed it just once */
+		if (state_name)
+			initstate(seed, (char *)rng_state, sizeof(rng_state));
+		else
+			srandom(seed);
+		if (shared_nspace) {
+			if (namerand)
+				nspace.namerand = random();
+			nspace_locks = calloc(nproc, sizeof(*nspace_locks));
+			for (i = 0; i < nproc; i++)
+				pthread_mutex_init(&nspace_locks[i], NULL);
+		}
+		/* and carry on with it, and with p0 if they share that */
+		if (state_name && (resume = state_read()) != NULL) {
+			if (shared_nspace) {
+				(void)mkdir("p0", 0777);
+				if (chdir("p0") < 0) {
+					perror("p0");
+					exit(1);
+				}
+				state_restore(resume, true);
+				assert(chdir("..") == 0);
+			} else {
+				state_rng(resume->rng);
+			}
+			free(resume);
+			resume = NULL;
+		}
+		/* a shared p0 gets populated just once, before they start */
+		if (shared_nspace && (pop_dirs || pop_files)) {
+			(void)mkdir("p0", 0777);
+			if (chdir("p0") < 0) {
+				perror("p0");
+				exit(1);
+			}
+			if (nsp->ftcount[FT_ANYm] == 0)
+				populate();
+			assert(chdir("..") == 0);
+		}
+		threads = calloc(nproc, sizeof(*threads));
+		clock_gettime(CLOCK_MONOTONIC, &report_start);
+		for (i = 0; i < nproc; i++) {
+			j = pthread_create(&threads[i], NULL, thread_worker,
+					   (void *)(long)i);
+			if (j) {
+				fprintf(stderr, "pthread_create failed: %s\n",
+					strerror(j));
+				exit(1);
+			}
+		}
+		if (report_interval)
+			pthread_create(&reporter, NULL, report_worker, NULL);
+		for (i = 0; i < nproc; i++) {
+			pthread_join(threads[i], &ret);
+			if (ret)
+				status = 1;
+		}
+		free(threads);
+		if (shared_nspace && cleanup) {
+			if (system("rm -rf p0") != 0)
+				perror("cleaning up");
+			cleanup_flist();
+		}
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &report_start);
 	for (i = 0; i < nproc; i++) {
 		if (fork() == 0) {
 			sigemptyset(&action.sa_mask);
@@ -780,65 +1467,24 @@ int main(int argc, char **argv)
 				}
 			}
 			procid = i;
-#ifdef AIO
-			if (io_setup(AIO_ENTRIES, &io_ctx) != 0) {
-				fprintf(stderr, "io_setup failed\n");
-				exit(1);
-			}
-#endif
-#ifdef URING
-			have_io_uring = true;
-			/*
-			 * If ENOSYS, just ignore uring, due to kernel doesn't support it.
-			 * If EPERM, maybe due to sysctl kernel.io_uring_disabled isn't 0,
-			 *           or some selinux policies, etc.
-			 * Other errors are fatal.
-			 */
-			c = io_uring_queue_init(URING_ENTRIES, &ring, 0);
-			switch(c){
-			case 0:
-				have_io_uring = true;
-				break;
-			case -ENOSYS:
-				have_io_uring = false;
-				if (verbose)
-					printf("io_uring isn't supported by kernel\n");
-				break;
-			case -EPERM:
-				have_io_uring = false;
-				if (verbose)
-					printf("io_uring isn't allowed, check io_uring_disabled sysctl or selinux policy\n");
-				break;
-			default:
-				fprintf(stderr, "io_uring_queue_init failed, errno=%d\n", -c);
-				exit(1);
-			}
-#endif
-			for (i = 0; keep_looping(i, loops); i++)
-				doproc();
-#ifdef AIO
-			if(io_destroy(io_ctx) != 0) {
-				fprintf(stderr, "io_destroy failed");
-				return 1;
-			}
-#endif
-#ifdef URING
-			if (have_io_uring)
-				io_uring_queue_exit(&ring);
-#endif
-			cleanup_flist();
+			i = run_worker();
 			free(freq_table);
-			return 0;
+			return i;
 		}
 	}
+	if (report_interval)
+		pthread_create(&reporter, NULL, report_worker, NULL);
 	while (wait(&stat) > 0 && !should_stop) {
-		continue;
+		if (WIFEXITED(stat) && WEXITSTATUS(stat))
+			status = 1;
 	}
 	action.sa_flags = SA_RESTART;
 	sigaction(SIGTERM, &action, 0);
 	kill(-getpid(), SIGTERM);
-	while (wait(&stat) > 0)
-		continue;
+	while (wait(&stat) > 0) {
+		if (WIFEXITED(stat) && WEXITSTATUS(stat))
+			status = 1;
+	}
 
 	if (errtag != 0) {
 		err_inj.errtag = 0;
@@ -854,9 +1500,157 @@ int main(int argc, char **argv)
 		close(fd);
 	}
 
+out:
+	if (report_fp) {
+		if (report_interval) {
+			pthread_mutex_lock(&report_lock);
+			report_done = 1;
+			pthread_cond_signal(&report_cond);
+			pthread_mutex_unlock(&report_lock);
+			pthread_join(reporter, NULL);
+		}
+		report_print(true);
+	}
 	free(freq_table);
 	unlink(buf);
-	return 0;
+	if (live)
+		shm_unlink(live_name);
+	return status;
+}
+
+/*
+ * Run one op, timing it if a report was asked for.
+ */
+void
+run_op(opdesc_t *p, opnum_t opno, long r)
+{
+	struct timespec	start;
+
+	if (my_lagstats && rate_issued)
+		opstat_lag(p - ops);
+#ifdef URING
+	if (aop_start(p - ops, opno, r))
+		return;
+#endif
+	if (opstats)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	op_errno = 0;
+	p->func(opno, r);
+	if (opstats)
+		opstat_add(p - ops, &start);
+	if (my_live)
+		live_op(p - ops, op_errno);
+}
+
+/*
+ * The body of a worker: a forked child or, with --threads, a thread.
+ */
+int
+run_worker(void)
+{
+#ifdef URING
+	int	c;
+#endif
+	int	i;
+
+	if (opstats)
+		my_opstats = &opstats[procid * OP_LAST];
+	if (lagstats)
+		my_lagstats = &lagstats[procid * OP_LAST];
+	if (live)
+		my_live = &live->workers[procid];
+#ifdef AIO
+	if (io_setup(AIO_ENTRIES, &io_ctx) != 0) {
+		fprintf(stderr, "io_setup failed\n");
+		exit(1);
+	}
+#endif
+#ifdef URING
+	have_io_uring = true;
+	/*
+	 * If ENOSYS, just ignore uring, due to kernel doesn't support it.
+	 * If EPERM, maybe due to sysctl kernel.io_uring_disabled isn't 0,
+	 *           or some selinux policies, etc.
+	 * Other errors are fatal.
+	 */
+	c = io_uring_queue_init(uring_depth ? uring_depth : URING_ENTRIES,
+				&ring, 0);
+	switch(c){
+	case 0:
+		have_io_uring = true;
+		if (uring_depth)
+			aop_init();
+		break;
+	case -ENOSYS:
+		have_io_uring = false;
+		if (verbose)
+			printf("io_uring isn't supported by kernel\n");
+		break;
+	case -EPERM:
+		have_io_uring = false;
+		if (verbose)
+			printf("io_uring isn't allowed, check io_uring_disabled sysctl or selinux policy\n");
+		break;
+	default:
+		fprintf(stderr, "io_uring_queue_init failed, errno=%d\n", -c);
+		exit(1);
+	}
+#endif
+	if (replay_name) {
+		i = replay_ops();
+	} else {
+		if (trace_name && trace_open() < 0)
+			exit(1);
+		if (state_name && !shared_nspace)
+			resume = state_read();
+		for (i = 0; keep_looping(i, loops); i++)
+			doproc();
+		if (state_name)
+			state_save();
+		trace_close();
+		i = 0;
+	}
+#ifdef AIO
+	if(io_destroy(io_ctx) != 0) {
+		fprintf(stderr, "io_destroy failed");
+		return 1;
+	}
+#endif
+#ifdef URING
+	free(aops);
+	aops = NULL;
+	if (have_io_uring)
+		io_uring_queue_exit(&ring);
+#endif
+	if (!shared_nspace)
+		cleanup_flist();
+	return i || verify_errors ? 1 : 0;
+}
+
+void *
+thread_worker(void *arg)
+{
+	int	ret;
+
+	procid = (long)arg;
+	/* the *_path() helpers chdir about, so each thread needs its own cwd */
+	if (unshare(CLONE_FS) < 0) {
+		perror("unshare(CLONE_FS)");
+		exit(1);
+	}
+	if (!shared_nspace) {
+		nsp = malloc(sizeof(*nsp));
+		if (!nsp) {
+			perror("malloc");
+			exit(1);
+		}
+		*nsp = nspace;
+	}
+	dirfd_init();
+	ret = run_worker();
+	if (!shared_nspace)
+		free(nsp);
+	return (void *)(long)ret;
 }
 
 int
@@ -929,10 +1723,13 @@ translate_flags(int flags, const char *delim,
 void
 add_to_flist(int ft, int id, int parent, int xattr_counter)
 {
-	fent_t	*fep;
-	flist_t	*ftp;
+	fent_t		*fep;
+	flist_t		*ftp;
+	findex_t	*ip;
+	int		pidx;
+	int		i;
 
-	ftp = &flist[ft];
+	ftp = &nsp->flist[ft];
 	if (ftp->nfiles == ftp->nslots) {
 		ftp->nslots += FLIST_SLOT_INCR;
 		ftp->fents = realloc(ftp->fents, ftp->nslots * sizeof(fent_t));
@@ -942,6 +1739,28 @@ add_to_flist(int ft, int id, int parent, int xattr_counter)
 	fep->ft = ft;
 	fep->parent = parent;
 	fep->xattr_counter = xattr_counter;
+	for (i = 0; i <= FT_ANYm; i++) {
+		if (i & (1 << ft))
+			nsp->ftcount[i]++;
+	}
+
+	ip = findex_get(id);
+	ip->ft = ft;
+	ip->slot = fep - ftp->fents;
+	pidx = findex_add_child(parent, id);
+	findex_lookup(id)->pidx = pidx;
+}
+
+static inline int
+name_dirfd(pathname_t *name)
+{
+	return name->dirfd == -1 ? AT_FDCWD : name->dirfd;
+}
+
+static inline const char *
+name_leaf(pathname_t *name)
+{
+	return name->dirfd == -1 ? name->path : name->path + name->leaf;
 }
 
 void
@@ -962,6 +1781,7 @@ append_pathname(pathname_t *name, char *str)
 	name->path = realloc(name->path, name->len + 1 + len);
 	strcpy(&name->path[name->len], str);
 	name->len += len;
+	name->dirfd = -1;
 }
 
 int
@@ -1021,19 +1841,19 @@ attr_remove_path(pathname_t *name, const char *attrname)
 
 int
 attr_set_path(pathname_t *name, const char *attrname, const char *attrvalue,
-	      const int valuelength)
+	      const int valuelength, int flags)
 {
 	char		buf[NAME_MAX + 1];
 	pathname_t	newname;
 	int		rval;
 
-	rval = lsetxattr(name->path, attrname, attrvalue, valuelength, 0);
+	rval = lsetxattr(name->path, attrname, attrvalue, valuelength, flags);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
 	if (chdir(buf) == 0) {
 		rval = attr_set_path(&newname, attrname, attrvalue,
-				     valuelength);
+				     valuelength, flags);
 		assert(chdir("..") == 0);
 	}
 	free_pathname(&newname);
@@ -1092,12 +1912,24 @@ cleanup_flist(void)
 	flist_t	*flp;
 	int	i;
 
-	for (i = 0, flp = flist; i < FT_nft; i++, flp++) {
+	for (i = 0, flp = nsp->flist; i < FT_nft; i++, flp++) {
 		flp->nslots = 0;
 		flp->nfiles = 0;
 		free(flp->fents);
 		flp->fents = NULL;
 	}
+	memset(nsp->ftcount, 0, sizeof(nsp->ftcount));
+	for (i = 0; nsp->findex && i < (1 << nsp->findex_shift); i++) {
+		if (nsp->findex[i].id == FINDEX_EMPTY)
+			continue;
+		dirfd_close(&nsp->findex[i]);
+		free(nsp->findex[i].children);
+		free(nsp->findex[i].path);
+	}
+	free(nsp->findex);
+	nsp->findex = NULL;
+	nsp->findex_shift = 0;
+	nsp->findex_used = 0;
 }
 
 int
@@ -1107,7 +1939,8 @@ creat_path(pathname_t *name, mode_t mode)
 	pathname_t	newname;
 	int		rval;
 
-	rval = creat(name->path, mode);
+	rval = openat(name_dirfd(name), name_leaf(name),
+		      O_CREAT | O_WRONLY | O_TRUNC, mode);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1119,112 +1952,335 @@ creat_path(pathname_t *name, mode_t mode)
 	return rval;
 }
 
+/*
+ * Delete the item from the list by
+ * moving last entry over the deleted one;
+ * unless deleted entry is the last one.
+ * Input: which file list array and which slot in array
+ */
 void
-dcache_enter(int dirid, int slot)
+del_from_flist(int ft, int slot)
 {
-	dcache[dirid % NDCACHE] = slot;
+	flist_t		*ftp;
+	findex_t	*ip;
+	int		parent;
+	int		pidx;
+	int		i;
+
+	ftp = &nsp->flist[ft];
+	for (i = 0; i <= FT_ANYm; i++) {
+		if (i & (1 << ft))
+			nsp->ftcount[i]--;
+	}
+	parent = ftp->fents[slot].parent;
+	ip = findex_lookup(ftp->fents[slot].id);
+	pidx = ip->pidx;
+	ip->ft = -1;
+	dirfd_close(ip);
+	findex_release(ip);
+	findex_del_child(parent, pidx);
+	if (slot != ftp->nfiles - 1) {
+		ftp->fents[slot] = ftp->fents[--ftp->nfiles];
+		findex_lookup(ftp->fents[slot].id)->slot = slot;
+	} else
+		ftp->nfiles--;
 }
 
+/*
+ * Drop everything below parid from the flists, deepest entries first.
+ */
 void
-dcache_init(void)
+delete_subvol_children(int parid)
 {
-	int	i;
+	findex_t	*ip;
+	int		id;
 
-	for (i = 0; i < NDCACHE; i++)
-		dcache[i] = -1;
+	while ((ip = findex_lookup(parid)) && ip->nchildren) {
+		id = ip->children[ip->nchildren - 1];
+		ip = findex_lookup(id);
+		if (ip->ft == FT_DIR || ip->ft == FT_SUBVOL)
+			delete_subvol_children(id);
+		ip = findex_lookup(id);
+		del_from_flist(ip->ft, ip->slot);
+	}
 }
 
-fent_t *
-dcache_lookup(int dirid)
+/*
+ * Drop the cached O_PATH fd of a directory, if it has one.
+ */
+void
+dirfd_close(findex_t *ip)
+{
+	if (ip->dirfd == -1)
+		return;
+	close(ip->dirfd);
+	dirfds[ip->dfslot].id = FINDEX_EMPTY;
+	ip->dirfd = -1;
+}
+
+void
+dirfd_init(void)
 {
-	fent_t	*fep;
 	int	i;
 
-	i = dcache[dirid % NDCACHE];
-	if (i >= 0 && i < flist[FT_DIR].nfiles &&
-	    (fep = &flist[FT_DIR].fents[i])->id == dirid)
-		return fep;
-	if (i >= 0 && i < flist[FT_SUBVOL].nfiles &&
-	    (fep = &flist[FT_SUBVOL].fents[i])->id == dirid)
-		return fep;
-	return NULL;
+	for (i = 0; i < NDIRFD; i++)
+		dirfds[i].id = FINDEX_EMPTY;
 }
 
-void
-dcache_purge(int dirid, int ft)
+/*
+ * Return an O_PATH fd for directory dirid, opening it relative to its
+ * parent's fd if it isn't cached yet.  At most NDIRFD fds are kept open;
+ * once they are all in use the oldest one not handed out during the
+ * current op is closed.  Returns -1 for the top directory or if no fd
+ * could be had, callers then fall back to plain pathnames.
+ */
+int
+dirid_to_fd(int dirid)
+{
+	char		buf[NAME_MAX + 1];
+	fent_t		*fep;
+	findex_t	*ip;
+	int		fd;
+	int		i;
+	int		pfd;
+
+	ip = findex_lookup(dirid);
+	if (ip == NULL || (ip->ft != FT_DIR && ip->ft != FT_SUBVOL))
+		return -1;
+	if (ip->dirfd != -1) {
+		dirfds[ip->dfslot].epoch = dirfd_epoch;
+		return ip->dirfd;
+	}
+	fep = &nsp->flist[ip->ft].fents[ip->slot];
+	pfd = dirid_to_fd(fep->parent);
+	if (fep->parent != -1 && pfd == -1)
+		return -1;
+
+	/* the current op may still use any fd it was given, don't close those */
+	for (i = 0; dirfds[dirfd_next].id != FINDEX_EMPTY &&
+		    dirfds[dirfd_next].epoch == dirfd_epoch; i++) {
+		if (i == NDIRFD)
+			return -1;
+		dirfd_next = (dirfd_next + 1) % NDIRFD;
+	}
+
+	i = sprintf(buf, "%c%x", nsp->flist[fep->ft].tag, fep->id);
+	namerandpad(fep->id, buf, i);
+	fd = openat(pfd == -1 ? AT_FDCWD : pfd, buf, O_PATH | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+
+	if (dirfds[dirfd_next].id != FINDEX_EMPTY)
+		dirfd_close(findex_lookup(dirfds[dirfd_next].id));
+	ip = findex_lookup(dirid);
+	ip->dirfd = fd;
+	ip->dfslot = dirfd_next;
+	dirfds[dirfd_next].id = dirid;
+	dirfds[dirfd_next].epoch = dirfd_epoch;
+	dirfd_next = (dirfd_next + 1) % NDIRFD;
+	return fd;
+}
+
+fent_t *
+dirid_to_fent(int dirid)
 {
-	int	*dcp;
-	dcp = &dcache[dirid % NDCACHE];
-	if (*dcp >= 0 && *dcp < flist[ft].nfiles &&
-	    flist[ft].fents[*dcp].id == dirid)
-		*dcp = -1;
+	findex_t	*ip;
+
+	ip = findex_lookup(dirid);
+	if (ip == NULL || (ip->ft != FT_DIR && ip->ft != FT_SUBVOL))
+		return NULL;
+	return &nsp->flist[ip->ft].fents[ip->slot];
 }
 
 /*
- * Delete the item from the list by
- * moving last entry over the deleted one;
- * unless deleted entry is the last one.
- * Input: which file list array and which slot in array
+ * Return the pathname of directory dirid.  It is cached in the index
+ * and only rebuilt once some directory has moved, as that bumps
+ * dirpath_gen.
  */
-void
-del_from_flist(int ft, int slot)
+char *
+dirid_to_path(int dirid)
 {
-	flist_t	*ftp;
+	findex_t	*ip;
+	pathname_t	name;
+	char		*path = NULL;
 
-	ftp = &flist[ft];
-	if (ft == FT_DIR || ft == FT_SUBVOL)
-		dcache_purge(ftp->fents[slot].id, ft);
-	if (slot != ftp->nfiles - 1) {
-		if (ft == FT_DIR || ft == FT_SUBVOL)
-			dcache_purge(ftp->fents[ftp->nfiles - 1].id, ft);
-		ftp->fents[slot] = ftp->fents[--ftp->nfiles];
-	} else
-		ftp->nfiles--;
+	ip = findex_lookup(dirid);
+	if (ip == NULL || (ip->ft != FT_DIR && ip->ft != FT_SUBVOL))
+		return NULL;
+	/*
+	 * Threads sharing the namespace can fill the cache concurrently;
+	 * a path stays valid until an op changing the namespace runs alone.
+	 */
+	if (shared_nspace)
+		pthread_mutex_lock(&dirpath_lock);
+	if (ip->path && ip->pathgen == nsp->dirpath_gen)
+		path = ip->path;
+	if (shared_nspace)
+		pthread_mutex_unlock(&dirpath_lock);
+	if (path)
+		return path;
+
+	init_pathname(&name);
+	if (!fent_to_name(&name, &nsp->flist[ip->ft].fents[ip->slot])) {
+		free_pathname(&name);
+		return NULL;
+	}
+	if (shared_nspace)
+		pthread_mutex_lock(&dirpath_lock);
+	if (ip->path && ip->pathgen == nsp->dirpath_gen) {
+		free(name.path);
+	} else {
+		free(ip->path);
+		ip->path = name.path;
+		ip->pathgen = nsp->dirpath_gen;
+	}
+	path = ip->path;
+	if (shared_nspace)
+		pthread_mutex_unlock(&dirpath_lock);
+	return path;
+}
+
+/*
+ * Parse a size such as 4k, 1.5m or 2g into v.  Returns 0 if it was one.
+ */
+int
+dist_num(const char *s, double *v)
+{
+	char	*end;
+
+	*v = strtod(s, &end);
+	if (end == s || !(*v >= 0) || isinf(*v))
+		return -1;
+	switch (*end) {
+	case 't': case 'T':
+		*v *= 1024;
+		/* fall through */
+	case 'g': case 'G':
+		*v *= 1024;
+		/* fall through */
+	case 'm': case 'M':
+		*v *= 1024;
+		/* fall through */
+	case 'k': case 'K':
+		*v *= 1024;
+		end++;
+		break;
+	}
+	return *end == '\0' ? 0 : -1;
 }
 
+/*
+ * Parse the distribution spec for option opt into d: fixed:N,
+ * uniform:MIN:MAX, zipf:S[:N], lognormal:MEDIAN:SIGMA or file:PATH, the
+ * file holding "value [weight]" lines.
+ */
 void
-delete_subvol_children(int parid)
-{
-	flist_t	*flp;
-	int	i;
-again:
-	for (i = 0, flp = flist; i < FT_nft; i++, flp++) {
-		int c;
-		for (c = 0; c < flp->nfiles; c++) {
-			if (flp->fents[c].parent == parid) {
-				int id = flp->fents[c].id;
-				del_from_flist(i, c);
-				if (i == FT_DIR || i == FT_SUBVOL)
-					delete_subvol_children(id);
-				goto again;
+dist_parse(dist_t *d, char *spec, const char *opt)
+{
+	char	*kind = strsep(&spec, ":");
+	char	*p1 = spec ? strsep(&spec, ":") : NULL;
+	char	*p2 = spec;
+	char	buf[256];
+	double	sum = 0;
+	double	v, w;
+	FILE	*fp;
+	int	i, nf;
+
+	memset(d, 0, sizeof(*d));
+	if (strcmp(kind, "fixed") == 0 && p1 && !p2) {
+		d->type = DIST_FIXED;
+		if (dist_num(p1, &d->a) == 0)
+			return;
+	} else if (strcmp(kind, "uniform") == 0 && p1 && p2) {
+		d->type = DIST_UNIFORM;
+		if (dist_num(p1, &d->a) == 0 && dist_num(p2, &d->b) == 0 &&
+		    d->a <= d->b)
+			return;
+	} else if (strcmp(kind, "zipf") == 0 && p1) {
+		d->type = DIST_ZIPF;
+		if (dist_num(p1, &d->a) == 0 && d->a > 0 &&
+		    (!p2 || (dist_num(p2, &d->b) == 0 && d->b >= 1)))
+			return;
+	} else if (strcmp(kind, "lognormal") == 0 && p1 && p2) {
+		d->type = DIST_LOGNORMAL;
+		if (dist_num(p1, &d->a) == 0 && d->a > 0 &&
+		    dist_num(p2, &d->b) == 0)
+			return;
+	} else if (strcmp(kind, "file") == 0 && p1) {
+		if (p2)
+			p2[-1] = ':';
+		if ((fp = fopen(p1, "r")) == NULL) {
+			perror(p1);
+			exit(1);
+		}
+		d->type = DIST_EMPIRICAL;
+		while (fgets(buf, sizeof(buf), fp)) {
+			char	vs[64];
+
+			if (buf[strspn(buf, " \t")] == '#')
+				continue;
+			w = 1;
+			nf = sscanf(buf, "%63s %lf", vs, &w);
+			if (nf < 1)
+				continue;
+			if (dist_num(vs, &v) || !(w >= 0)) {
+				fprintf(stderr, "bad %s line in %s: %s",
+					opt, p1, buf);
+				exit(1);
 			}
+			d->val = realloc(d->val, (d->n + 1) * sizeof(double));
+			d->cdf = realloc(d->cdf, (d->n + 1) * sizeof(double));
+			d->val[d->n] = v;
+			d->cdf[d->n++] = sum += w;
+		}
+		fclose(fp);
+		if (d->n && sum > 0) {
+			for (i = 0; i < d->n; i++)
+				d->cdf[i] /= sum;
+			return;
 		}
+		fprintf(stderr, "no %s values in %s\n", opt, p1);
+		exit(1);
 	}
+	fprintf(stderr, "bad %s '%s'\n", opt, kind);
+	exit(1);
 }
 
-fent_t *
-dirid_to_fent(int dirid)
-{
-	fent_t	*efep;
-	fent_t	*fep;
-	flist_t	*flp;
-	int	ft = FT_DIR;
-
-	if ((fep = dcache_lookup(dirid)))
-		return fep;
-again:
-	flp = &flist[ft];
-	for (fep = flp->fents, efep = &fep[flp->nfiles]; fep < efep; fep++) {
-		if (fep->id == dirid) {
-			dcache_enter(dirid, fep - flp->fents);
-			return fep;
+/*
+ * Draw a value from d using the random bits r, laid out as lr is (two
+ * random() results in the high and low words).  max stands in for the
+ * item count of a zipf without one.
+ */
+double
+dist_sample(dist_t *d, double max, uint64_t r)
+{
+	double	u = ((r >> 32) & 0x7fffffff) / 2147483648.0;
+	double	u2 = ((r & 0x7fffffff) + 1) / 2147483648.0;
+	int	lo, hi, mid;
+
+	switch (d->type) {
+	case DIST_FIXED:
+		return d->a;
+	case DIST_UNIFORM:
+		return d->a + u * (d->b - d->a);
+	case DIST_ZIPF:
+		return zipf_rank(u, d->a, d->b ? d->b : max);
+	case DIST_LOGNORMAL:
+		/* Box-Muller for the normal deviate */
+		return d->a * exp(d->b * sqrt(-2 * log(u2)) * cos(2 * M_PI * u));
+	case DIST_EMPIRICAL:
+		lo = 0;
+		hi = d->n - 1;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (d->cdf[mid] > u)
+				hi = mid;
+			else
+				lo = mid + 1;
 		}
+		return d->val[lo];
 	}
-	if (ft == FT_DIR) {
-		ft = FT_SUBVOL;
-		goto again;
-	}
-	return NULL;
+	return 0;
 }
 
 bool
@@ -1261,8 +2317,10 @@ doproc(void)
 	opdesc_t	*p;
 	long long	dividend;
 
-	dividend = (operations + execute_freq) / (execute_freq + 1);
-	sprintf(buf, "p%x", procid);
+	/* rounded up, dividing first as a --profile runs LLONG_MAX ops */
+	dividend = operations / (execute_freq + 1) +
+		   (operations % (execute_freq + 1) != 0);
+	sprintf(buf, "p%x", shared_nspace ? 0 : procid);
 	(void)mkdir(buf, 0777);
 	if (chdir(buf) < 0 || stat64(".", &statbuf) < 0) {
 		perror(buf);
@@ -1274,11 +2332,32 @@ doproc(void)
 		perror("getcwd failed");
 		_exit(1);
 	}
-	seed += procid;
-	srandom(seed);
-	if (namerand)
-		namerand = random();
+	if (!use_threads) {
+		seed += procid;
+		if (state_name)
+			initstate(seed, (char *)rng_state, sizeof(rng_state));
+		else
+			srandom(seed);
+	}
+	if (namerand && !shared_nspace) {
+		nsp->namerand = random();
+		nsp->dirpath_gen++;
+	}
+	if (resume) {
+		state_restore(resume, !use_threads);
+		free(resume);
+		resume = NULL;
+	}
+	/* only into an empty tree, not over one carried on from */
+	if ((pop_dirs || pop_files) && !shared_nspace &&
+	    nsp->ftcount[FT_ANYm] == 0)
+		populate();
+	phase = NULL;
+	if (rate_limited)
+		rate_reset();
 	for (opno = 0; keep_running(opno, operations); opno++) {
+		if (phases && !phase_next(opno))
+			break;
 		if (execute_cmd && opno && opno % dividend == 0) {
 			if (verbose)
 				printf("%lld: execute command %s\n", opno,
@@ -1288,8 +2367,11 @@ doproc(void)
 				fprintf(stderr, "execute command failed with "
 					"%d\n", rval);
 		}
-		p = &ops[freq_table[random() % freq_table_size]];
-		p->func(opno, random());
+		p = rate_limited ? rate_next() : pick_op(random());
+		dirfd_epoch++;
+		nspace_lock(p - ops);
+		run_op(p, opno, random());
+		nspace_unlock(p - ops);
 		/*
 		 * test for forced shutdown by stat'ing the test
 		 * directory.  If this stat returns EIO, assume
@@ -1304,6 +2386,11 @@ doproc(void)
 		}
 	}
 errout:
+#ifdef URING
+	aop_drain();
+#endif
+	if (verify)
+		verify_sweep(opno);
 	rval = chdir("..");
 	if (rval != 0 && errno == EIO) {
 		/*
@@ -1316,13 +2403,14 @@ errout:
 	}
 	assert(rval == 0);
 	free(homedir);
-	if (cleanup) {
+	if (cleanup && !shared_nspace) {
 		int ret;
 
 		sprintf(cmd, "rm -rf %s", buf);
 		ret = system(cmd);
 		if (ret != 0)
 			perror("cleaning up");
+		trace_op(TRACE_CLEANUP, opno, NULL, NULL, 0, 0, 0, 0, 0);
 		cleanup_flist();
 	}
 }
@@ -1335,35 +2423,34 @@ errout:
 int
 fent_to_name(pathname_t *name, fent_t *fep)
 {
-	flist_t	*flp = &flist[fep->ft];
+	flist_t	*flp = &nsp->flist[fep->ft];
 	char	buf[NAME_MAX + 1];
 	int	i;
-	fent_t	*pfep;
-	int	e;
+	char	*ppath;
 
 	if (fep == NULL)
 		return 0;
 
 	/* build up parent directory name */
 	if (fep->parent != -1) {
-		pfep = dirid_to_fent(fep->parent);
+		ppath = dirid_to_path(fep->parent);
 #ifdef DEBUG
-		if (pfep == NULL) {
+		if (ppath == NULL) {
 			fprintf(stderr, "%d: fent-id = %d: can't find parent id: %d\n",
 				procid, fep->id, fep->parent);
 		} 
 #endif
-		if (pfep == NULL)
-			return 0;
-		e = fent_to_name(name, pfep);
-		if (!e)
+		if (ppath == NULL)
 			return 0;
+		append_pathname(name, ppath);
 		append_pathname(name, "/");
 	}
 
 	i = sprintf(buf, "%c%x", flp->tag, fep->id);
 	namerandpad(fep->id, buf, i);
+	i = name->len;
 	append_pathname(name, buf);
+	name->leaf = i;
 	return 1;
 }
 
@@ -1381,22 +2468,258 @@ fents_ancestor_check(fent_t *fep, fent_t *dfep)
 	return false;
 }
 
+/*
+ * How far into a file of size writes may start: a megabyte past its
+ * end, or with --file-size (or the phase's file-size=) the file's own
+ * target size, drawn once per inode so that it stays put.
+ */
+off64_t
+file_limit(off64_t size, uint64_t ino)
+{
+	dist_t		*d = phase && phase->fsize_dist.type ?
+			     &phase->fsize_dist : &fsize_dist;
+	uint64_t	h = ino + 0x9e3779b97f4a7c15ULL;
+	double		v;
+
+	if (!d->type)
+		return MIN(size + (1024 * 1024), MAXFSIZE);
+	/* splitmix64 finaliser */
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	v = dist_sample(d, maxfsize, h);
+	return v < 1 ? 1 : v >= maxfsize ? maxfsize : (off64_t)v;
+}
+
+/*
+ * Fill buf, to be written at off in file ino.  With --verify each block
+ * is made to describe itself, so off and len must be multiples of
+ * VERIFY_BLOCK; otherwise it is all the one byte, as it always was.
+ */
 void
-fix_parent(int oldid, int newid, bool swap)
+fill_buf(char *buf, off64_t off, size_t len, uint64_t ino)
 {
-	fent_t	*fep;
-	flist_t	*flp;
+	vblock_t	*vb;
+	uint64_t	seed;
+	size_t		b;
+	int		i;
+
+	if (!verify) {
+		memset(buf, nsp->nameseq & 0xff, len);
+		return;
+	}
+	for (b = 0; b < len; b += VERIFY_BLOCK) {
+		vb = (vblock_t *)(buf + b);
+		vb->h.magic = VERIFY_MAGIC;
+		vb->h.gen = ++verify_gen;
+		vb->h.ino = ino;
+		vb->h.off = off + b;
+		seed = (vb->h.off ^ ((uint64_t)procid << 32 | vb->h.gen)) *
+			0x9e3779b97f4a7c15ULL;
+		for (i = VERIFY_CSUM_WORD + 1; i < VERIFY_BLOCK / 8; i++)
+			vb->w[i] = seed ^ i;
+		vb->h.csum = verify_csum(vb);
+	}
+}
+
+/*
+ * Index of the hash bucket an id starts probing from.
+ */
+static inline int
+findex_hash(int id)
+{
+	return ((unsigned int)id * 2654435761U) >> (32 - nsp->findex_shift);
+}
+
+/*
+ * Record id as a child of parent, returning its position in the
+ * parent's list of children.
+ */
+int
+findex_add_child(int parent, int id)
+{
+	findex_t	*pp;
+
+	pp = findex_get(parent);
+	if (pp->nchildren == pp->nchslots) {
+		pp->nchslots = pp->nchslots ? pp->nchslots * 2 : FLIST_SLOT_INCR;
+		pp->children = realloc(pp->children,
+				       pp->nchslots * sizeof(*pp->children));
+	}
+	pp->children[pp->nchildren] = id;
+	return pp->nchildren++;
+}
+
+/*
+ * Remove the child at position pidx from parent's list of children by
+ * moving the last child over it.
+ */
+void
+findex_del_child(int parent, int pidx)
+{
+	findex_t	*pp;
+
+	pp = findex_lookup(parent);
+	if (pidx != --pp->nchildren) {
+		pp->children[pidx] = pp->children[pp->nchildren];
+		findex_lookup(pp->children[pidx])->pidx = pidx;
+	}
+	findex_release(pp);
+}
+
+/*
+ * Look up the index entry for id, creating an empty one if needed.
+ * This can resize the table, so any other findex_t pointer held by the
+ * caller is stale afterwards.
+ */
+findex_t *
+findex_get(int id)
+{
+	findex_t	*ip;
+	int		i;
+
+	if ((ip = findex_lookup(id)))
+		return ip;
+	if ((nsp->findex_used + 1) * 2 > (1 << nsp->findex_shift))
+		findex_grow();
+	for (i = findex_hash(id); nsp->findex[i].id != FINDEX_EMPTY;
+	     i = (i + 1) & ((1 << nsp->findex_shift) - 1))
+		;
+	ip = &nsp->findex[i];
+	memset(ip, 0, sizeof(*ip));
+	ip->id = id;
+	ip->ft = -1;
+	ip->dirfd = -1;
+	nsp->findex_used++;
+	return ip;
+}
+
+void
+findex_grow(void)
+{
+	findex_t	*old = nsp->findex;
+	int		oldsize = nsp->findex ? 1 << nsp->findex_shift : 0;
+	int		i;
+	int		j;
+
+	nsp->findex_shift = nsp->findex_shift ? nsp->findex_shift + 1 :
+						 FINDEX_SHIFT_MIN;
+	nsp->findex = malloc((1 << nsp->findex_shift) * sizeof(*nsp->findex));
+	if (nsp->findex == NULL) {
+		perror("findex_grow");
+		exit(1);
+	}
+	for (i = 0; i < (1 << nsp->findex_shift); i++)
+		nsp->findex[i].id = FINDEX_EMPTY;
+	for (j = 0; j < oldsize; j++) {
+		if (old[j].id == FINDEX_EMPTY)
+			continue;
+		for (i = findex_hash(old[j].id); nsp->findex[i].id != FINDEX_EMPTY;
+		     i = (i + 1) & ((1 << nsp->findex_shift) - 1))
+			;
+		nsp->findex[i] = old[j];
+	}
+	free(old);
+}
+
+findex_t *
+findex_lookup(int id)
+{
+	int		i;
+
+	if (nsp->findex == NULL)
+		return NULL;
+	for (i = findex_hash(id); nsp->findex[i].id != FINDEX_EMPTY;
+	     i = (i + 1) & ((1 << nsp->findex_shift) - 1)) {
+		if (nsp->findex[i].id == id)
+			return &nsp->findex[i];
+	}
+	return NULL;
+}
+
+/*
+ * Free the index entry if it no longer describes a file entry nor
+ * has any children.  Removal shifts later entries of the same probe
+ * chain back, so other findex_t pointers are stale afterwards.
+ */
+void
+findex_release(findex_t *ip)
+{
+	int	mask = (1 << nsp->findex_shift) - 1;
 	int	i;
 	int	j;
 
-	for (i = 0, flp = flist; i < FT_nft; i++, flp++) {
-		for (j = 0, fep = flp->fents; j < flp->nfiles; j++, fep++) {
-			if (fep->parent == oldid)
-				fep->parent = newid;
-			else if (swap && fep->parent == newid)
-				fep->parent = oldid;
+	if (ip->ft != -1 || ip->nchildren)
+		return;
+	free(ip->children);
+	free(ip->path);
+	i = ip - nsp->findex;
+	for (j = (i + 1) & mask; nsp->findex[j].id != FINDEX_EMPTY;
+	     j = (j + 1) & mask) {
+		/* only move entries whose home bucket is not in (i, j] */
+		if (((j - findex_hash(nsp->findex[j].id)) & mask) >=
+		    ((j - i) & mask)) {
+			nsp->findex[i] = nsp->findex[j];
+			i = j;
 		}
 	}
+	nsp->findex[i].id = FINDEX_EMPTY;
+	nsp->findex_used--;
+}
+
+/*
+ * Move the children of oldid over to newid (which is expected to have
+ * none of its own) or, when swapping, exchange the two sets.
+ */
+void
+fix_parent(int oldid, int newid, bool swap)
+{
+	findex_t	*op;
+	findex_t	*np;
+	findex_t	*ip;
+	int		*children;
+	int		nchildren;
+	int		nchslots;
+	int		i;
+
+	findex_get(oldid);
+	findex_get(newid);
+	op = findex_lookup(oldid);
+	np = findex_lookup(newid);
+	if (!swap && np->nchildren) {
+		fprintf(stderr, "fsstress: fix_parent target %d has children\n",
+			newid);
+		abort();
+	}
+
+	children = op->children;
+	nchildren = op->nchildren;
+	nchslots = op->nchslots;
+	op->children = np->children;
+	op->nchildren = np->nchildren;
+	op->nchslots = np->nchslots;
+	np->children = children;
+	np->nchildren = nchildren;
+	np->nchslots = nchslots;
+
+	/*
+	 * The directory inodes have moved under these ids, so their cached
+	 * fds are wrong now, as is the cached path of everything below.
+	 */
+	dirfd_close(op);
+	dirfd_close(np);
+	nsp->dirpath_gen++;
+
+	for (i = 0; i < op->nchildren; i++) {
+		ip = findex_lookup(op->children[i]);
+		nsp->flist[ip->ft].fents[ip->slot].parent = oldid;
+	}
+	for (i = 0; i < np->nchildren; i++) {
+		ip = findex_lookup(np->children[i]);
+		nsp->flist[ip->ft].fents[ip->slot].parent = newid;
+	}
+	findex_release(op);
+	findex_release(findex_lookup(newid));
 }
 
 void
@@ -1407,6 +2730,7 @@ free_pathname(pathname_t *name)
 		name->path = NULL;
 		name->len = 0;
 	}
+	name->dirfd = -1;
 }
 
 /*
@@ -1425,8 +2749,8 @@ generate_fname(fent_t *fep, int ft, pathname_t *name, int *idp, int *v)
 	int	e;
 
 	/* create name */
-	flp = &flist[ft];
-	len = sprintf(buf, "%c%x", flp->tag, id = nameseq++);
+	flp = &nsp->flist[ft];
+	len = sprintf(buf, "%c%x", flp->tag, id = nsp->nameseq++);
 	namerandpad(id, buf, len);
 
 	/* prepend fep parent dir-name to it */
@@ -1436,7 +2760,12 @@ generate_fname(fent_t *fep, int ft, pathname_t *name, int *idp, int *v)
 			return 0;
 		append_pathname(name, "/");
 	}
+	len = name->len;
 	append_pathname(name, buf);
+	if (use_dirfds && fep) {
+		name->dirfd = dirid_to_fd(fep->id);
+		name->leaf = len;
+	}
 
 	*idp = id;
 	*v = verbose;
@@ -1472,7 +2801,7 @@ int
 get_fname(int which, long r, pathname_t *name, flist_t **flpp, fent_t **fepp,
 	  int *v)
 {
-	int	totalsum = 0; /* total number of matching files */
+	int	totalsum; /* total number of matching files */
 	int	partialsum = 0; /* partial sum of matching files */
 	fent_t	*fep;
 	flist_t	*flp;
@@ -1481,14 +2810,8 @@ get_fname(int which, long r, pathname_t *name, flist_t **flpp, fent_t **fepp,
 	int	x;
 	int	e = 1; /* success */
 
-	/*
-	 * go thru flist and add up number of files for each
-	 * category that matches with <which>.
-	 */
-	for (i = 0, flp = flist; i < FT_nft; i++, flp++) {
-		if (which & (1 << i))
-			totalsum += flp->nfiles;
-	}
+	/* number of files in all the categories that match <which> */
+	totalsum = nsp->ftcount[which & FT_ANYm];
 	if (totalsum == 0) {
 		if (flpp)
 			*flpp = NULL;
@@ -1501,10 +2824,15 @@ get_fname(int which, long r, pathname_t *name, flist_t **flpp, fent_t **fepp,
 	/*
 	 * Now we have possible matches between 0..totalsum-1.
 	 * And we use r to help us choose which one we want,
-	 * which when bounded by totalsum becomes x.
+	 * which when bounded by totalsum becomes x.  With --hot-files,
+	 * x is instead a zipf rank, so the first files are picked most.
 	 */ 
-	x = (int)(r % totalsum);
-	for (i = 0, flp = flist; i < FT_nft; i++, flp++) {
+	if (hot_files)
+		x = (int)zipf_rank((r & 0x7fffffff) / 2147483648.0, hot_files,
+				   totalsum) - 1;
+	else
+		x = (int)(r % totalsum);
+	for (i = 0, flp = nsp->flist; i < FT_nft; i++, flp++) {
 		if (which & (1 << i)) {
 			if (x < partialsum + flp->nfiles) {
 
@@ -1514,6 +2842,9 @@ get_fname(int which, long r, pathname_t *name, flist_t **flpp, fent_t **fepp,
 				/* fill-in what we were asked for */
 				if (name) {
 					e = fent_to_name(name, fep);
+					if (e && use_dirfds)
+						name->dirfd =
+							dirid_to_fd(fep->parent);
 #ifdef DEBUG
 					if (!e) {
 						fprintf(stderr, "%d: failed to get path for entry:"
@@ -1552,6 +2883,14 @@ init_pathname(pathname_t *name)
 {
 	name->len = 0;
 	name->path = NULL;
+	name->dirfd = -1;
+	name->leaf = 0;
+}
+
+unsigned long long
+lat_percentile(opstat_t *os, int permille)
+{
+	return lat_hist_percentile(os->hist, os->count, os->max_ns, permille);
 }
 
 int
@@ -1561,7 +2900,8 @@ lchown_path(pathname_t *name, uid_t owner, gid_t group)
 	pathname_t	newname;
 	int		rval;
 
-	rval = lchown(name->path, owner, group);
+	rval = fchownat(name_dirfd(name), name_leaf(name), owner, group,
+			AT_SYMLINK_NOFOLLOW);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1583,7 +2923,8 @@ link_path(pathname_t *name1, pathname_t *name2)
 	pathname_t	newname2;
 	int		rval;
 
-	rval = link(name1->path, name2->path);
+	rval = linkat(name_dirfd(name1), name_leaf(name1),
+		      name_dirfd(name2), name_leaf(name2), 0);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name1, buf1, &newname1);
@@ -1628,69 +2969,284 @@ link_path(pathname_t *name1, pathname_t *name2)
 	return rval;
 }
 
+/*
+ * Make the --live-stats segment for nproc workers.
+ */
 int
-lstat64_path(pathname_t *name, struct stat64 *sbuf)
+live_init(void)
 {
-	char		buf[NAME_MAX + 1];
-	pathname_t	newname;
-	int		rval;
+	struct timespec	now;
+	size_t		size;
+	int		fd;
 
-	rval = lstat64(name->path, sbuf);
-	if (rval >= 0 || errno != ENAMETOOLONG)
-		return rval;
-	separate_pathname(name, buf, &newname);
-	if (chdir(buf) == 0) {
-		rval = lstat64_path(&newname, sbuf);
-		assert(chdir("..") == 0);
+	size = sizeof(*live) + nproc * sizeof(live->workers[0]);
+	snprintf(live_name, sizeof(live_name), "/fsstress.%d", getpid());
+	fd = shm_open(live_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		perror(live_name);
+		return -1;
 	}
-	free_pathname(&newname);
-	return rval;
+	if (ftruncate(fd, size) < 0 ||
+	    (live = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, 0)) == MAP_FAILED) {
+		perror(live_name);
+		close(fd);
+		shm_unlink(live_name);
+		live = NULL;
+		return -1;
+	}
+	close(fd);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	live->nproc = nproc;
+	live->nops = OP_LAST;
+	live->start_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+	memcpy(live->magic, LIVE_MAGIC, sizeof(live->magic));
+	return 0;
 }
 
+/*
+ * Count an op of type op that has just finished, with errno e if it
+ * failed.  Every op comes through here, sync or queued.
+ */
 void
-make_freq_table(void)
+live_op(opty_t op, int e)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	my_live->ops++;
+	my_live->op_count[op]++;
+	if (e) {
+		my_live->errors++;
+		my_live->op_errors[op]++;
+		my_live->err_count[e < LIVE_ERRNOS ? e : 0]++;
+	}
+	my_live->nfiles = nsp->ftcount[FT_ANYm];
+	my_live->ndirs = nsp->ftcount[FT_DIRm];
+	my_live->last_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * An op's error exits pass their errno through here, for run_op() to
+ * count once the op returns.  Returns e.
+ */
+int
+op_failed(int e)
 {
-	int		f;
+	if (e)
+		op_errno = e;
+	return e;
+}
+
+/*
+ * Print what the --live-stats of the fsstress with this pid show: each
+ * worker's rate and how long since it last finished an op, which is how
+ * a stall shows up, then the op and errno counts of all the workers.
+ */
+int
+live_print(pid_t pid)
+{
+	char		name[32];
+	struct stat	sb;
+	struct timespec	now;
+	live_hdr_t	*lh;
+	live_worker_t	*w;
+	uint64_t	count;
+	uint64_t	errors;
+	double		elapsed;
+	int		fd;
 	int		i;
-	opdesc_t	*p;
+	int		op;
 
-	for (p = ops, f = 0; p < ops_end; p++)
-		f += p->freq;
-	freq_table = malloc(f * sizeof(*freq_table));
-	freq_table_size = f;
-	for (p = ops, i = 0; p < ops_end; p++) {
-		for (f = 0; f < p->freq; f++, i++)
-			freq_table[i] = p - ops;
+	snprintf(name, sizeof(name), "/fsstress.%d", pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror(name);
+		return 1;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(*lh) ||
+	    (lh = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd,
+		       0)) == MAP_FAILED) {
+		fprintf(stderr, "%s: can't map live stats\n", name);
+		close(fd);
+		return 1;
 	}
+	close(fd);
+	if (memcmp(lh->magic, LIVE_MAGIC, sizeof(lh->magic)) ||
+	    lh->nops != OP_LAST || sb.st_size < sizeof(*lh) +
+	    lh->nproc * sizeof(lh->workers[0])) {
+		fprintf(stderr, "%s: not live stats of this fsstress\n", name);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec * 1000000000LL + now.tv_nsec -
+		   lh->start_ns) / 1e9;
+	printf("fsstress %d: %u workers, %.1fs\n", pid, lh->nproc, elapsed);
+	printf("worker %12s %10s %8s %8s %8s %9s\n", "ops", "ops/sec",
+		"errors", "files", "dirs", "idle");
+	for (i = 0; i < lh->nproc; i++) {
+		w = &lh->workers[i];
+		printf("%6d %12llu %10.1f %8llu %8lld %8lld ", i,
+			(unsigned long long)w->ops, w->ops / elapsed,
+			(unsigned long long)w->errors, (long long)w->nfiles,
+			(long long)w->ndirs);
+		if (w->last_ns)
+			printf("%8.1fs\n", (now.tv_sec * 1000000000LL +
+				now.tv_nsec - w->last_ns) / 1e9);
+		else
+			printf("%9s\n", "-");
+	}
+	printf("%-16s %12s %8s\n", "op", "count", "errors");
+	for (op = 0; op < OP_LAST; op++) {
+		count = errors = 0;
+		for (i = 0; i < lh->nproc; i++) {
+			count += lh->workers[i].op_count[op];
+			errors += lh->workers[i].op_errors[op];
+		}
+		if (count || errors)
+			printf("%-16s %12llu %8llu\n", ops[op].name,
+				(unsigned long long)count,
+				(unsigned long long)errors);
+	}
+	for (op = 0; op < LIVE_ERRNOS; op++) {
+		count = 0;
+		for (i = 0; i < lh->nproc; i++)
+			count += lh->workers[i].err_count[op];
+		if (count)
+			printf("errno %3d %-30s %8llu\n", op,
+				op ? strerror(op) : "(other)",
+				(unsigned long long)count);
+	}
+	munmap(lh, sb.st_size);
+	return 0;
 }
 
 int
-mkdir_path(pathname_t *name, mode_t mode)
+lstat64_path(pathname_t *name, struct stat64 *sbuf)
 {
 	char		buf[NAME_MAX + 1];
 	pathname_t	newname;
 	int		rval;
 
-	rval = mkdir(name->path, mode);
+	rval = fstatat64(name_dirfd(name), name_leaf(name), sbuf,
+			 AT_SYMLINK_NOFOLLOW);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
 	if (chdir(buf) == 0) {
-		rval = mkdir_path(&newname, mode);
+		rval = lstat64_path(&newname, sbuf);
 		assert(chdir("..") == 0);
 	}
 	free_pathname(&newname);
 	return rval;
 }
 
-int
-mknod_path(pathname_t *name, mode_t mode, dev_t dev)
-{
-	char		buf[NAME_MAX + 1];
-	pathname_t	newname;
+/*
+ * Build the alias table (Vose's method) for the op frequencies, so that
+ * picking an op costs the same whatever the number of ops or the size
+ * of their weights.
+ */
+void
+make_freq_table(void)
+{
+	double		f;
+	double		*prob;
+	int		*small;
+	int		*large;
+	int		nsmall;
+	int		nlarge;
+	int		i;
+	int		n;
+	long		range;
+	opdesc_t	*p;
+
+	for (p = ops, f = 0, n = 0; p < ops_end; p++) {
+		if (p->freq > 0) {
+			f += p->freq;
+			n++;
+		}
+	}
+	if (n == 0) {
+		fprintf(stderr, "%s: all operation frequencies are zero\n",
+			myprog);
+		exit(1);
+	}
+	freq_table = malloc(n * sizeof(*freq_table));
+	freq_table_size = n;
+	prob = malloc(n * sizeof(*prob));
+	small = malloc(n * sizeof(*small));
+	large = malloc(n * sizeof(*large));
+	if (!freq_table || !prob || !small || !large) {
+		perror("make_freq_table");
+		exit(1);
+	}
+
+	/* scale the weights so that they average 1 per column */
+	nsmall = nlarge = 0;
+	for (p = ops, i = 0; p < ops_end; p++) {
+		if (p->freq <= 0)
+			continue;
+		freq_table[i].op = freq_table[i].alias = p - ops;
+		prob[i] = p->freq * n / f;
+		if (prob[i] < 1)
+			small[nsmall++] = i;
+		else
+			large[nlarge++] = i;
+		i++;
+	}
+
+	/* top up each light column with part of a heavy one */
+	range = RAND_MAX / n + 1;
+	while (nsmall && nlarge) {
+		int	s = small[--nsmall];
+		int	l = large[--nlarge];
+
+		freq_table[s].alias = freq_table[l].op;
+		freq_table[s].thresh = (long)(prob[s] * range);
+		prob[l] -= 1 - prob[s];
+		if (prob[l] < 1)
+			small[nsmall++] = l;
+		else
+			large[nlarge++] = l;
+	}
+	/* whatever is left is full, give or take rounding */
+	while (nlarge)
+		freq_table[large[--nlarge]].thresh = range;
+	while (nsmall)
+		freq_table[small[--nsmall]].thresh = range;
+
+	free(prob);
+	free(small);
+	free(large);
+}
+
+int
+mkdir_path(pathname_t *name, mode_t mode)
+{
+	char		buf[NAME_MAX + 1];
+	pathname_t	newname;
+	int		rval;
+
+	rval = mkdirat(name_dirfd(name), name_leaf(name), mode);
+	if (rval >= 0 || errno != ENAMETOOLONG)
+		return rval;
+	separate_pathname(name, buf, &newname);
+	if (chdir(buf) == 0) {
+		rval = mkdir_path(&newname, mode);
+		assert(chdir("..") == 0);
+	}
+	free_pathname(&newname);
+	return rval;
+}
+
+int
+mknod_path(pathname_t *name, mode_t mode, dev_t dev)
+{
+	char		buf[NAME_MAX + 1];
+	pathname_t	newname;
 	int		rval;
 
-	rval = mknod(name->path, mode, dev);
+	rval = mknodat(name_dirfd(name), name_leaf(name), mode, dev);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1702,6 +3258,108 @@ mknod_path(pathname_t *name, mode_t mode, dev_t dev)
 	return rval;
 }
 
+/*
+ * Move this worker on to the next --profile phase if the one it is in is
+ * over, sitting out any it takes no part in.  Returns false once the last
+ * phase is over.
+ */
+bool
+phase_next(opnum_t opno)
+{
+	struct timespec	now;
+	long long	ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+	if (phase && !(phase->ops && opno - phase_opno >= phase->ops) &&
+	    !(phase->duration && ns >= phase_end))
+		return true;
+	for (phase = phase ? phase + 1 : phases; phase < phases + nphases;
+	     phase++) {
+		phase_opno = opno;
+		phase_end = ns + phase->duration * 1000000000LL;
+		if (rate_limited)
+			rate_reset();
+		if (verbose)
+			printf("%d/%lld: phase %s\n", procid, opno, phase->name);
+		if (!phase->workers || procid < phase->workers)
+			return true;
+		/* not in this one: if it is timed, wait for the others */
+		while (phase->duration && ns < phase_end && !should_stop) {
+			usleep(100000);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+		}
+	}
+	phase = NULL;
+	return false;
+}
+
+/*
+ * Length of a read or write: up to FILELEN_MAX, or up to the maxlen of
+ * the --profile phase, or drawn from the phase's io-size= or --io-size
+ * (still capped by maxlen).
+ */
+size_t
+pick_len(void)
+{
+	int	max = phase && phase->maxlen ? phase->maxlen : FILELEN_MAX;
+	dist_t	*d = phase && phase->io_dist.type ? &phase->io_dist : &io_dist;
+	double	len;
+
+	if (!d->type)
+		return (random() % max) + 1;
+	len = dist_sample(d, max,
+			  ((uint64_t)random() << 32) + random());
+	if (phase && phase->maxlen && len > max)
+		len = max;
+	if (len > INT_MAX)
+		len = INT_MAX;
+	return len < 1 ? 1 : (size_t)len;
+}
+
+/*
+ * Where in [0, limit) an I/O goes, from the random bits lr: anywhere,
+ * or following --offset.  A zipf offset ranks 4k blocks, which are then
+ * scattered over the range so the hot ones aren't all at the start.
+ */
+off64_t
+pick_off(int64_t lr, off64_t limit)
+{
+	uint64_t	nblocks;
+	uint64_t	k;
+	double		v;
+
+	if (!off_dist.type)
+		return lr % limit;
+	if (off_dist.type != DIST_ZIPF) {
+		v = dist_sample(&off_dist, limit, lr);
+		return v < limit ? (off64_t)v : (off64_t)fmod(v, limit);
+	}
+	nblocks = (limit + 4095) / 4096;
+	k = (uint64_t)dist_sample(&off_dist, nblocks, lr) - 1;
+	k = (k * 0x9e3779b97f4a7c15ULL) % nblocks;
+	return (off64_t)((k * 4096 + (lr & 4095)) % limit);
+}
+
+/*
+ * Choose an op by weight using a single random number: its low part
+ * selects the alias table column, the rest decides between the column's
+ * op and its alias.
+ */
+opdesc_t *
+pick_op(long r)
+{
+	freqent_t	*table = phase ? phase->freq_table : freq_table;
+	int		size = phase ? phase->freq_table_size : freq_table_size;
+	freqent_t	*fe;
+
+	fe = &table[r % size];
+	if (r / size < fe->thresh)
+		return &ops[fe->op];
+	return &ops[fe->alias];
+}
+
 void
 namerandpad(int id, char *buf, int i)
 {
@@ -1711,19 +3369,90 @@ namerandpad(int id, char *buf, int i)
 	int		padlen;
 	int		padmod;
 
-	if (namerand == 0)
+	if (nsp->namerand == 0)
 		return;
-	bucket = (id ^ namerand) % (sizeof(buckets) / sizeof(buckets[0]));
+	bucket = (id ^ nsp->namerand) % (sizeof(buckets) / sizeof(buckets[0]));
 	padmod = buckets[bucket] + 1 - i;
 	if (padmod <= 0)
 		return;
-	padlen = (id ^ namerand) % padmod;
+	padlen = (id ^ nsp->namerand) % padmod;
 	if (padlen) {
 		memset(&buf[i], 'X', padlen);
 		buf[i + padlen] = '\0';
 	}
 }
 
+/*
+ * Ops which change the namespace (or the nameseq or xattr counts kept
+ * with it), and so must run alone when threads share the namespace.
+ */
+opty_t nspace_ops[] = {
+	OP_ATTR_SET,
+	OP_CREAT,
+	OP_LINK,
+	OP_MKDIR,
+	OP_MKNOD,
+	OP_RENAME,
+	OP_RNOREPLACE,
+	OP_REXCHANGE,
+	OP_RWHITEOUT,
+	OP_RMDIR,
+	OP_SETFATTR,
+	OP_SNAPSHOT,
+	OP_SUBVOL_CREATE,
+	OP_SUBVOL_DELETE,
+	OP_SYMLINK,
+	OP_UNLINK,
+};
+
+bool
+nspace_changing_op(opty_t op)
+{
+	int	i;
+
+	for (i = 0; i < sizeof(nspace_ops) / sizeof(nspace_ops[0]); i++) {
+		if (nspace_ops[i] == op)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * With --shared-namespace the namespace lock is split in one stripe per
+ * thread.  Ops that only use existing entries hold their own thread's
+ * stripe, so any number of them race on the same files.  Ops changing
+ * the namespace take every stripe, in order, and run alone.
+ */
+void
+nspace_lock(opty_t op)
+{
+	int	i;
+
+	if (!shared_nspace)
+		return;
+	if (!nspace_changing_op(op)) {
+		pthread_mutex_lock(&nspace_locks[procid]);
+		return;
+	}
+	for (i = 0; i < nproc; i++)
+		pthread_mutex_lock(&nspace_locks[i]);
+}
+
+void
+nspace_unlock(opty_t op)
+{
+	int	i;
+
+	if (!shared_nspace)
+		return;
+	if (!nspace_changing_op(op)) {
+		pthread_mutex_unlock(&nspace_locks[procid]);
+		return;
+	}
+	for (i = nproc - 1; i >= 0; i--)
+		pthread_mutex_unlock(&nspace_locks[i]);
+}
+
 int
 open_file_or_dir(pathname_t *name, int flags)
 {
@@ -1747,7 +3476,7 @@ open_path(pathname_t *name, int oflag)
 	pathname_t	newname;
 	int		rval;
 
-	rval = open(name->path, oflag);
+	rval = openat(name_dirfd(name), name_leaf(name), oflag);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1765,8 +3494,16 @@ opendir_path(pathname_t *name)
 	char		buf[NAME_MAX + 1];
 	pathname_t	newname;
 	DIR		*rval;
+	int		fd;
 
-	rval = opendir(name->path);
+	if (name->dirfd == -1) {
+		rval = opendir(name->path);
+	} else {
+		fd = openat(name->dirfd, name_leaf(name), O_RDONLY | O_DIRECTORY);
+		rval = fd < 0 ? NULL : fdopendir(fd);
+		if (fd >= 0 && rval == NULL)
+			close(fd);
+	}
 	if (rval || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1778,11 +3515,307 @@ opendir_path(pathname_t *name)
 	return rval;
 }
 
+/*
+ * Account for an op of type op which started at start.
+ */
+void
+opstat_add(opty_t op, struct timespec *start)
+{
+	struct timespec		now;
+	unsigned long long	ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+	opstat_count(&my_opstats[op], ns);
+}
+
+void
+opstat_count(opstat_t *os, unsigned long long ns)
+{
+	os->count++;
+	os->ns += ns;
+	if (ns > os->max_ns)
+		os->max_ns = ns;
+	os->hist[lat_bucket(ns)]++;
+}
+
+/*
+ * Account for how long after it was due with --rate an op is issued.
+ */
+void
+opstat_lag(opty_t op)
+{
+	struct timespec	now;
+	long long	ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = now.tv_sec * 1000000000LL + now.tv_nsec - rate_issued;
+	opstat_count(&my_lagstats[op], ns > 0 ? ns : 0);
+}
+
+/*
+ * Build the --populate tree in the current directory and put all of it
+ * on the file lists before the random ops start.  Directory i goes under
+ * directory (i - 1) / pop_fanout, so the tree fills up a level at a time,
+ * and the files are dealt out across the directories in turn.  Everything
+ * is made with *at() calls on the parents' cached fds, and each file's
+ * data goes out in one write from a buffer filled just once.
+ */
+void
+populate(void)
+{
+	char		buf[NAME_MAX + 1];
+	char		xname[XATTR_NAME_BUF_SIZE];
+	char		*data = NULL;
+	int		*dirids;
+	int		fd;
+	int		i;
+	int		id;
+	int		len;
+	int		nd = 0;
+	int		nf = 0;
+	int		parent;
+	int		pfd;
+	ssize_t		n;
+	ssize_t		size;
+	struct stat64	stb;
+	uint64_t	ino;
+	struct timespec	start;
+	struct timespec	now;
+	int		xc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	dirids = malloc((pop_dirs ? pop_dirs : 1) * sizeof(*dirids));
+	if (pop_size) {
+		data = malloc(roundup_64(pop_size, VERIFY_BLOCK));
+		memset(data, nsp->nameseq & 0xff, pop_size);
+	}
+	for (i = 0; i < pop_dirs; i++) {
+		parent = i && pop_fanout ? dirids[(i - 1) / pop_fanout] : -1;
+		dirids[i] = parent;
+		dirfd_epoch++;
+		pfd = dirid_to_fd(parent);
+		if (parent != -1 && pfd == -1)
+			continue;
+		id = nsp->nameseq++;
+		len = sprintf(buf, "%c%x", nsp->flist[FT_DIR].tag, id);
+		namerandpad(id, buf, len);
+		if (mkdirat(pfd == -1 ? AT_FDCWD : pfd, buf, 0777) < 0)
+			continue;
+		add_to_flist(FT_DIR, id, parent, 0);
+		dirids[i] = id;
+		nd++;
+	}
+	for (i = 0; i < pop_files; i++) {
+		parent = pop_dirs ? dirids[i % pop_dirs] : -1;
+		dirfd_epoch++;
+		pfd = dirid_to_fd(parent);
+		if (parent != -1 && pfd == -1)
+			continue;
+		id = nsp->nameseq++;
+		len = sprintf(buf, "%c%x", nsp->flist[FT_REG].tag, id);
+		namerandpad(id, buf, len);
+		fd = openat(pfd == -1 ? AT_FDCWD : pfd, buf,
+			    O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd < 0)
+			continue;
+		size = pop_size ? random() % ((long long)pop_size + 1) : 0;
+		ino = 0;
+		if (verify && size) {
+			/* each file's blocks have to be its own */
+			if (fstat64(fd, &stb) == 0)
+				ino = stb.st_ino;
+			size = roundup_64(size, VERIFY_BLOCK);
+			fill_buf(data, 0, size, ino);
+		}
+		n = size ? write(fd, data, size) : 0;
+		if (n < 0 && verbose)
+			printf("%d: populate %s write %zd failed %d\n",
+				procid, buf, size, errno);
+		if (verify && size && ino)
+			verify_wrote(data, ino, 0, size, n);
+		xc = 0;
+		if (random() % 100 < pop_xattrs) {
+			generate_xattr_name(1, xname, sizeof(xname));
+			len = random() % 101;
+			if (len > size)
+				len = size;
+			if (fsetxattr(fd, xname, data, len, XATTR_CREATE) == 0)
+				xc = 1;
+		}
+		close(fd);
+		add_to_flist(FT_REG, id, parent, xc);
+		nf++;
+	}
+	/* the ops start with a clean fd cache */
+	for (i = 0; i < NDIRFD; i++) {
+		if (dirfds[i].id != FINDEX_EMPTY)
+			dirfd_close(findex_lookup(dirfds[i].id));
+	}
+	free(data);
+	free(dirids);
+	if (verbose) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		printf("%d: populated %d dirs and %d files in %.3fs\n",
+			procid, nd, nf, (now.tv_sec - start.tv_sec) +
+			(now.tv_nsec - start.tv_nsec) / 1e9);
+	}
+}
+
+void
+populate_parse(char *arg)
+{
+	char * const	keys[] = {
+		"dirs", "fanout", "files", "size", "xattrs", NULL
+	};
+	int		*vals[] = {
+		&pop_dirs, &pop_fanout, &pop_files, &pop_size, &pop_xattrs
+	};
+	char		*end;
+	char		*value;
+	long		v;
+	int		k;
+
+	while (*arg) {
+		k = getsubopt(&arg, keys, &value);
+		if (k < 0 || value == NULL) {
+			fprintf(stderr, "bad --populate argument '%s'\n",
+				value ? value : "");
+			exit(1);
+		}
+		v = strtol(value, &end, 0);
+		if (end == value || *end != '\0' || v < 0 || v > INT_MAX ||
+		    (k == 4 && v > 100)) {
+			fprintf(stderr, "bad --populate %s '%s'\n", keys[k],
+				value);
+			exit(1);
+		}
+		*vals[k] = v;
+	}
+}
+
+/*
+ * Read the --profile phases, building each its own op table from the
+ * -f/-z mix with its changes made to it.
+ */
+void
+profile_read(const char *dirname)
+{
+	char		line[4096];
+	char		where[PATH_MAX + 64];
+	double		base[OP_LAST];
+	FILE		*fp;
+	phase_t		*ph;
+	char		*end;
+	char		*tok;
+	long long	val;
+	int		lineno = 0;
+	int		i;
+
+	fp = fopen(profile_name, "r");
+	if (!fp) {
+		perror(profile_name);
+		exit(1);
+	}
+	for (i = 0; i < OP_LAST; i++)
+		base[i] = ops[i].freq;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if ((end = strchr(line, '#')) != NULL)
+			*end = '\0';
+		tok = strtok(line, " \t\n");
+		if (!tok)
+			continue;
+		phases = realloc(phases, ++nphases * sizeof(*phases));
+		ph = &phases[nphases - 1];
+		memset(ph, 0, sizeof(*ph));
+		snprintf(ph->name, sizeof(ph->name), "%s", tok);
+		while ((tok = strtok(NULL, " \t\n")) != NULL) {
+			if (strcmp(tok, "zero") == 0) {
+				zero_freq();
+				continue;
+			}
+			end = strchr(tok, '=');
+			if (!end) {
+				fprintf(stderr, "%s:%d: bad '%s'\n",
+					profile_name, lineno, tok);
+				exit(1);
+			}
+			if (strncmp(tok, "rate=", 5) == 0) {
+				ph->rate = strtod(end + 1, &end);
+				if (*end != '\0' || !(ph->rate > 0) ||
+				    isinf(ph->rate)) {
+					fprintf(stderr, "%s:%d: bad '%s'\n",
+						profile_name, lineno, tok);
+					exit(1);
+				}
+				rate_limited = 1;
+				continue;
+			}
+			if (strncmp(tok, "io-size=", 8) == 0) {
+				dist_parse(&ph->io_dist, end + 1, "io-size");
+				continue;
+			}
+			if (strncmp(tok, "file-size=", 10) == 0) {
+				dist_parse(&ph->fsize_dist, end + 1,
+					   "file-size");
+				continue;
+			}
+			if (strncmp(tok, "ops=", 4) && strncmp(tok, "duration=", 9) &&
+			    strncmp(tok, "workers=", 8) && strncmp(tok, "maxlen=", 7)) {
+				snprintf(where, sizeof(where), "%s:%d phase %s",
+					 profile_name, lineno, ph->name);
+				process_freq(tok, where);
+				continue;
+			}
+			val = strtoll(end + 1, &end, 0);
+			if (*end != '\0' || val < 0 ||
+			    (tok[0] != 'o' && val > INT_MAX)) {
+				fprintf(stderr, "%s:%d: bad '%s'\n",
+					profile_name, lineno, tok);
+				exit(1);
+			}
+			switch (tok[0]) {
+			case 'o':
+				ph->ops = val;
+				break;
+			case 'd':
+				ph->duration = val;
+				break;
+			case 'w':
+				ph->workers = val;
+				break;
+			case 'm':
+				ph->maxlen = val;
+				break;
+			}
+		}
+		if (!ph->ops && !ph->duration) {
+			fprintf(stderr, "%s:%d: phase %s needs ops= or duration=\n",
+				profile_name, lineno, ph->name);
+			exit(1);
+		}
+		non_btrfs_freq(dirname);
+		make_freq_table();
+		ph->freq_table = freq_table;
+		ph->freq_table_size = freq_table_size;
+		for (i = 0; i < OP_LAST; i++)
+			ops[i].freq = base[i];
+	}
+	fclose(fp);
+	if (!nphases) {
+		fprintf(stderr, "%s: no phases\n", profile_name);
+		exit(1);
+	}
+}
+
 void
-process_freq(char *arg)
+process_freq(char *arg, const char *opt)
 {
 	opdesc_t	*p;
 	char		*s;
+	char		*end;
 
 	s = strchr(arg, '=');
 	if (s == NULL) {
@@ -1792,14 +3825,142 @@ process_freq(char *arg)
 	*s++ = '\0';
 	for (p = ops; p < ops_end; p++) {
 		if (strcmp(arg, p->name) == 0) {
-			p->freq = atoi(s);
+			p->freq = strtod(s, &end);
+			if (end == s || *end != '\0' || !(p->freq >= 0) ||
+			    isinf(p->freq)) {
+				fprintf(stderr, "bad frequency '%s' for %s in %s\n",
+					s, arg, opt);
+				exit(1);
+			}
 			return;
 		}
 	}
-	fprintf(stderr, "can't find op type %s for -f\n", arg);
+	fprintf(stderr, "can't find op type %s for %s\n", arg, opt);
 	exit(1);
 }
 
+/*
+ * The gap in ns to the next op for one worker doing r ops/sec.
+ */
+long long
+rate_gap(double r)
+{
+	double	u;
+
+	if (!rate_poisson)
+		return 1e9 / r;
+	u = (random() + 1.0) / (RAND_MAX + 1.0);
+	return -log(u) * 1e9 / r;
+}
+
+/*
+ * With --rate, choose the next op and sleep until it is due.  Ops fall
+ * due on a fixed schedule however long the last ones took, so when the
+ * filesystem can't keep up it shows as ops issued late, which --report
+ * has, rather than just as fewer of them.  With per-op rates each op type
+ * has a schedule of its own and the one due soonest goes next.
+ */
+opdesc_t *
+rate_next(void)
+{
+	struct timespec	ts;
+	opdesc_t	*p;
+	long long	*due = &rate_due;
+	double		r;
+	int		op;
+	int		workers;
+
+	if (rate_by_op) {
+		p = NULL;
+		for (op = 0; op < OP_LAST; op++) {
+			if (op_rate[op] > 0 && (!p || op_due[op] < *due)) {
+				p = &ops[op];
+				due = &op_due[op];
+			}
+		}
+		r = op_rate[p - ops];
+	} else {
+		p = pick_op(random());
+		r = phase && phase->rate ? phase->rate : rate;
+		if (!r) {
+			/* a phase that doesn't keep to a rate */
+			rate_issued = 0;
+			return p;
+		}
+	}
+	ts.tv_sec = *due / 1000000000LL;
+	ts.tv_nsec = *due % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR && !should_stop)
+		;
+	rate_issued = *due;
+	/* the rate is shared by the workers the phase runs, not all of them */
+	workers = phase && phase->workers ? MIN(phase->workers, nproc) : nproc;
+	*due += rate_gap(r / workers);
+	return p;
+}
+
+void
+rate_parse(char *arg)
+{
+	char	*end;
+	char	*tok;
+	char	*val;
+	double	r;
+	int	op;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (strcmp(tok, "poisson") == 0) {
+			rate_poisson = 1;
+			continue;
+		}
+		if (strcmp(tok, "constant") == 0) {
+			rate_poisson = 0;
+			continue;
+		}
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+		r = strtod(val ? val : tok, &end);
+		if (end == (val ? val : tok) || *end != '\0' || !(r > 0) ||
+		    isinf(r)) {
+			fprintf(stderr, "bad --rate '%s'\n", val ? val : tok);
+			exit(1);
+		}
+		rate_limited = 1;
+		if (!val) {
+			rate = r;
+			continue;
+		}
+		for (op = 0; op < OP_LAST; op++) {
+			if (strcmp(tok, ops[op].name) == 0)
+				break;
+		}
+		if (op == OP_LAST) {
+			fprintf(stderr, "can't find op type %s for --rate\n",
+				tok);
+			exit(1);
+		}
+		op_rate[op] = r;
+		rate_by_op = 1;
+	}
+}
+
+/*
+ * Start this worker's schedules from now.
+ */
+void
+rate_reset(void)
+{
+	struct timespec	now;
+	int		op;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rate_due = now.tv_sec * 1000000000LL + now.tv_nsec;
+	for (op = 0; op < OP_LAST; op++)
+		op_due[op] = rate_due;
+}
+
 int
 readlink_path(pathname_t *name, char *lbuf, size_t lbufsiz)
 {
@@ -1807,7 +3968,7 @@ readlink_path(pathname_t *name, char *lbuf, size_t lbufsiz)
 	pathname_t	newname;
 	int		rval;
 
-	rval = readlink(name->path, lbuf, lbufsiz);
+	rval = readlinkat(name_dirfd(name), name_leaf(name), lbuf, lbufsiz);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1830,10 +3991,11 @@ rename_path(pathname_t *name1, pathname_t *name2, int mode)
 	int		rval;
 
 	if (mode == 0)
-		rval = rename(name1->path, name2->path);
+		rval = renameat(name_dirfd(name1), name_leaf(name1),
+				name_dirfd(name2), name_leaf(name2));
 	else
-		rval = renameat2(AT_FDCWD, name1->path,
-				 AT_FDCWD, name2->path, mode);
+		rval = renameat2(name_dirfd(name1), name_leaf(name1),
+				 name_dirfd(name2), name_leaf(name2), mode);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name1, buf1, &newname1);
@@ -1878,6 +4040,559 @@ rename_path(pathname_t *name1, pathname_t *name2, int mode)
 	return rval;
 }
 
+/*
+ * Redo one op from a trace with plain syscalls on the names recorded.
+ * Returns the errno it got, or 0.
+ */
+int
+replay_op(opty_t op, trace_rec_t *rec, const char *path, const char *path2)
+{
+	pathname_t	f;
+	pathname_t	newf;
+	struct stat64	stb;
+	struct iovec	*iov = NULL;
+	char		*buf = NULL;
+	char		*addr;
+	sigjmp_buf	sigbus_jmpbuf;
+	loff_t		off = rec->off;
+	loff_t		off2 = rec->off2;
+	off64_t		len = rec->len;
+	int		iovcnt = 1;
+	int		iswrite = 0;
+	int		flags = O_RDONLY;
+	int		fd = -1;
+	int		e = 0;
+	int		i;
+	ssize_t		ret;
+
+	init_pathname(&f);
+	init_pathname(&newf);
+	if (path)
+		append_pathname(&f, (char *)path);
+	if (path2)
+		append_pathname(&newf, (char *)path2);
+	switch (op) {
+	case OP_AFSYNC:
+	case OP_FDATASYNC:
+	case OP_FSYNC:
+		fd = open_file_or_dir(&f, O_WRONLY);
+		if (fd < 0) {
+			e = errno;
+			break;
+		}
+		if (op == OP_FDATASYNC)
+			e = fdatasync(fd) < 0 ? errno : 0;
+		else
+			e = fsync(fd) < 0 ? errno : 0;
+		break;
+	case OP_AWRITE:
+	case OP_DWRITE:
+	case OP_URING_WRITE:
+	case OP_WRITE:
+	case OP_WRITE_DONTCACHE:
+	case OP_WRITEV:
+		iswrite = 1;
+		flags = O_WRONLY;
+		/* fall through */
+	case OP_AREAD:
+	case OP_DREAD:
+	case OP_URING_READ:
+	case OP_READ:
+	case OP_READ_DONTCACHE:
+	case OP_READV:
+		if (op == OP_AREAD || op == OP_AWRITE ||
+		    op == OP_DREAD || op == OP_DWRITE)
+			flags |= O_DIRECT;
+		if (op == OP_READV || op == OP_WRITEV)
+			iovcnt = off2;
+		fd = open_path(&f, flags);
+		buf = memalign(getpagesize(), len ? len : 1);
+		iov = calloc(iovcnt, sizeof(*iov));
+		if (fd < 0 || !buf || !iov) {
+			e = fd < 0 ? errno : ENOMEM;
+			break;
+		}
+		if (iswrite)
+			memset(buf, rec->flags & 0xff, len);
+		for (i = 0; i < iovcnt; i++) {
+			iov[i].iov_base = buf + i * (len / iovcnt);
+			iov[i].iov_len = len / iovcnt;
+		}
+		i = (op == OP_READ_DONTCACHE || op == OP_WRITE_DONTCACHE) ?
+			RWF_DONTCACHE : 0;
+		if (iswrite)
+			ret = pwritev2(fd, iov, iovcnt, off, i);
+		else
+			ret = preadv2(fd, iov, iovcnt, off, i);
+		e = ret < 0 ? errno : 0;
+		break;
+	case OP_CHOWN:
+		e = lchown_path(&f, off, off2) < 0 ? errno : 0;
+		break;
+	case OP_CLONERANGE:
+#ifdef FICLONERANGE
+	{
+		struct file_clone_range	fcr;
+
+		fcr.src_fd = open_path(&f, O_RDONLY);
+		fd = open_path(&newf, O_WRONLY);
+		if (fcr.src_fd < 0 || fd < 0) {
+			e = errno;
+		} else {
+			fcr.src_offset = off;
+			fcr.src_length = len;
+			fcr.dest_offset = off2;
+			e = ioctl(fd, FICLONERANGE, &fcr) < 0 ? errno : 0;
+		}
+		if (fcr.src_fd >= 0)
+			close(fcr.src_fd);
+		break;
+	}
+#else
+		e = EOPNOTSUPP;
+		break;
+#endif
+	case OP_COPYRANGE:
+		i = open_path(&f, O_RDONLY);
+		fd = open_path(&newf, O_WRONLY);
+		if (i < 0 || fd < 0) {
+			e = errno;
+		} else {
+			ret = 0;
+			while (len > 0) {
+				ret = syscall(__NR_copy_file_range, i, &off,
+					      fd, &off2, len, 0);
+				if (ret <= 0 || ret > len)
+					break;
+				len -= ret;
+			}
+			e = ret < 0 ? errno : 0;
+		}
+		if (i >= 0)
+			close(i);
+		break;
+	case OP_EXCHANGE_RANGE:
+#ifdef XFS_IOC_EXCHANGE_RANGE
+	{
+		struct xfs_exchange_range	fxr = { 0 };
+
+		fxr.file1_fd = open_path(&f, O_RDWR);
+		fd = open_path(&newf, O_RDWR);
+		if (fxr.file1_fd < 0 || fd < 0) {
+			e = errno;
+		} else {
+			fxr.file1_offset = off;
+			fxr.length = len;
+			fxr.file2_offset = off2;
+			e = ioctl(fd, XFS_IOC_EXCHANGE_RANGE, &fxr) < 0 ?
+				errno : 0;
+		}
+		if (fxr.file1_fd >= 0)
+			close(fxr.file1_fd);
+		break;
+	}
+#else
+		e = EOPNOTSUPP;
+		break;
+#endif
+	case OP_CREAT:
+		fd = creat_path(&f, 0666);
+		e = fd < 0 ? errno : 0;
+		break;
+	case OP_FALLOCATE:
+	case OP_PUNCH:
+	case OP_ZERO:
+	case OP_COLLAPSE:
+	case OP_INSERT:
+	case OP_UNSHARE:
+		fd = open_path(&f, O_RDWR);
+		if (fd < 0)
+			e = errno;
+		else
+			e = fallocate(fd, rec->flags, off, len) < 0 ? errno : 0;
+		break;
+	case OP_LINK:
+		e = link_path(&f, &newf) < 0 ? errno : 0;
+		break;
+	case OP_MKDIR:
+		e = mkdir_path(&f, 0777) < 0 ? errno : 0;
+		break;
+	case OP_MKNOD:
+		e = mknod_path(&f, S_IFCHR|0666, 0) < 0 ? errno : 0;
+		break;
+	case OP_MREAD:
+	case OP_MWRITE:
+		fd = open_path(&f, O_RDWR);
+		if (fd < 0 || fstat64(fd, &stb) < 0) {
+			e = errno;
+			break;
+		}
+		/* stay inside the file, anything past EOF would SIGBUS */
+		if (off + len > stb.st_size)
+			len = stb.st_size - off;
+		if (len <= 0) {
+			e = EFAULT;
+			break;
+		}
+		i = op == OP_MWRITE ? PROT_WRITE : PROT_READ;
+		addr = mmap(NULL, len, i, rec->flags >> 8, fd, off);
+		if (addr == MAP_FAILED) {
+			e = errno;
+			break;
+		}
+		if (op == OP_MWRITE) {
+			if (sigsetjmp(sigbus_jmpbuf, 1) == 0) {
+				sigbus_jmp = &sigbus_jmpbuf;
+				memset(addr, rec->flags & 0xff, len);
+			} else
+				e = EFAULT;
+			sigbus_jmp = NULL;
+		} else if ((buf = malloc(len)) != NULL)
+			memcpy(buf, addr, len);
+		munmap(addr, len);
+		break;
+	case OP_REMOVEFATTR:
+		e = attr_remove_path(&f, path2) < 0 ? errno : 0;
+		break;
+	case OP_RENAME:
+	case OP_RNOREPLACE:
+	case OP_REXCHANGE:
+	case OP_RWHITEOUT:
+		e = rename_path(&f, &newf, rec->flags) < 0 ? errno : 0;
+		break;
+	case OP_RMDIR:
+		e = rmdir_path(&f) < 0 ? errno : 0;
+		break;
+	case OP_SETFATTR:
+		buf = gen_random_string(len);
+		e = attr_set_path(&f, path2, buf, len, rec->flags) < 0 ?
+			errno : 0;
+		break;
+	case OP_SPLICE:
+	{
+		int	filedes[2];
+
+		i = open_path(&f, O_RDONLY);
+		fd = open_path(&newf, O_WRONLY);
+		if (i < 0 || fd < 0 || pipe(filedes) < 0) {
+			e = errno;
+			if (i >= 0)
+				close(i);
+			break;
+		}
+		ret = 0;
+		while (len > 0) {
+			ssize_t	bytes;
+
+			bytes = splice(i, &off, filedes[1], NULL, len, 0);
+			if (bytes <= 0) {
+				ret = bytes;
+				break;
+			}
+			len -= bytes;
+			while (bytes > 0) {
+				ret = splice(filedes[0], NULL, fd, &off2,
+					     bytes, 0);
+				if (ret < 0)
+					break;
+				bytes -= ret;
+			}
+			if (ret < 0)
+				break;
+		}
+		e = ret < 0 ? errno : 0;
+		close(filedes[0]);
+		close(filedes[1]);
+		close(i);
+		break;
+	}
+	case OP_STAT:
+		e = lstat64_path(&f, &stb) < 0 ? errno : 0;
+		break;
+	case OP_SYMLINK:
+		e = symlink_path(path2, &f) < 0 ? errno : 0;
+		break;
+	case OP_SYNC:
+		fd = open(".", O_RDONLY|O_DIRECTORY);
+		if (fd < 0)
+			e = errno;
+		else
+			e = syncfs(fd) < 0 ? errno : 0;
+		break;
+	case OP_TRUNCATE:
+		e = truncate64_path(&f, off) < 0 ? errno : 0;
+		break;
+	case OP_UNLINK:
+		e = unlink_path(&f) < 0 ? errno : 0;
+		break;
+	default:
+		e = EOPNOTSUPP;
+		break;
+	}
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	free(iov);
+	free_pathname(&f);
+	free_pathname(&newf);
+	return e;
+}
+
+/*
+ * Replay this worker's trace from --replay-ops in place of the random
+ * ops.  With --replay-order the workers take their turns by the global
+ * sequence number.  Returns the number of ops whose result differed from
+ * the one recorded.
+ */
+int
+replay_ops(void)
+{
+	char		path[PATH_MAX];
+	char		dir[16];
+	struct stat64	stb;
+	trace_hdr_t	*hdr;
+	trace_rec_t	*rec;
+	char		*base;
+	char		*cur;
+	char		*end;
+	char		*p1;
+	char		*p2;
+	int		*opmap;
+	long long	count = 0;
+	long long	skipped = 0;
+	long long	mismatch = 0;
+	int		fd;
+	int		op;
+	int		e;
+	int		i;
+	int		j;
+
+	snprintf(path, sizeof(path), "%s.%d", replay_name, procid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat64(fd, &stb) < 0) {
+		perror(path);
+		exit(1);
+	}
+	base = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	hdr = (trace_hdr_t *)base;
+	if (base == MAP_FAILED || stb.st_size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s: not an fsstress op trace\n", path);
+		exit(1);
+	}
+	end = base + stb.st_size;
+
+	/* the trace names its ops, they need not be numbered as ours are */
+	opmap = calloc(hdr->nops, sizeof(*opmap));
+	cur = base + sizeof(*hdr);
+	for (i = 0; i < hdr->nops && cur < end; i++) {
+		for (j = 0; j < OP_LAST; j++)
+			if (strcmp(cur, ops[j].name) == 0)
+				break;
+		opmap[i] = (j < OP_LAST || strcmp(cur, "cleanup") == 0) ?
+			j : -1;
+		cur += strnlen(cur, end - cur) + 1;
+	}
+	cur = base + TRACE_ALIGN(cur - base);
+
+	sprintf(dir, "p%x", hdr->dir);
+	(void)mkdir(dir, 0777);
+	if (chdir(dir) < 0) {
+		perror(dir);
+		exit(1);
+	}
+	while (cur + sizeof(*rec) <= end && !should_stop) {
+		rec = (trace_rec_t *)cur;
+		p1 = rec->plen ? cur + sizeof(*rec) : NULL;
+		p2 = rec->plen2 ? cur + sizeof(*rec) + rec->plen : NULL;
+		cur += sizeof(*rec) + TRACE_ALIGN(rec->plen + rec->plen2);
+		if (cur > end)
+			break;
+		if (replay_order)
+			replay_wait(rec->seq);
+		op = rec->op < hdr->nops ? opmap[rec->op] : -1;
+		if (op == TRACE_CLEANUP) {
+			assert(chdir("..") == 0);
+			snprintf(path, sizeof(path), "rm -rf %s", dir);
+			if (system(path) != 0)
+				perror("cleaning up");
+			(void)mkdir(dir, 0777);
+			if (chdir(dir) < 0) {
+				perror(dir);
+				exit(1);
+			}
+			e = 0;
+		} else if (op < 0) {
+			skipped++;
+			e = rec->err;
+		} else {
+			count++;
+			e = replay_op(op, rec, p1, p2);
+		}
+		if (replay_order)
+			__atomic_store_n(trace_seq, rec->seq + 1,
+					 __ATOMIC_RELEASE);
+		if (e != rec->err)
+			mismatch++;
+		if (verbose)
+			printf("%d/%lld: replay %s %s%s%s %d (was %d)\n",
+			       procid, (long long)rec->opno,
+			       op < 0 ? "?" : op == TRACE_CLEANUP ?
+			       "cleanup" : ops[op].name,
+			       p1 ? p1 : "", p2 ? " " : "", p2 ? p2 : "",
+			       e, rec->err);
+	}
+	if (replay_order)
+		__atomic_store_n(&trace_seq[1 + procid], INT64_MAX,
+				 __ATOMIC_RELEASE);
+	assert(chdir("..") == 0);
+	printf("%d: replayed %lld ops, %lld skipped, %lld results differ\n",
+	       procid, count, skipped, mismatch);
+	free(opmap);
+	munmap(base, stb.st_size);
+	return mismatch;
+}
+
+/*
+ * Wait for the op numbered seq to be next with --replay-order.  Ops can
+ * be missing from the trace, such as those under way when the recording
+ * was killed.  Once every worker is waiting for a later op than the next
+ * one, that one will never come, and the worker with the lowest op waiting
+ * goes ahead.
+ */
+void
+replay_wait(int64_t seq)
+{
+	int64_t		cur;
+	int64_t		low;
+	int		i;
+
+	__atomic_store_n(&trace_seq[1 + procid], seq, __ATOMIC_RELEASE);
+	while ((cur = __atomic_load_n(trace_seq, __ATOMIC_ACQUIRE)) < seq &&
+	       !should_stop) {
+		low = INT64_MAX;
+		for (i = 0; i < nproc; i++)
+			low = MIN(low, __atomic_load_n(&trace_seq[1 + i],
+						       __ATOMIC_ACQUIRE));
+		if (low == seq)
+			__atomic_compare_exchange_n(trace_seq, &cur, seq,
+						    false, __ATOMIC_ACQ_REL,
+						    __ATOMIC_ACQUIRE);
+		else
+			sched_yield();
+	}
+}
+
+/*
+ * Write a line of JSON with what each op type and each worker has done
+ * so far.  The workers carry on meanwhile, so an interim report can be
+ * off by the odd op.
+ */
+void
+report_print(bool final)
+{
+	struct timespec		now;
+	opstat_t		sum;
+	opstat_t		lag;
+	opstat_t		*os;
+	unsigned long long	total;
+	double			elapsed;
+	const char		*sep;
+	int			b;
+	int			i;
+	int			op;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - report_start.tv_sec) +
+		(now.tv_nsec - report_start.tv_nsec) / 1e9;
+	fprintf(report_fp, "{\"elapsed\": %.3f, \"final\": %s, \"workers\": [",
+		elapsed, final ? "true" : "false");
+	for (i = 0; i < nproc; i++) {
+		total = 0;
+		for (op = 0; op < OP_LAST; op++)
+			total += opstats[i * OP_LAST + op].count;
+		fprintf(report_fp, "%s{\"id\": %d, \"ops\": %llu, \"ops_per_sec\": %.1f}",
+			i ? ", " : "", i, total, total / elapsed);
+	}
+	fprintf(report_fp, "], \"ops\": {");
+	sep = "";
+	for (op = 0; op < OP_LAST; op++) {
+		memset(&sum, 0, sizeof(sum));
+		memset(&lag, 0, sizeof(lag));
+		for (i = 0; i < nproc; i++) {
+			os = &opstats[i * OP_LAST + op];
+			sum.count += os->count;
+			sum.ns += os->ns;
+			sum.max_ns = MAX(sum.max_ns, os->max_ns);
+			for (b = 0; b < LAT_BUCKETS; b++)
+				sum.hist[b] += os->hist[b];
+			if (!lagstats)
+				continue;
+			os = &lagstats[i * OP_LAST + op];
+			lag.count += os->count;
+			lag.ns += os->ns;
+			lag.max_ns = MAX(lag.max_ns, os->max_ns);
+			for (b = 0; b < LAT_BUCKETS; b++)
+				lag.hist[b] += os->hist[b];
+		}
+		if (!sum.count)
+			continue;
+		fprintf(report_fp, "%s\"%s\": {\"count\": %llu, \"ops_per_sec\": %.1f, "
+			"\"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+			"\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, "
+			"\"hist\": [",
+			sep, ops[op].name, sum.count, sum.count / elapsed,
+			sum.ns / sum.count, lat_percentile(&sum, 500),
+			lat_percentile(&sum, 900), lat_percentile(&sum, 990),
+			lat_percentile(&sum, 999), sum.max_ns);
+		sep = "";
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			if (!sum.hist[b])
+				continue;
+			fprintf(report_fp, "%s[%llu, %llu]", sep,
+				lat_bucket_ns(b), sum.hist[b]);
+			sep = ", ";
+		}
+		fprintf(report_fp, "]");
+		if (lag.count)
+			fprintf(report_fp, ", \"lag_mean_ns\": %llu, "
+				"\"lag_p50_ns\": %llu, \"lag_p99_ns\": %llu, "
+				"\"lag_p999_ns\": %llu, \"lag_max_ns\": %llu",
+				lag.ns / lag.count, lat_percentile(&lag, 500),
+				lat_percentile(&lag, 990),
+				lat_percentile(&lag, 999), lag.max_ns);
+		fprintf(report_fp, "}");
+		sep = ", ";
+	}
+	fprintf(report_fp, "}}\n");
+	fflush(report_fp);
+}
+
+/*
+ * Runs in the parent, writing a report every report_interval seconds
+ * until report_done is set.
+ */
+void *
+report_worker(void *arg)
+{
+	struct timespec	next;
+
+	clock_gettime(CLOCK_REALTIME, &next);
+	pthread_mutex_lock(&report_lock);
+	while (!report_done) {
+		next.tv_sec += report_interval;
+		while (!report_done &&
+		       pthread_cond_timedwait(&report_cond, &report_lock,
+					      &next) != ETIMEDOUT)
+			;
+		if (!report_done)
+			report_print(false);
+	}
+	pthread_mutex_unlock(&report_lock);
+	return NULL;
+}
+
 int
 rmdir_path(pathname_t *name)
 {
@@ -1885,7 +4600,7 @@ rmdir_path(pathname_t *name)
 	pathname_t	newname;
 	int		rval;
 
-	rval = rmdir(name->path);
+	rval = unlinkat(name_dirfd(name), name_leaf(name), AT_REMOVEDIR);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1933,7 +4648,7 @@ show_ops(int flag, char *lead_str)
                 printf("\n");
         } else if (flag == 0) {
 		/* Table view style */
-	        int		f;
+	        double		f;
 	        for (f = 0, p = ops; p < ops_end; p++)
 		        f += p->freq;
 
@@ -1944,7 +4659,7 @@ show_ops(int flag, char *lead_str)
 		        if (flag != 0 || p->freq > 0) {
 			        if (lead_str != NULL)
 				        printf("%s", lead_str);
-			        printf("%20s %d/%d %s\n",
+			        printf("%20s %g/%g %s\n",
 			        p->name, p->freq, f,
 			        (p->iswrite == 0) ? " " : "write op");
 		        }
@@ -1957,7 +4672,7 @@ show_ops(int flag, char *lead_str)
 			operations, nproc);
 	        for (p = ops; p < ops_end; p++)
 		        if (p->freq > 0)
-			        printf("-f %s=%d \\\n",p->name, p->freq);
+			        printf("-f %s=%g \\\n",p->name, p->freq);
 	}
 }
 
@@ -1968,7 +4683,7 @@ stat64_path(pathname_t *name, struct stat64 *sbuf)
 	pathname_t	newname;
 	int		rval;
 
-	rval = stat64(name->path, sbuf);
+	rval = fstatat64(name_dirfd(name), name_leaf(name), sbuf, 0);
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -1980,6 +4695,191 @@ stat64_path(pathname_t *name, struct stat64 *sbuf)
 	return rval;
 }
 
+/*
+ * Read back what state_save() left for this worker, if anything.
+ */
+wstate_t *
+state_read(void)
+{
+	char		path[PATH_MAX];
+	char		magic[sizeof(STATE_MAGIC)];
+	char		rng[RNG_STATE_LEN * 2 + 1];
+	wstate_t	*ws;
+	FILE		*fp;
+	int		i;
+
+	snprintf(path, sizeof(path), "%s.%d", state_name, procid);
+	fp = fopen(path, "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			return NULL;
+		perror(path);
+		exit(1);
+	}
+	ws = calloc(1, sizeof(*ws));
+	if (!ws) {
+		perror("calloc");
+		exit(1);
+	}
+	if (fscanf(fp, "%16s nameseq %d namerand %d seed %lu random %256s",
+		   magic, &ws->nameseq, &ws->namerand, &ws->seed, rng) != 5 ||
+	    strcmp(magic, STATE_MAGIC) || strlen(rng) != RNG_STATE_LEN * 2) {
+		fprintf(stderr, "%s: not an fsstress state file\n", path);
+		exit(1);
+	}
+	fclose(fp);
+	for (i = 0; i < RNG_STATE_LEN; i++)
+		sscanf(&rng[i * 2], "%2hhx", &((unsigned char *)ws->rng)[i]);
+	if (verbose)
+		printf("%d: carrying on from %s, nameseq %d\n", procid, path,
+		       ws->nameseq);
+	return ws;
+}
+
+/*
+ * Carry on from saved state: rebuild the file lists from the tree in the
+ * current directory, and take up the naming and, if asked, the random
+ * sequence where they left off.
+ */
+void
+state_restore(wstate_t *ws, bool rng)
+{
+	int	next;
+
+	cleanup_flist();
+	next = state_scan(-1);
+	nsp->nameseq = MAX(ws->nameseq, next);
+	if (namerand)
+		nsp->namerand = ws->namerand;
+	nsp->dirpath_gen++;
+	if (rng) {
+		seed = ws->seed;
+		state_rng(ws->rng);
+	}
+}
+
+/*
+ * Make saved state the random() state.  It has to go through a copy,
+ * as setstate() writes the position of the current state back into it
+ * and that is rng_state already.
+ */
+void
+state_rng(int32_t *saved)
+{
+	int32_t	tmp[RNG_STATE_LEN / sizeof(int32_t)];
+
+	memcpy(tmp, saved, sizeof(tmp));
+	setstate((char *)tmp);
+	memcpy(rng_state, saved, sizeof(rng_state));
+	setstate((char *)rng_state);
+}
+
+/*
+ * Save this worker's naming and random state for --state.  The file is
+ * replaced by a rename so that a crash never leaves half of one.
+ */
+void
+state_save(void)
+{
+	char	path[PATH_MAX];
+	char	tmp[PATH_MAX + 4];
+	FILE	*fp;
+	int	i;
+
+	snprintf(path, sizeof(path), "%s.%d", state_name, procid);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		perror(tmp);
+		return;
+	}
+	/* this writes the position in the sequence into rng_state */
+	setstate((char *)rng_state);
+	fprintf(fp, "%s\nnameseq %d\nnamerand %d\nseed %lu\nrandom ",
+		STATE_MAGIC, nsp->nameseq, nsp->namerand, seed);
+	for (i = 0; i < RNG_STATE_LEN; i++)
+		fprintf(fp, "%02x", ((unsigned char *)rng_state)[i]);
+	fprintf(fp, "\n");
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		perror(tmp);
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	fclose(fp);
+	if (rename(tmp, path) < 0)
+		perror(path);
+}
+
+/*
+ * Add what's in the current directory, and below, to the file lists as
+ * children of parent, taking the type and id from the name as it was
+ * made by generate_fname().  Anything else is left out.  Returns one past
+ * the highest id seen.
+ */
+int
+state_scan(int parent)
+{
+	DIR		*dir;
+	struct dirent	*de;
+	struct stat64	stb;
+	char		*p;
+	int		next = 0;
+	int		ft;
+	int		id;
+
+	dir = opendir(".");
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)) != NULL) {
+		for (ft = 0; ft < FT_nft; ft++)
+			if (de->d_name[0] == nsp->flist[ft].tag)
+				break;
+		if (ft == FT_nft || !isxdigit(de->d_name[1]))
+			continue;
+		id = strtol(de->d_name + 1, &p, 16);
+		if (p[strspn(p, "X")] != '\0' ||
+		    lstat64(de->d_name, &stb) < 0)
+			continue;
+		add_to_flist(ft, id, parent, state_xattr_count(de->d_name));
+		next = MAX(next, id + 1);
+		if ((ft == FT_DIR || ft == FT_SUBVOL) && S_ISDIR(stb.st_mode) &&
+		    chdir(de->d_name) == 0) {
+			id = state_scan(id);
+			next = MAX(next, id);
+			assert(chdir("..") == 0);
+		}
+	}
+	closedir(dir);
+	return next;
+}
+
+/*
+ * One past the highest numbered xattr that setfattr_f() left on a file.
+ */
+int
+state_xattr_count(const char *name)
+{
+	char	*buf;
+	char	*p;
+	ssize_t	len;
+	int	count = 0;
+	int	n;
+
+	len = llistxattr(name, NULL, 0);
+	if (len <= 0)
+		return 0;
+	buf = malloc(len);
+	if (!buf)
+		return 0;
+	len = llistxattr(name, buf, len);
+	for (p = buf; len > 0 && p < buf + len; p += strlen(p) + 1)
+		if (sscanf(p, "user.x%d", &n) == 1)
+			count = MAX(count, n + 1);
+	free(buf);
+	return count;
+}
+
 int
 symlink_path(const char *name1, pathname_t *name)
 {
@@ -1992,7 +4892,7 @@ symlink_path(const char *name1, pathname_t *name)
             return 0;
         }
 
-	rval = symlink(name1, name->path);
+	rval = symlinkat(name1, name_dirfd(name), name_leaf(name));
 	if (rval >= 0 || errno != ENAMETOOLONG)
 		return rval;
 	separate_pathname(name, buf, &newname);
@@ -2004,6 +4904,109 @@ symlink_path(const char *name1, pathname_t *name)
 	return rval;
 }
 
+/*
+ * Finish this worker's trace.
+ */
+void
+trace_close(void)
+{
+	if (!trace_fp)
+		return;
+	if (fclose(trace_fp) != 0)
+		perror("writing op trace");
+	trace_fp = NULL;
+}
+
+/*
+ * Append an op to this worker's trace, if --record-ops asked for one.
+ * The pathnames follow the record, padded so the next one is aligned.
+ */
+void
+trace_op(opty_t op, opnum_t opno, const char *path, const char *path2,
+	 off64_t off, off64_t off2, off64_t len, int flags, int e)
+{
+	static const char	zero[8];
+	trace_rec_t		rec = { 0 };
+
+	if (!trace_fp)
+		return;
+	rec.seq = __atomic_fetch_add(trace_seq, 1, __ATOMIC_RELAXED);
+	rec.opno = opno;
+	rec.off = off;
+	rec.off2 = off2;
+	rec.len = len;
+	rec.flags = flags;
+	rec.err = e;
+	rec.plen = path ? strlen(path) + 1 : 0;
+	rec.plen2 = path2 ? strlen(path2) + 1 : 0;
+	rec.op = op;
+	fwrite(&rec, sizeof(rec), 1, trace_fp);
+	if (path)
+		fwrite(path, rec.plen, 1, trace_fp);
+	if (path2)
+		fwrite(path2, rec.plen2, 1, trace_fp);
+	fwrite(zero, TRACE_ALIGN(rec.plen + rec.plen2) -
+	       (rec.plen + rec.plen2), 1, trace_fp);
+}
+
+/*
+ * Start this worker's trace, <prefix>.<procid>, with its header.
+ */
+int
+trace_open(void)
+{
+	static const char	zero[8];
+	char			path[PATH_MAX];
+	trace_hdr_t		hdr;
+	size_t			len = sizeof(hdr);
+	int			i;
+
+	snprintf(path, sizeof(path), "%s.%d", trace_name, procid);
+	trace_fp = fopen(path, "w");
+	if (!trace_fp) {
+		perror(path);
+		return -1;
+	}
+	setvbuf(trace_fp, NULL, _IOFBF, 1 << 20);
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.dir = shared_nspace ? 0 : procid;
+	hdr.nops = OP_LAST + 1;
+	fwrite(&hdr, sizeof(hdr), 1, trace_fp);
+	for (i = 0; i < OP_LAST; i++) {
+		fwrite(ops[i].name, strlen(ops[i].name) + 1, 1, trace_fp);
+		len += strlen(ops[i].name) + 1;
+	}
+	fwrite("cleanup", sizeof("cleanup"), 1, trace_fp);
+	len += sizeof("cleanup");
+	fwrite(zero, TRACE_ALIGN(len) - len, 1, trace_fp);
+	return 0;
+}
+
+/*
+ * Trace and state prefixes are taken relative to where we were started,
+ * not to the test directory.
+ */
+char *
+trace_path(const char *prefix)
+{
+	char	cwd[PATH_MAX];
+	char	*path;
+
+	if (prefix[0] == '/')
+		return strdup(prefix);
+	if (!getcwd(cwd, sizeof(cwd))) {
+		perror("getcwd failed");
+		exit(1);
+	}
+	path = malloc(strlen(cwd) + strlen(prefix) + 2);
+	if (!path) {
+		perror("malloc");
+		exit(1);
+	}
+	sprintf(path, "%s/%s", cwd, prefix);
+	return path;
+}
+
 int
 truncate64_path(pathname_t *name, off64_t length)
 {
@@ -2011,35 +5014,268 @@ truncate64_path(pathname_t *name, off64_t length)
 	pathname_t	newname;
 	int		rval;
 
-	rval = truncate64(name->path, length);
-	if (rval >= 0 || errno != ENAMETOOLONG)
-		return rval;
-	separate_pathname(name, buf, &newname);
-	if (chdir(buf) == 0) {
-		rval = truncate64_path(&newname, length);
-		assert(chdir("..") == 0);
+	rval = truncate64(name->path, length);
+	if (rval >= 0 || errno != ENAMETOOLONG)
+		return rval;
+	separate_pathname(name, buf, &newname);
+	if (chdir(buf) == 0) {
+		rval = truncate64_path(&newname, length);
+		assert(chdir("..") == 0);
+	}
+	free_pathname(&newname);
+	return rval;
+}
+
+int
+unlink_path(pathname_t *name)
+{
+	char		buf[NAME_MAX + 1];
+	pathname_t	newname;
+	int		rval;
+
+	rval = unlinkat(name_dirfd(name), name_leaf(name), 0);
+	if (rval >= 0 || errno != ENAMETOOLONG)
+		return rval;
+	separate_pathname(name, buf, &newname);
+	if (chdir(buf) == 0) {
+		rval = unlink_path(&newname);
+		assert(chdir("..") == 0);
+	}
+	free_pathname(&newname);
+	return rval;
+}
+
+/*
+ * The entry for block blk of file ino, or NULL if there is none and add
+ * isn't set.  The table doubles when it is three quarters full.
+ */
+vgen_t *
+vgen_find(uint64_t ino, uint64_t blk, bool add)
+{
+	vgen_t		*old;
+	size_t		oldsize;
+	size_t		i;
+	uint64_t	h;
+
+	if (add && (vgen_count + 1) * 4 > vgen_size * 3) {
+		old = vgens;
+		oldsize = vgen_size;
+		vgen_size = vgen_size ? vgen_size * 2 : 4096;
+		vgens = calloc(vgen_size, sizeof(*vgens));
+		if (!vgens) {
+			perror("verify table");
+			exit(1);
+		}
+		vgen_count = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].ino || old[i].blk)
+				*vgen_find(old[i].ino, old[i].blk, true) = old[i];
+		free(old);
+	}
+	if (!vgen_size)
+		return NULL;
+	h = (ino * 0x9e3779b97f4a7c15ULL) ^ blk;
+	h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ULL;
+	for (i = (h ^ (h >> 29)) & (vgen_size - 1); ;
+	     i = (i + 1) & (vgen_size - 1)) {
+		if (vgens[i].ino == ino && vgens[i].blk == blk)
+			return &vgens[i];
+		if (!vgens[i].ino && !vgens[i].blk)
+			break;
+	}
+	if (!add)
+		return NULL;
+	vgen_count++;
+	vgens[i].ino = ino;
+	vgens[i].blk = blk;
+	vgens[i].gen = 0;
+	return &vgens[i];
+}
+
+/*
+ * A write of the len bytes fill_buf made in buf to off in file ino has
+ * returned done: the blocks it wrote whole now hold their new gen, one
+ * it wrote part of can't be known, and the rest keep what they had.
+ */
+void
+verify_wrote(const char *buf, uint64_t ino, off64_t off, size_t len,
+	     ssize_t done)
+{
+	size_t	b;
+
+	if (!verify || done <= 0)
+		return;
+	for (b = 0; b < len && b < done; b += VERIFY_BLOCK)
+		vgen_find(ino, (off + b) / VERIFY_BLOCK, true)->gen =
+			b + VERIFY_BLOCK <= done ?
+			((const vblock_t *)(buf + b))->h.gen : 0;
+}
+
+/*
+ * The blocks from off for len in file ino may or may not have been
+ * written, as when a mapped write took a SIGBUS part way.
+ */
+void
+verify_forget(uint64_t ino, off64_t off, size_t len)
+{
+	vgen_t	*vg;
+	size_t	b;
+
+	if (!verify)
+		return;
+	for (b = 0; b < len; b += VERIFY_BLOCK)
+		if ((vg = vgen_find(ino, (off + b) / VERIFY_BLOCK, false)))
+			vg->gen = 0;
+}
+
+/*
+ * Blocks have been moved into file ino from elsewhere in it or from
+ * another file, so they no longer have to name it or where they are.
+ */
+void
+verify_moved(uint64_t ino)
+{
+	if (verify)
+		vgen_find(ino, VERIFY_MOVED, true);
+}
+
+/*
+ * Check the whole verify blocks among the n bytes read from off in path,
+ * file ino, into buf.  A block of zeroes is a hole, or was punched or
+ * zeroed; any other has to be as fill_buf made it, name this file and
+ * offset, and be from the last write there that this worker knows of.
+ * Files that blocks were moved into are only held to the first.
+ */
+void
+verify_check(opnum_t opno, const char *path, uint64_t ino, const char *buf,
+	     off64_t off, ssize_t n)
+{
+	vblock_t	vb;
+	vgen_t		*vg;
+	uint64_t	any;
+	const char	*bad;
+	uint32_t	want;
+	bool		moved;
+	off64_t		b;
+	int		i;
+
+	if (!verify || n <= 0)
+		return;
+	moved = !ino || vgen_find(ino, VERIFY_MOVED, false) != NULL;
+	for (b = roundup_64(off, VERIFY_BLOCK) - off; b + VERIFY_BLOCK <= n;
+	     b += VERIFY_BLOCK) {
+		memcpy(&vb, buf + b, sizeof(vb));
+		any = 0;
+		for (i = 0; i < VERIFY_BLOCK / 8; i++)
+			any |= vb.w[i];
+		if (!any)
+			continue;
+		want = 0;
+		if (vb.h.magic != VERIFY_MAGIC)
+			bad = "magic";
+		else if (vb.h.csum != verify_csum(&vb))
+			bad = "checksum";
+		else if (moved)
+			continue;
+		else if (vb.h.ino != ino || vb.h.off != off + b)
+			bad = "place";
+		else if ((vg = vgen_find(ino, (off + b) / VERIFY_BLOCK,
+					 false)) && vg->gen &&
+			 vg->gen != vb.h.gen) {
+			bad = "gen";
+			want = vg->gen;
+		} else
+			continue;
+		verify_errors++;
+		fprintf(stderr, "%d/%lld: verify %s [%lld,%d] bad %s, written "
+			"as ino %llu off %lld gen %u", procid, opno, path,
+			(long long)(off + b), VERIFY_BLOCK, bad,
+			(unsigned long long)vb.h.ino, (long long)vb.h.off,
+			vb.h.gen);
+		if (want)
+			fprintf(stderr, ", expected gen %u", want);
+		fprintf(stderr, "\n");
+	}
+}
+
+/*
+ * Checksum of a verify block, leaving out the checksum itself.  Each word
+ * has its own odd weight so that changing any one always shows, and the
+ * terms don't depend on each other so the loop vectorises.
+ */
+uint64_t
+verify_csum(const vblock_t *vb)
+{
+	uint64_t	sum = 0;
+	int		i;
+
+	for (i = 0; i < VERIFY_BLOCK / 8; i++)
+		sum += vb->w[i] * (2 * i + 1);
+	return sum - vb->w[VERIFY_CSUM_WORD] * (2 * VERIFY_CSUM_WORD + 1);
+}
+
+/*
+ * Read all of every regular file through verify_check.
+ */
+void
+verify_sweep(opnum_t opno)
+{
+	char		*buf;
+	fent_t		*fep;
+	flist_t		*flp;
+	pathname_t	f;
+	struct stat64	stb;
+	off64_t		off;
+	ssize_t		n;
+	int		fd;
+	int		ft;
+	int		i;
+	int		nfiles = 0;
+
+	buf = malloc(VERIFY_SWEEP_LEN);
+	for (ft = 0, flp = nsp->flist; ft < FT_nft; ft++, flp++) {
+		if (!((1 << ft) & FT_REGFILE))
+			continue;
+		for (i = 0, fep = flp->fents; i < flp->nfiles; i++, fep++) {
+			init_pathname(&f);
+			if (fent_to_name(&f, fep) &&
+			    (fd = open_path(&f, O_RDONLY)) >= 0) {
+				if (fstat64(fd, &stb) < 0)
+					stb.st_ino = 0;
+				for (off = 0; (n = pread(fd, buf,
+						VERIFY_SWEEP_LEN, off)) > 0;
+				     off += n)
+					verify_check(opno, f.path, stb.st_ino,
+						     buf, off, n);
+				close(fd);
+				nfiles++;
+			}
+			free_pathname(&f);
+		}
 	}
-	free_pathname(&newname);
-	return rval;
+	free(buf);
+	if (verbose || verify_errors)
+		printf("%d: verify swept %d files, %d bad blocks so far\n",
+			procid, nfiles, verify_errors);
 }
 
-int
-unlink_path(pathname_t *name)
+/*
+ * A rank in 1..n whose probability falls off as rank^-s, from u uniform
+ * in [0, 1), by inverting the continuous approximation of the CDF.
+ */
+double
+zipf_rank(double u, double s, double n)
 {
-	char		buf[NAME_MAX + 1];
-	pathname_t	newname;
-	int		rval;
+	double	x;
 
-	rval = unlink(name->path);
-	if (rval >= 0 || errno != ENAMETOOLONG)
-		return rval;
-	separate_pathname(name, buf, &newname);
-	if (chdir(buf) == 0) {
-		rval = unlink_path(&newname);
-		assert(chdir("..") == 0);
-	}
-	free_pathname(&newname);
-	return rval;
+	if (n <= 1)
+		return 1;
+	if (fabs(s - 1) < 1e-9)
+		x = pow(n + 1, u);
+	else
+		x = pow(u * (pow(n + 1, 1 - s) - 1) + 1, 1 / (1 - s));
+	x = floor(x);
+	return x < 1 ? 1 : x > n ? n : x;
 }
 
 void
@@ -2075,6 +5311,57 @@ usage(void)
 	printf("   -X ncmd          number of calls to the -x command (default 1)\n");
 	printf("   -H               prints usage and exits\n");
 	printf("   --duration=s     ignore any -n setting and run for this many seconds\n");
+	printf("   --dirfds         resolve names with *at() calls relative to cached\n");
+	printf("                    O_PATH fds of their parent directories\n");
+	printf("   --threads        run the -p workers as threads of one process; they\n");
+	printf("                    share the random sequence and the -o logfile\n");
+	printf("   --shared-namespace  with --threads, all threads work on the same\n");
+	printf("                    files in p0 instead of each in its own directory\n");
+	printf("   --uring-depth=n  keep up to n ops per worker in flight through\n");
+	printf("                    io_uring; the ops it can't do run synchronously\n");
+	printf("   --report[=file]  at exit, write per-op latency percentiles and\n");
+	printf("                    histograms and ops/sec as a line of JSON to file\n");
+	printf("                    (default stdout)\n");
+	printf("   --report-interval=s  also write a --report line every s seconds\n");
+	printf("   --record-ops=prefix  write each worker's ops to a binary trace,\n");
+	printf("                    prefix.<worker>\n");
+	printf("   --replay-ops=prefix  redo the ops of the prefix.* traces, one worker\n");
+	printf("                    to a trace, and count results that differ\n");
+	printf("   --replay-order   with --replay-ops, keep to the order the ops were\n");
+	printf("                    recorded in across all the workers\n");
+	printf("   --state=prefix   save each worker's name and random state to\n");
+	printf("                    prefix.<worker> when it stops; if that is there at\n");
+	printf("                    start, carry on from it and the tree left in pN\n");
+	printf("   --populate=dirs=n,fanout=f,files=m,size=s,xattrs=pct\n");
+	printf("                    before the ops, each worker builds a tree of n\n");
+	printf("                    directories, f under each, holding m files of up\n");
+	printf("                    to s bytes, pct%% of them with an xattr\n");
+	printf("   --live-stats     keep per-worker op, error and file counts in\n");
+	printf("                    shared memory, /dev/shm/fsstress.<pid>\n");
+	printf("   --stats=pid      print the --live-stats of fsstress pid and exit\n");
+	printf("   --verify         write self-checking blocks, check them on every\n");
+	printf("                    read and in all files at the end, and exit 1 if\n");
+	printf("                    any are bad\n");
+	printf("   --profile=file   run through the phases in file, one a line:\n");
+	printf("                    name [ops=n] [duration=s] [workers=n] [maxlen=n]\n");
+	printf("                    [rate=r] [io-size=dist] [file-size=dist] [zero]\n");
+	printf("                    [op_name=freq ...]; each starts\n");
+	printf("                    from the -f/-z mix, zero clears it, and -n doesn't\n");
+	printf("                    apply\n");
+	printf("   --rate=r[,op_name=r...][,poisson]  issue r ops/sec over all the\n");
+	printf("                    workers on a fixed schedule, or r of each op type\n");
+	printf("                    named, evenly spaced or as a Poisson process;\n");
+	printf("                    --report then has how late they were issued\n");
+	printf("   --io-size=dist   draw read and write lengths from dist, one of\n");
+	printf("                    fixed:n, uniform:min:max, zipf:s[:n],\n");
+	printf("                    lognormal:median:sigma or file:path (lines of\n");
+	printf("                    \"value [weight]\"); sizes take k/m/g suffixes\n");
+	printf("   --file-size=dist give each file a target size from dist, within\n");
+	printf("                    which its writes, truncates and allocations start\n");
+	printf("   --offset=dist    draw read and write offsets from dist; zipf ranks\n");
+	printf("                    4k blocks spread over the file, for hot spots\n");
+	printf("   --hot-files=s    pick files by a zipf of exponent s rather than\n");
+	printf("                    evenly, so a few take most of the ops\n");
 }
 
 void
@@ -2176,7 +5463,7 @@ afsync_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_file_or_dir(&f, O_WRONLY | O_DIRECT);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -2204,7 +5491,8 @@ afsync_f(opnum_t opno, long r)
 		return;
 	}
 
-	e = event.res2;
+	e = op_failed(event.res2);
+	trace_op(OP_AFSYNC, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v)
 		printf("%d/%lld: afsync %s %d\n", procid, opno, f.path, e);
 	free_pathname(&f);
@@ -2241,7 +5529,7 @@ do_aio_rw(opnum_t opno, long r, int flags)
 		goto aio_out;
 	}
 	fd = open_path(&f, flags|O_DIRECT);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -2275,8 +5563,10 @@ do_aio_rw(opnum_t opno, long r, int flags)
 	if (dio_env)
 		diob.d_mem = diob.d_miniosz = atoi(dio_env);
 	align = (int64_t)diob.d_miniosz;
+	if (verify && align < VERIFY_BLOCK)
+		align = VERIFY_BLOCK;
 	lr = ((int64_t)random() << 32) + random();
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	len -= (len % align);
 	if (len <= 0)
 		len = align;
@@ -2291,13 +5581,13 @@ do_aio_rw(opnum_t opno, long r, int flags)
 	}
 
 	if (iswrite) {
-		off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+		off = pick_off(lr, file_limit(stb.st_size, stb.st_ino));
 		off -= (off % align);
 		off %= maxfsize;
-		memset(buf, nameseq & 0xff, len);
+		fill_buf(buf, off, len, stb.st_ino);
 		io_prep_pwrite(&iocb, fd, buf, len, off);
 	} else {
-		off = (off64_t)(lr % stb.st_size);
+		off = pick_off(lr, stb.st_size);
 		off -= (off % align);
 		io_prep_pread(&iocb, fd, buf, len, off);
 	}
@@ -2314,7 +5604,13 @@ do_aio_rw(opnum_t opno, long r, int flags)
 		goto aio_out;
 	}
 
-	e = event.res != len ? event.res2 : 0;
+	e = op_failed(event.res != len ? event.res2 : 0);
+	if (iswrite)
+		verify_wrote(buf, stb.st_ino, off, len, (long)event.res);
+	else
+		verify_check(opno, f.path, stb.st_ino, buf, off, (long)event.res);
+	trace_op(iswrite ? OP_AWRITE : OP_AREAD, opno, f.path, NULL, off, 0,
+		 len, iswrite ? nsp->nameseq & 0xff : 0, e);
 	if (v)
 		printf("%d/%lld: %s %s%s [%lld,%d] %d\n",
 		       procid, opno, iswrite ? "awrite" : "aread",
@@ -2357,7 +5653,7 @@ do_uring_rw(opnum_t opno, long r, int flags)
 		goto uring_out;
 	}
 	fd = open_path(&f, flags);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -2386,7 +5682,9 @@ do_uring_rw(opnum_t opno, long r, int flags)
 		goto uring_out;
 	}
 	lr = ((int64_t)random() << 32) + random();
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
+	if (verify)
+		len = roundup_64(len, VERIFY_BLOCK);
 	buf = malloc(len);
 	if (!buf) {
 		if (v)
@@ -2397,12 +5695,14 @@ do_uring_rw(opnum_t opno, long r, int flags)
 	iovec.iov_base = buf;
 	iovec.iov_len = len;
 	if (iswrite) {
-		off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+		off = pick_off(lr, file_limit(stb.st_size, stb.st_ino));
 		off %= maxfsize;
-		memset(buf, nameseq & 0xff, len);
+		if (verify)
+			off = rounddown_64(off, VERIFY_BLOCK);
+		fill_buf(buf, off, len, stb.st_ino);
 		io_uring_prep_writev(sqe, fd, &iovec, 1, off);
 	} else {
-		off = (off64_t)(lr % stb.st_size);
+		off = pick_off(lr, stb.st_size);
 		io_uring_prep_readv(sqe, fd, &iovec, 1, off);
 	}
 
@@ -2418,6 +5718,13 @@ do_uring_rw(opnum_t opno, long r, int flags)
 			       iswrite ? "uring_write" : "uring_read", e);
 		goto uring_out;
 	}
+	if (iswrite)
+		verify_wrote(buf, stb.st_ino, off, len, cqe->res);
+	else
+		verify_check(opno, f.path, stb.st_ino, buf, off, cqe->res);
+	trace_op(iswrite ? OP_URING_WRITE : OP_URING_READ, opno, f.path, NULL,
+		 off, 0, len, iswrite ? nsp->nameseq & 0xff : 0,
+		 op_failed(cqe->res < 0 ? -cqe->res : 0));
 	if (v)
 		printf("%d/%lld: %s %s%s [%lld, %d(res=%d)] %d\n",
 		       procid, opno, iswrite ? "uring_write" : "uring_read",
@@ -2433,6 +5740,678 @@ do_uring_rw(opnum_t opno, long r, int flags)
 }
 #endif
 
+#ifdef URING
+extern struct print_flags renameat2_flags[];
+#ifdef HAVE_LINUX_FALLOC_H
+extern struct print_flags falloc_flags[];
+#endif
+
+/*
+ * Can op be run on the engine?  The others are always done synchronously.
+ */
+bool
+aop_capable(opty_t op)
+{
+	switch (op) {
+	case OP_CREAT:
+#ifdef HAVE_LINUX_FALLOC_H
+	case OP_FALLOCATE:
+#endif
+	case OP_FDATASYNC:
+	case OP_FSYNC:
+	case OP_LINK:
+	case OP_MKDIR:
+	case OP_READ:
+	case OP_RENAME:
+	case OP_RNOREPLACE:
+	case OP_REXCHANGE:
+	case OP_RWHITEOUT:
+	case OP_RMDIR:
+#if LIBURING_MAJOR_VERSION > 2 || (LIBURING_MAJOR_VERSION == 2 && LIBURING_MINOR_VERSION >= 2)
+	case OP_SETFATTR:
+#endif
+	case OP_STAT:
+	case OP_UNLINK:
+	case OP_URING_READ:
+	case OP_URING_WRITE:
+	case OP_WRITE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * The entry id of type ft, if it is still there.
+ */
+fent_t *
+aop_fent(int id, int ft)
+{
+	findex_t	*ip;
+
+	ip = findex_lookup(id);
+	if (ip == NULL || ip->ft != ft)
+		return NULL;
+	return &nsp->flist[ft].fents[ip->slot];
+}
+
+/*
+ * Update the namespace for a completed op and log it.  The op ran
+ * concurrently with others, so the entries it picked may have gone or
+ * moved by now: anything no longer there is left alone, at worst the
+ * namespace then disagrees with what's on disk and later ops fail.
+ */
+void
+aop_finish(aop_t *a, int e)
+{
+	fent_t	*dfep;
+	fent_t	*fep;
+	int	xattr_counter;
+	bool	parent_ok;
+
+	switch (a->op) {
+	case OP_RENAME:
+	case OP_RNOREPLACE:
+	case OP_REXCHANGE:
+	case OP_RWHITEOUT:
+		trace_op(a->op, a->opno, a->f.path, a->newf.path, 0, 0, 0,
+			 a->mode, e);
+		break;
+	case OP_LINK:
+		trace_op(a->op, a->opno, a->f.path, a->newf.path, 0, 0, 0, 0, e);
+		break;
+	case OP_SETFATTR:
+		trace_op(a->op, a->opno, a->f.path, a->xname, 0, 0, a->len,
+			 a->mode, e);
+		break;
+	case OP_URING_WRITE:
+	case OP_WRITE:
+		trace_op(a->op, a->opno, a->f.path, NULL, a->off, 0, a->len,
+			 a->buf && a->len ? a->buf[0] & 0xff : 0, e);
+		break;
+	default:
+		trace_op(a->op, a->opno, a->f.path, NULL, a->off, 0, a->len,
+			 a->mode, e);
+		break;
+	}
+
+	parent_ok = a->parid == -1 || dirid_to_fent(a->parid) != NULL;
+	switch (a->op) {
+	case OP_CREAT:
+		if (e == 0 && parent_ok)
+			add_to_flist(a->ft, a->newid, a->parid, 0);
+		if (a->v) {
+			printf("%d/%lld: creat %s x:0 %d 0\n", procid, a->opno,
+			       a->f.path, e);
+			printf("%d/%lld: creat add id=%d,parent=%d\n", procid,
+			       a->opno, a->newid, a->parid);
+		}
+		break;
+	case OP_FALLOCATE:
+#ifdef HAVE_LINUX_FALLOC_H
+		if (a->v)
+			printf("%d/%lld: fallocate(%s) %s [%lld,%lld] %d\n",
+			       procid, a->opno,
+			       translate_flags(a->mode, "|", falloc_flags),
+			       a->f.path, (long long)a->off,
+			       (long long)a->len, e);
+#endif
+		break;
+	case OP_LINK:
+		if (e == 0 && parent_ok)
+			add_to_flist(a->ft, a->newid, a->parid, a->xattr_counter);
+		if (a->v) {
+			printf("%d/%lld: link %s %s %d\n", procid, a->opno,
+			       a->f.path, a->newf.path, e);
+			printf("%d/%lld: link add id=%d,parent=%d\n", procid,
+			       a->opno, a->newid, a->parid);
+		}
+		break;
+	case OP_MKDIR:
+		if (e == 0 && parent_ok)
+			add_to_flist(FT_DIR, a->newid, a->parid, 0);
+		if (a->v) {
+			printf("%d/%lld: mkdir %s %d\n", procid, a->opno,
+			       a->f.path, e);
+			printf("%d/%lld: mkdir add id=%d,parent=%d\n", procid,
+			       a->opno, a->newid, a->parid);
+		}
+		break;
+	case OP_READ:
+	case OP_URING_READ:
+	case OP_URING_WRITE:
+	case OP_WRITE:
+		if (a->v)
+			printf("%d/%lld: %s %s [%lld,%d] %d\n", procid, a->opno,
+			       ops[a->op].name, a->f.path, (long long)a->off,
+			       (int)a->len, e);
+		break;
+	case OP_RENAME:
+	case OP_RNOREPLACE:
+	case OP_REXCHANGE:
+	case OP_RWHITEOUT:
+		fep = aop_fent(a->id, a->ft);
+		dfep = a->mode == RENAME_EXCHANGE ?
+			aop_fent(a->newid, a->ft) : NULL;
+		if (e == 0 && fep && parent_ok &&
+		    (dfep || a->mode != RENAME_EXCHANGE)) {
+			xattr_counter = fep->xattr_counter;
+			if (a->ft == FT_DIR || a->ft == FT_SUBVOL)
+				fix_parent(a->id, a->newid,
+					   a->mode == RENAME_EXCHANGE);
+			if (a->mode == RENAME_WHITEOUT) {
+				fep->xattr_counter = 0;
+				add_to_flist(a->ft, a->newid, a->parid,
+					     xattr_counter);
+			} else if (a->mode == RENAME_EXCHANGE) {
+				fep->xattr_counter = dfep->xattr_counter;
+				dfep->xattr_counter = xattr_counter;
+			} else {
+				del_from_flist(a->ft,
+					fep - nsp->flist[a->ft].fents);
+				add_to_flist(a->ft, a->newid, a->parid,
+					     xattr_counter);
+			}
+		}
+		if (a->v)
+			printf("%d/%lld: rename(%s) %s to %s %d\n", procid,
+			       a->opno,
+			       translate_flags(a->mode, "|", renameat2_flags),
+			       a->f.path, a->newf.path, e);
+		break;
+	case OP_RMDIR:
+	case OP_UNLINK:
+		fep = aop_fent(a->id, a->ft);
+		if (e == 0 && fep)
+			del_from_flist(a->ft, fep - nsp->flist[a->ft].fents);
+		if (a->v)
+			printf("%d/%lld: %s %s %d\n", procid, a->opno,
+			       ops[a->op].name, a->f.path, e);
+		break;
+	case OP_SETFATTR:
+		fep = aop_fent(a->id, a->ft);
+		if (e == 0 && fep)
+			fep->xattr_counter++;
+		if (a->v)
+			printf("%d/%lld: setfattr file %s name %s flag %s value length %d: %d\n",
+			       procid, a->opno, a->f.path, a->xname,
+			       xattr_flag_to_string(a->mode), (int)a->len, e);
+		break;
+	default:
+		if (a->v)
+			printf("%d/%lld: %s %s %d\n", procid, a->opno,
+			       ops[a->op].name, a->f.path, e);
+		break;
+	}
+}
+
+/*
+ * Queue the request for the current stage of an op.  It goes to the
+ * kernel with the next batch, see aop_reap().
+ */
+void
+aop_issue(aop_t *a)
+{
+	struct io_uring_sqe	*sqe;
+
+	/* every op has at most one request queued, so this can't fail */
+	sqe = io_uring_get_sqe(&ring);
+	assert(sqe != NULL);
+	switch (a->stage) {
+	case AOP_OPEN:
+		io_uring_prep_openat(sqe, AT_FDCWD, a->f.path, a->mode, 0666);
+		break;
+	case AOP_STAT:
+		io_uring_prep_statx(sqe, a->fd, "", AT_EMPTY_PATH, STATX_SIZE,
+				    &a->stx);
+		break;
+	case AOP_CLOSE:
+		io_uring_prep_close(sqe, a->fd);
+		break;
+	case AOP_IO:
+		switch (a->op) {
+		case OP_FALLOCATE:
+			io_uring_prep_fallocate(sqe, a->fd, a->mode, a->off,
+						a->len);
+			break;
+		case OP_FDATASYNC:
+			io_uring_prep_fsync(sqe, a->fd, IORING_FSYNC_DATASYNC);
+			break;
+		case OP_FSYNC:
+			io_uring_prep_fsync(sqe, a->fd, 0);
+			break;
+		case OP_LINK:
+			io_uring_prep_linkat(sqe, AT_FDCWD, a->f.path,
+					     AT_FDCWD, a->newf.path, 0);
+			break;
+		case OP_MKDIR:
+			io_uring_prep_mkdirat(sqe, AT_FDCWD, a->f.path, 0777);
+			break;
+		case OP_READ:
+		case OP_URING_READ:
+			io_uring_prep_read(sqe, a->fd, a->buf, a->len, a->off);
+			break;
+		case OP_RENAME:
+		case OP_RNOREPLACE:
+		case OP_REXCHANGE:
+		case OP_RWHITEOUT:
+			io_uring_prep_renameat(sqe, AT_FDCWD, a->f.path,
+					       AT_FDCWD, a->newf.path, a->mode);
+			break;
+		case OP_RMDIR:
+			io_uring_prep_unlinkat(sqe, AT_FDCWD, a->f.path,
+					       AT_REMOVEDIR);
+			break;
+#if LIBURING_MAJOR_VERSION > 2 || (LIBURING_MAJOR_VERSION == 2 && LIBURING_MINOR_VERSION >= 2)
+		case OP_SETFATTR:
+			io_uring_prep_setxattr(sqe, a->xname, a->buf,
+					       a->f.path, a->mode, a->len);
+			break;
+#endif
+		case OP_STAT:
+			io_uring_prep_statx(sqe, AT_FDCWD, a->f.path,
+					    AT_SYMLINK_NOFOLLOW,
+					    STATX_BASIC_STATS, &a->stx);
+			break;
+		case OP_UNLINK:
+			io_uring_prep_unlinkat(sqe, AT_FDCWD, a->f.path, 0);
+			break;
+		case OP_URING_WRITE:
+		case OP_WRITE:
+			io_uring_prep_write(sqe, a->fd, a->buf, a->len, a->off);
+			break;
+		default:
+			assert(0);
+		}
+		break;
+	}
+	io_uring_sqe_set_data(sqe, a);
+}
+
+/*
+ * Pick the file(s) for an op, the same way its synchronous version
+ * does, and set up its first request.  Returns false if there's
+ * nothing to do.
+ */
+bool
+aop_prep(aop_t *a, long r)
+{
+	fent_t	*dfep;
+	fent_t	*fep;
+	int	v1;
+	int	which;
+	int	xattr_num;
+
+	switch (a->op) {
+	case OP_CREAT:
+	case OP_MKDIR:
+		if (!get_fname(FT_ANYDIR, r, NULL, NULL, &fep, &v1))
+			a->parid = -1;
+		else
+			a->parid = fep->id;
+		if (a->op == OP_CREAT) {
+			which = random() % 100;
+			a->ft = rtpct ? ((which > rtpct) ? FT_REG : FT_RTF) :
+					FT_REG;
+			a->mode = O_CREAT | O_WRONLY | O_TRUNC;
+			a->stage = AOP_OPEN;
+		} else {
+			a->ft = FT_DIR;
+		}
+		if (!generate_fname(fep, a->ft, &a->f, &a->newid, &a->v)) {
+			if (a->v | v1)
+				printf("%d/%lld: %s - no filename\n", procid,
+				       a->opno, ops[a->op].name);
+			return false;
+		}
+		a->v |= v1;
+		return true;
+	case OP_LINK:
+		if (!get_fname(FT_NOTDIR, r, &a->f, NULL, &fep, &v1)) {
+			if (v1)
+				printf("%d/%lld: link - no file\n", procid,
+				       a->opno);
+			return false;
+		}
+		a->id = fep->id;
+		a->ft = fep->ft;
+		a->xattr_counter = fep->xattr_counter;
+		if (!get_fname(FT_DIRm, random(), NULL, NULL, &dfep, &a->v))
+			a->parid = -1;
+		else
+			a->parid = dfep->id;
+		a->v |= v1;
+		if (!generate_fname(dfep, a->ft, &a->newf, &a->newid, &v1)) {
+			if (a->v | v1)
+				printf("%d/%lld: link - no filename\n", procid,
+				       a->opno);
+			return false;
+		}
+		a->v |= v1;
+		return true;
+	case OP_RENAME:
+	case OP_RNOREPLACE:
+	case OP_REXCHANGE:
+	case OP_RWHITEOUT:
+		a->mode = a->op == OP_RNOREPLACE ? RENAME_NOREPLACE :
+			  a->op == OP_REXCHANGE ? RENAME_EXCHANGE :
+			  a->op == OP_RWHITEOUT ? RENAME_WHITEOUT : 0;
+		which = (a->mode == RENAME_WHITEOUT) ? FT_DEVm : FT_ANYm;
+		if (!get_fname(which, r, &a->f, NULL, &fep, &v1)) {
+			if (v1)
+				printf("%d/%lld: rename - no source filename\n",
+				       procid, a->opno);
+			return false;
+		}
+		a->id = fep->id;
+		a->ft = fep->ft;
+		if (a->mode == RENAME_EXCHANGE) {
+			if (!get_fname(1 << a->ft, random(), &a->newf, NULL,
+				       &dfep, &a->v)) {
+				if (a->v)
+					printf("%d/%lld: rename - no target filename\n",
+					       procid, a->opno);
+				return false;
+			}
+			if (a->ft == FT_DIR &&
+			    (fents_ancestor_check(fep, dfep) ||
+			     fents_ancestor_check(dfep, fep))) {
+				if (a->v)
+					printf("%d/%lld: rename(REXCHANGE) %s and %s "
+					       "have ancestor-descendant relationship\n",
+					       procid, a->opno, a->f.path,
+					       a->newf.path);
+				return false;
+			}
+			a->v |= v1;
+			a->newid = dfep->id;
+			a->parid = dfep->parent;
+			return true;
+		}
+		if (!get_fname(FT_DIRm, random(), NULL, NULL, &dfep, &a->v))
+			a->parid = -1;
+		else
+			a->parid = dfep->id;
+		a->v |= v1;
+		if (!generate_fname(dfep, a->ft, &a->newf, &a->newid, &v1)) {
+			if (a->v | v1)
+				printf("%d/%lld: rename - no filename\n",
+				       procid, a->opno);
+			return false;
+		}
+		a->v |= v1;
+		return true;
+	case OP_RMDIR:
+	case OP_UNLINK:
+		which = a->op == OP_RMDIR ? FT_DIRm : FT_NOTDIR;
+		if (!get_fname(which, r, &a->f, NULL, &fep, &a->v)) {
+			if (a->v)
+				printf("%d/%lld: %s - no file\n", procid,
+				       a->opno, ops[a->op].name);
+			return false;
+		}
+		a->id = fep->id;
+		a->ft = fep->ft;
+		return true;
+	case OP_SETFATTR:
+		if (!get_fname(FT_REGFILE | FT_ANYDIR, r, &a->f, NULL, &fep,
+			       &a->v)) {
+			if (a->v)
+				printf("%d/%lld: setfattr - no filename\n",
+				       procid, a->opno);
+			return false;
+		}
+		a->id = fep->id;
+		a->ft = fep->ft;
+		a->mode = 0;
+		if ((fep->xattr_counter > 0) && (random() % 2)) {
+			xattr_num = (random() % fep->xattr_counter) + 1;
+			if (random() % 2)
+				a->mode = XATTR_REPLACE;
+		} else {
+			xattr_num = fep->xattr_counter + 1;
+			if (random() % 2)
+				a->mode = XATTR_CREATE;
+		}
+		a->len = random() % 101;
+		a->buf = gen_random_string(a->len);
+		if ((!a->buf && a->len > 0) ||
+		    generate_xattr_name(xattr_num, a->xname,
+					sizeof(a->xname)) < 0)
+			return false;
+		return true;
+	case OP_STAT:
+		if (!get_fname(FT_ANYm, r, &a->f, NULL, NULL, &a->v)) {
+			if (a->v)
+				printf("%d/%lld: stat - no entries\n", procid,
+				       a->opno);
+			return false;
+		}
+		return true;
+	default:
+		/* the ops on file data open the file first */
+		which = a->op == OP_WRITE ? FT_REGm : FT_REGFILE;
+		if (!get_fname(which, r, &a->f, NULL, NULL, &a->v)) {
+			if (a->v)
+				printf("%d/%lld: %s - no filename\n", procid,
+				       a->opno, ops[a->op].name);
+			return false;
+		}
+		a->mode = a->op == OP_READ || a->op == OP_URING_READ ?
+			O_RDONLY : a->op == OP_FALLOCATE ? O_RDWR : O_WRONLY;
+		a->stage = AOP_OPEN;
+		return true;
+	}
+}
+
+/*
+ * Set up the I/O of a data op once the file's size is known.
+ * Returns false if there's nothing to do.
+ */
+bool
+aop_prep_io(aop_t *a)
+{
+	off64_t		size = a->stx.stx_size;
+	int64_t		lr;
+
+	lr = ((int64_t)random() << 32) + random();
+	switch (a->op) {
+	case OP_READ:
+	case OP_URING_READ:
+		if (size == 0) {
+			if (a->v)
+				printf("%d/%lld: %s - %s zero size\n", procid,
+				       a->opno, ops[a->op].name, a->f.path);
+			return false;
+		}
+		a->off = pick_off(lr, size);
+		a->len = pick_len();
+		a->buf = malloc(a->len);
+		return a->buf != NULL;
+	case OP_FALLOCATE:
+		a->off = (off64_t)(lr % file_limit(size, a->stx.stx_ino));
+		a->off %= maxfsize;
+		a->len = (off64_t)(random() % (1024 * 1024));
+#ifdef HAVE_LINUX_FALLOC_H
+		a->mode = FALLOC_FL_KEEP_SIZE & random();
+#endif
+		return true;
+	default:
+		a->off = pick_off(lr, file_limit(size, a->stx.stx_ino));
+		a->off %= maxfsize;
+		a->len = pick_len();
+		a->buf = malloc(a->len);
+		if (!a->buf)
+			return false;
+		memset(a->buf, nsp->nameseq & 0xff, a->len);
+		return true;
+	}
+}
+
+void
+aop_put(aop_t *a)
+{
+	free_pathname(&a->f);
+	free_pathname(&a->newf);
+	free(a->buf);
+	a->buf = NULL;
+	if (opstats)
+		opstat_add(a->op, &a->start);
+	if (my_live)
+		live_op(a->op, a->err);
+	a->next = aop_free;
+	aop_free = a;
+	aop_busy--;
+}
+
+/*
+ * A request of a has completed with res: move the op on to its next
+ * stage, or finish it.
+ */
+void
+aop_complete(aop_t *a, int res)
+{
+	int	e = res < 0 ? -res : 0;
+
+	if (e && !a->err)
+		a->err = e;
+	switch (a->stage) {
+	case AOP_OPEN:
+		if (res < 0) {
+			if (a->op == OP_CREAT)
+				aop_finish(a, e);
+			else if (a->v)
+				printf("%d/%lld: %s - open %s failed %d\n",
+				       procid, a->opno, ops[a->op].name,
+				       a->f.path, e);
+			aop_put(a);
+			return;
+		}
+		a->fd = res;
+		if (a->op == OP_CREAT) {
+			aop_finish(a, 0);
+			a->stage = AOP_CLOSE;
+		} else if (a->op == OP_FSYNC || a->op == OP_FDATASYNC) {
+			a->stage = AOP_IO;
+		} else {
+			a->stage = AOP_STAT;
+		}
+		break;
+	case AOP_STAT:
+		if (res < 0 && a->v)
+			printf("%d/%lld: %s - fstat64 %s failed %d\n", procid,
+			       a->opno, ops[a->op].name, a->f.path, e);
+		a->stage = (res == 0 && aop_prep_io(a)) ? AOP_IO : AOP_CLOSE;
+		break;
+	case AOP_IO:
+		aop_finish(a, e);
+		if (a->fd == -1) {
+			aop_put(a);
+			return;
+		}
+		a->stage = AOP_CLOSE;
+		break;
+	case AOP_CLOSE:
+		aop_put(a);
+		return;
+	}
+	aop_issue(a);
+}
+
+/*
+ * Hand the queued requests to the kernel and process whatever has
+ * completed, waiting for at least one completion if wait is set.
+ */
+void
+aop_reap(bool wait)
+{
+	struct io_uring_cqe	*cqes[AOP_BATCH];
+	unsigned		i;
+	unsigned		n;
+	int			e;
+
+	e = io_uring_submit_and_wait(&ring, wait ? 1 : 0);
+	if (e < 0 && e != -EINTR) {
+		fprintf(stderr, "%d: io_uring_submit failed %d\n", procid, e);
+		exit(1);
+	}
+	do {
+		n = io_uring_peek_batch_cqe(&ring, cqes, AOP_BATCH);
+		for (i = 0; i < n; i++)
+			aop_complete(io_uring_cqe_get_data(cqes[i]),
+				     cqes[i]->res);
+		io_uring_cq_advance(&ring, n);
+	} while (n == AOP_BATCH);
+}
+
+/*
+ * Start op on the engine, once a slot is free.  Returns false if the op
+ * isn't one the engine does, it then has to be run synchronously.
+ */
+bool
+aop_start(opty_t op, opnum_t opno, long r)
+{
+	aop_t	*a;
+
+	if (!aops)
+		return false;
+	if (!aop_capable(op)) {
+		/* keep the queue moving while the op blocks */
+		if (aop_busy)
+			aop_reap(false);
+		return false;
+	}
+	while (!aop_free)
+		aop_reap(true);
+	a = aop_free;
+	aop_free = a->next;
+	aop_busy++;
+	if (opstats)
+		clock_gettime(CLOCK_MONOTONIC, &a->start);
+	a->op = op;
+	a->opno = opno;
+	a->stage = AOP_IO;
+	a->v = 0;
+	a->fd = -1;
+	a->parid = -1;
+	a->err = 0;
+	init_pathname(&a->f);
+	init_pathname(&a->newf);
+	if (aop_prep(a, r))
+		aop_issue(a);
+	else
+		aop_put(a);
+	return true;
+}
+
+/*
+ * Wait for all the ops in flight to complete.
+ */
+void
+aop_drain(void)
+{
+	while (aops && aop_busy)
+		aop_reap(true);
+}
+
+void
+aop_init(void)
+{
+	int	i;
+
+	aops = calloc(uring_depth, sizeof(*aops));
+	if (!aops) {
+		perror("calloc");
+		exit(1);
+	}
+	aop_free = NULL;
+	for (i = uring_depth - 1; i >= 0; i--) {
+		aops[i].next = aop_free;
+		aop_free = &aops[i];
+	}
+}
+#endif
+
 void
 aread_f(opnum_t opno, long r)
 {
@@ -2491,7 +6470,7 @@ attr_remove_f(opnum_t opno, long r)
 		return;
 	}
 	if (attr_remove_path(&f, aname) < 0)
-		e = errno;
+		e = op_failed(errno);
 	else
 		e = 0;
 	check_cwd();
@@ -2516,15 +6495,15 @@ attr_set_f(opnum_t opno, long r)
 	init_pathname(&f);
 	if (!get_fname(FT_ANYm, r, &f, NULL, NULL, &v))
 		append_pathname(&f, ".");
-	sprintf(aname, "user.a%x", nameseq++);
+	sprintf(aname, "user.a%x", nsp->nameseq++);
 	li = (int)(random() % (sizeof(lengths) / sizeof(lengths[0])));
 	len = (int)(random() % lengths[li]);
 	if (len == 0)
 		len = 1;
 	aval = malloc(len);
-	memset(aval, nameseq & 0xff, len);
-	if (attr_set_path(&f, aname, aval, len) < 0)
-		e = errno;
+	memset(aval, nsp->nameseq & 0xff, len);
+	if (attr_set_path(&f, aname, aval, len, 0) < 0)
+		e = op_failed(errno);
 	else
 		e = 0;
 	check_cwd();
@@ -2621,7 +6600,7 @@ bulkstat1_f(opnum_t opno, long r)
         bsr.icount=1;
         bsr.ubuffer=&t;
         bsr.ocount=NULL;
-	e = xfsctl(".", fd, XFS_IOC_FSBULKSTAT_SINGLE, &bsr) < 0 ? errno : 0;
+	e = xfsctl(".", fd, XFS_IOC_FSBULKSTAT_SINGLE, &bsr) < 0 ? op_failed(errno) : 0;
 	if (v)
 		printf("%d/%lld: bulkstat1 %s ino %lld %d\n",
 		       procid, opno, good?"real":"random",
@@ -2647,8 +6626,9 @@ chown_f(opnum_t opno, long r)
 	nbits = (int)(random() % idmodulo);
 	u &= (1 << nbits) - 1;
 	g &= (1 << nbits) - 1;
-	e = lchown_path(&f, u, g) < 0 ? errno : 0;
+	e = lchown_path(&f, u, g) < 0 ? op_failed(errno) : 0;
 	check_cwd();
+	trace_op(OP_CHOWN, opno, f.path, NULL, u, g, 0, 0, e);
 	if (v)
 		printf("%d/%lld: chown %s %d/%d %d\n", procid, opno, f.path, (int)u, (int)g, e);
 	free_pathname(&f);
@@ -2700,7 +6680,7 @@ exchangerange_f(
 
 	/* Open files */
 	fd1 = open_path(&fpath1, O_RDONLY);
-	e = fd1 < 0 ? errno : 0;
+	e = fd1 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd1 < 0) {
 		if (v1)
@@ -2710,7 +6690,7 @@ exchangerange_f(
 	}
 
 	fd2 = open_path(&fpath2, O_WRONLY);
-	e = fd2 < 0 ? errno : 0;
+	e = fd2 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd2 < 0) {
 		if (v2)
@@ -2745,7 +6725,7 @@ exchangerange_f(
 	}
 
 	/* Never let us swap more than 1/4 of the files. */
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	if (len > stat1.st_size / 4)
 		len = stat1.st_size / 4;
 	if (len > stat2.st_size / 4)
@@ -2787,7 +6767,13 @@ exchangerange_f(
 	fxr.file2_offset = off2;
 
 	ret = ioctl(fd2, XFS_IOC_EXCHANGE_RANGE, &fxr);
-	e = ret < 0 ? errno : 0;
+	e = ret < 0 ? op_failed(errno) : 0;
+	if (!e) {
+		verify_moved(stat1.st_ino);
+		verify_moved(stat2.st_ino);
+	}
+	trace_op(OP_EXCHANGE_RANGE, opno, fpath1.path, fpath2.path, off1, off2,
+		 len, 0, e);
 	if (v1 || v2) {
 		printf("%d/%lld: exchangerange %s%s [%lld,%lld] -> %s%s [%lld,%lld]",
 			procid, opno,
@@ -2855,7 +6841,7 @@ clonerange_f(
 
 	/* Open files */
 	fd1 = open_path(&fpath1, O_RDONLY);
-	e = fd1 < 0 ? errno : 0;
+	e = fd1 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd1 < 0) {
 		if (v1)
@@ -2865,7 +6851,7 @@ clonerange_f(
 	}
 
 	fd2 = open_path(&fpath2, O_WRONLY);
-	e = fd2 < 0 ? errno : 0;
+	e = fd2 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd2 < 0) {
 		if (v2)
@@ -2892,7 +6878,7 @@ clonerange_f(
 	inode_info(inoinfo2, sizeof(inoinfo2), &stat2, v2);
 
 	/* Calculate offsets */
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	len = rounddown_64(len, stat1.st_blksize);
 	if (len == 0)
 		len = stat1.st_blksize;
@@ -2926,7 +6912,11 @@ clonerange_f(
 	fcr.dest_offset = off2;
 
 	ret = ioctl(fd2, FICLONERANGE, &fcr);
-	e = ret < 0 ? errno : 0;
+	e = ret < 0 ? op_failed(errno) : 0;
+	if (!e)
+		verify_moved(stat2.st_ino);
+	trace_op(OP_CLONERANGE, opno, fpath1.path, fpath2.path, off1, off2,
+		 len, 0, e);
 	if (v1 || v2) {
 		printf("%d/%lld: clonerange %s%s [%lld,%lld] -> %s%s [%lld,%lld]",
 			procid, opno,
@@ -2997,7 +6987,7 @@ copyrange_f(
 
 	/* Open files */
 	fd1 = open_path(&fpath1, O_RDONLY);
-	e = fd1 < 0 ? errno : 0;
+	e = fd1 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd1 < 0) {
 		if (v1)
@@ -3007,7 +6997,7 @@ copyrange_f(
 	}
 
 	fd2 = open_path(&fpath2, O_WRONLY);
-	e = fd2 < 0 ? errno : 0;
+	e = fd2 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd2 < 0) {
 		if (v2)
@@ -3034,18 +7024,22 @@ copyrange_f(
 	inode_info(inoinfo2, sizeof(inoinfo2), &stat2, v2);
 
 	/* Calculate offsets */
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	if (len == 0)
 		len = stat1.st_blksize;
 	if (len > stat1.st_size)
 		len = stat1.st_size;
+	if (verify)
+		len = roundup_64(len, VERIFY_BLOCK);
 
 	lr = ((int64_t)random() << 32) + random();
-	if (stat1.st_size == len)
+	if (stat1.st_size <= len)
 		off1 = 0;
 	else
 		off1 = (off64_t)(lr % MIN(stat1.st_size - len, MAXFSIZE));
 	off1 %= maxfsize;
+	if (verify)
+		off1 = rounddown_64(off1, VERIFY_BLOCK);
 
 	/*
 	 * If srcfile == destfile, randomly generate destination ranges
@@ -3056,6 +7050,8 @@ copyrange_f(
 		lr = ((int64_t)random() << 32) + random();
 		off2 = (off64_t)(lr % max_off2);
 		off2 %= maxfsize;
+		if (verify)
+			off2 = rounddown_64(off2, VERIFY_BLOCK);
 	} while (stat1.st_ino == stat2.st_ino && llabs(off2 - off1) < len);
 
 	/*
@@ -3077,7 +7073,11 @@ copyrange_f(
 		else if (ret > 0)
 			len -= ret;
 	}
-	e = ret < 0 ? errno : 0;
+	e = ret < 0 ? op_failed(errno) : 0;
+	if (len < length)
+		verify_moved(stat2.st_ino);
+	trace_op(OP_COPYRANGE, opno, fpath1.path, fpath2.path, offset1, offset2,
+		 length, 0, e);
 	if (v1 || v2) {
 		printf("%d/%lld: copyrange %s%s [%lld,%lld] -> %s%s [%lld,%lld]",
 			procid, opno,
@@ -3127,12 +7127,12 @@ deduperange_f(
 	int			i;
 	int			e;
 
-	if (flist[FT_REG].nfiles < 2)
+	if (nsp->flist[FT_REG].nfiles < 2)
 		return;
 
 	/* Pick somewhere between 2 and 128 files. */
 	do {
-		nr = random() % (flist[FT_REG].nfiles + 1);
+		nr = random() % (nsp->flist[FT_REG].nfiles + 1);
 	} while (nr < 2 || nr > 128);
 
 	/* Alloc memory */
@@ -3210,7 +7210,7 @@ deduperange_f(
 
 	/* Open files */
 	fd[0] = open_path(&fpath[0], O_RDONLY);
-	e = fd[0] < 0 ? errno : 0;
+	e = fd[0] < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd[0] < 0) {
 		if (v[0])
@@ -3221,7 +7221,7 @@ deduperange_f(
 
 	for (i = 1; i < nr; i++) {
 		fd[i] = open_path(&fpath[i], O_WRONLY);
-		e = fd[i] < 0 ? errno : 0;
+		e = fd[i] < 0 ? op_failed(errno) : 0;
 		check_cwd();
 		if (fd[i] < 0) {
 			if (v[i])
@@ -3252,7 +7252,7 @@ deduperange_f(
 	}
 
 	/* Never try to dedupe more than half of the src file. */
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	len = rounddown_64(len, stat[0].st_blksize);
 	if (len == 0)
 		len = stat[0].st_blksize / 2;
@@ -3298,7 +7298,7 @@ deduperange_f(
 	}
 
 	ret = ioctl(fd[0], FIDEDUPERANGE, fdr);
-	e = ret < 0 ? errno : 0;
+	e = ret < 0 ? op_failed(errno) : 0;
 	if (v[0]) {
 		printf("%d/%lld: deduperange from %s%s [%lld,%lld]",
 			procid, opno,
@@ -3369,7 +7369,7 @@ setxattr_f(opnum_t opno, long r)
 	if (!get_fname(FT_ANYm, r, &f, NULL, NULL, &v))
 		append_pathname(&f, ".");
 	fd = open_path(&f, O_RDWR);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 
 	/* project ID */
@@ -3382,6 +7382,8 @@ setxattr_f(opnum_t opno, long r)
 		fsx.fsx_projid = p;
 		e = xfsctl(f.path, fd, XFS_IOC_FSSETXATTR, &fsx);
 	}
+	if (e < 0)
+		op_failed(errno);
 	if (v)
 		printf("%d/%lld: setxattr %s %u %d\n", procid, opno, f.path, p, e);
 	free_pathname(&f);
@@ -3432,7 +7434,7 @@ splice_f(opnum_t opno, long r)
 
 	/* Open files */
 	fd1 = open_path(&fpath1, O_RDONLY);
-	e = fd1 < 0 ? errno : 0;
+	e = fd1 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd1 < 0) {
 		if (v1)
@@ -3442,7 +7444,7 @@ splice_f(opnum_t opno, long r)
 	}
 
 	fd2 = open_path(&fpath2, O_WRONLY);
-	e = fd2 < 0 ? errno : 0;
+	e = fd2 < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd2 < 0) {
 		if (v2)
@@ -3469,18 +7471,22 @@ splice_f(opnum_t opno, long r)
 	inode_info(inoinfo2, sizeof(inoinfo2), &stat2, v2);
 
 	/* Calculate offsets */
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	if (len == 0)
 		len = stat1.st_blksize;
 	if (len > stat1.st_size)
 		len = stat1.st_size;
+	if (verify)
+		len = roundup_64(len, VERIFY_BLOCK);
 
 	lr = ((int64_t)random() << 32) + random();
-	if (stat1.st_size == len)
+	if (stat1.st_size <= len)
 		off1 = 0;
 	else
 		off1 = (off64_t)(lr % MIN(stat1.st_size - len, MAXFSIZE));
 	off1 %= maxfsize;
+	if (verify)
+		off1 = rounddown_64(off1, VERIFY_BLOCK);
 
 	/*
 	 * splice can overlap write, so the offset of the target file can be
@@ -3489,6 +7495,8 @@ splice_f(opnum_t opno, long r)
 	 */
 	lr = ((int64_t)random() << 32) + random();
 	off2 = (off64_t)(lr % MIN(stat2.st_size + (1024ULL * stat2.st_blksize), MAXFSIZE));
+	if (verify)
+		off2 = rounddown_64(off2, VERIFY_BLOCK);
 
 	/*
 	 * Since len, off1 and off2 will be changed later, preserve their
@@ -3533,9 +7541,13 @@ splice_f(opnum_t opno, long r)
 	}
 
 	if (ret1 < 0 || ret2 < 0)
-		e = errno;
+		e = op_failed(errno);
 	else
 		e = 0;
+	if (total)
+		verify_moved(stat2.st_ino);
+	trace_op(OP_SPLICE, opno, fpath1.path, fpath2.path, offset1, offset2,
+		 length, 0, e);
 	if (v1 || v2) {
 		printf("%d/%lld: splice %s%s [%lld,%lld] -> %s%s [%lld,%lld] %d",
 			procid, opno,
@@ -3603,7 +7615,7 @@ creat_f(opnum_t opno, long r)
 		return;
 	}
 	fd = creat_path(&f, 0666);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	e1 = 0;
 	check_cwd();
 	if (fd >= 0) {
@@ -3625,6 +7637,7 @@ creat_f(opnum_t opno, long r)
 		add_to_flist(type, id, parid, 0);
 		close(fd);
 	}
+	trace_op(OP_CREAT, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v) {
 		printf("%d/%lld: creat %s x:%d %d %d\n", procid, opno, f.path,
 			extsize ? a.fsx_extsize : 0, e, e1);
@@ -3642,6 +7655,7 @@ dread_f(opnum_t opno, long r)
 	int		e;
 	pathname_t	f;
 	int		fd;
+	ssize_t		n;
 	size_t		len;
 	int64_t		lr;
 	off64_t		off;
@@ -3658,7 +7672,7 @@ dread_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_RDONLY|O_DIRECT);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -3700,18 +7714,21 @@ dread_f(opnum_t opno, long r)
 
 	align = (int64_t)diob.d_miniosz;
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % stb.st_size);
+	off = pick_off(lr, stb.st_size);
 	off -= (off % align);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	len -= (len % align);
 	if (len <= 0)
 		len = align;
 	else if (len > diob.d_maxiosz) 
 		len = diob.d_maxiosz;
 	buf = memalign(diob.d_mem, len);
-	e = read(fd, buf, len) < 0 ? errno : 0;
+	n = read(fd, buf, len);
+	e = n < 0 ? op_failed(errno) : 0;
+	verify_check(opno, f.path, stb.st_ino, buf, off, n);
 	free(buf);
+	trace_op(OP_DREAD, opno, f.path, NULL, off, 0, len, 0, e);
 	if (v)
 		printf("%d/%lld: dread %s%s [%lld,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off, (int)len, e);
@@ -3729,6 +7746,7 @@ dwrite_f(opnum_t opno, long r)
 	pathname_t	f;
 	int		fd;
 	size_t		len;
+	ssize_t		n;
 	int64_t		lr;
 	off64_t		off;
 	struct stat64	stb;
@@ -3744,7 +7762,7 @@ dwrite_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_WRONLY|O_DIRECT);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -3776,11 +7794,13 @@ dwrite_f(opnum_t opno, long r)
 		diob.d_mem = diob.d_miniosz = atoi(dio_env);
 
 	align = (int64_t)diob.d_miniosz;
+	if (verify && align < VERIFY_BLOCK)
+		align = VERIFY_BLOCK;
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = pick_off(lr, file_limit(stb.st_size, stb.st_ino));
 	off -= (off % align);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	len -= (len % align);
 	if (len <= 0)
 		len = align;
@@ -3789,9 +7809,13 @@ dwrite_f(opnum_t opno, long r)
 	buf = memalign(diob.d_mem, len);
 	off %= maxfsize;
 	lseek64(fd, off, SEEK_SET);
-	memset(buf, nameseq & 0xff, len);
-	e = write(fd, buf, len) < 0 ? errno : 0;
+	fill_buf(buf, off, len, stb.st_ino);
+	n = write(fd, buf, len);
+	e = n < 0 ? op_failed(errno) : 0;
+	verify_wrote(buf, stb.st_ino, off, len, n);
 	free(buf);
+	trace_op(OP_DWRITE, opno, f.path, NULL, off, 0, len,
+		 nsp->nameseq & 0xff, e);
 	if (v)
 		printf("%d/%lld: dwrite %s%s [%lld,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off, (int)len, e);
@@ -3817,7 +7841,7 @@ struct print_flags falloc_flags [] = {
 #endif
 
 void
-do_fallocate(opnum_t opno, long r, int mode)
+do_fallocate(opty_t op, opnum_t opno, long r, int mode)
 {
 #ifdef HAVE_LINUX_FALLOC_H
 	int		e;
@@ -3856,7 +7880,7 @@ do_fallocate(opnum_t opno, long r, int mode)
 	}
 	inode_info(st, sizeof(st), &stb, v);
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = (off64_t)(lr % file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
 	len = (off64_t)(random() % (1024 * 1024));
 	/*
@@ -3868,8 +7892,16 @@ do_fallocate(opnum_t opno, long r, int mode)
 		off = roundup_64(off, stb.st_blksize);
 		len = roundup_64(len, stb.st_blksize);
 	}
+	/* a part block punched or zeroed would look like corruption */
+	if (verify) {
+		off = rounddown_64(off, VERIFY_BLOCK);
+		len = roundup_64(len, VERIFY_BLOCK);
+	}
 	mode |= FALLOC_FL_KEEP_SIZE & random();
-	e = fallocate(fd, mode, (loff_t)off, (loff_t)len) < 0 ? errno : 0;
+	e = fallocate(fd, mode, (loff_t)off, (loff_t)len) < 0 ? op_failed(errno) : 0;
+	if (!e && (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)))
+		verify_moved(stb.st_ino);
+	trace_op(op, opno, f.path, NULL, off, 0, len, mode, e);
 	if (v)
 		printf("%d/%lld: fallocate(%s) %s%s [%lld,%lld] %d\n",
 		       procid, opno, translate_falloc_flags(mode),
@@ -3883,7 +7915,7 @@ void
 fallocate_f(opnum_t opno, long r)
 {
 #ifdef HAVE_LINUX_FALLOC_H
-	do_fallocate(opno, r, 0);
+	do_fallocate(OP_FALLOCATE, opno, r, 0);
 #endif
 }
 
@@ -3904,7 +7936,7 @@ fdatasync_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_WRONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -3913,7 +7945,8 @@ fdatasync_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = fdatasync(fd) < 0 ? errno : 0;
+	e = fdatasync(fd) < 0 ? op_failed(errno) : 0;
+	trace_op(OP_FDATASYNC, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v)
 		printf("%d/%lld: fdatasync %s %d\n", procid, opno, f.path, e);
 	free_pathname(&f);
@@ -3954,7 +7987,7 @@ fiemap_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_RDWR);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -3983,7 +8016,7 @@ fiemap_f(opnum_t opno, long r)
 		return;
 	}
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = (off64_t)(lr % file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
 	fiemap->fm_flags = random() & (FIEMAP_FLAGS_COMPAT | 0x10000);
 	fiemap->fm_extent_count = blocks_to_map;
@@ -3992,6 +8025,8 @@ fiemap_f(opnum_t opno, long r)
 	fiemap->fm_length = ((int64_t)random() << 32) + random();
 
 	e = ioctl(fd, FS_IOC_FIEMAP, (unsigned long)fiemap);
+	if (e < 0)
+		op_failed(errno);
 	if (v)
 		printf("%d/%lld: ioctl(FIEMAP) %s%s [%lld,%lld,%s] %d\n",
 		       procid, opno, f.path, st, (long long)fiemap->fm_start,
@@ -4019,7 +8054,7 @@ fsync_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_file_or_dir(&f, O_WRONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -4028,7 +8063,8 @@ fsync_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = fsync(fd) < 0 ? errno : 0;
+	e = fsync(fd) < 0 ? op_failed(errno) : 0;
+	trace_op(OP_FSYNC, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v)
 		printf("%d/%lld: fsync %s %d\n", procid, opno, f.path, e);
 	free_pathname(&f);
@@ -4070,10 +8106,12 @@ getattr_f(opnum_t opno, long r)
 	if (!get_fname(FT_ANYm, r, &f, NULL, NULL, &v))
 		append_pathname(&f, ".");
 	fd = open_path(&f, O_RDWR);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 
 	e = ioctl(fd, FS_IOC_GETFLAGS, &fl);
+	if (e < 0)
+		op_failed(errno);
 	if (v)
 		printf("%d/%lld: getattr %s %u %d\n", procid, opno, f.path, fl, e);
 	free_pathname(&f);
@@ -4166,7 +8204,7 @@ getfattr_f(opnum_t opno, long r)
 		goto out;
 	}
 
-	e = getxattr(f.path, name, value, value_len) < 0 ? errno : 0;
+	e = getxattr(f.path, name, value, value_len) < 0 ? op_failed(errno) : 0;
 out_log:
 	if (v)
 		printf("%d/%lld: getfattr file %s name %s value length %d %d\n",
@@ -4203,7 +8241,7 @@ link_f(opnum_t opno, long r)
 		parid = fep->id;
 	v |= v1;
 	init_pathname(&l);
-	e = generate_fname(fep, flp - flist, &l, &id, &v1);
+	e = generate_fname(fep, flp - nsp->flist, &l, &id, &v1);
 	v |= v1;
 	if (!e) {
 		if (v) {
@@ -4215,10 +8253,11 @@ link_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = link_path(&f, &l) < 0 ? errno : 0;
+	e = link_path(&f, &l) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e == 0)
-		add_to_flist(flp - flist, id, parid, fep_src->xattr_counter);
+		add_to_flist(flp - nsp->flist, id, parid, fep_src->xattr_counter);
+	trace_op(OP_LINK, opno, f.path, l.path, 0, 0, 0, 0, e);
 	if (v) {
 		printf("%d/%lld: link %s %s %d\n", procid, opno, f.path, l.path,
 			e);
@@ -4248,6 +8287,7 @@ listfattr_f(opnum_t opno, long r)
 
 	e = listxattr(f.path, NULL, 0);
 	if (e < 0) {
+		op_failed(errno);
 		if (v)
 			printf("%d/%lld: listfattr %s failed %d\n",
 			       procid, opno, f.path, errno);
@@ -4269,7 +8309,7 @@ listfattr_f(opnum_t opno, long r)
 		goto out;
 	}
 
-	e = listxattr(f.path, buffer, buffer_len) < 0 ? errno : 0;
+	e = listxattr(f.path, buffer, buffer_len) < 0 ? op_failed(errno) : 0;
 	if (v)
 		printf("%d/%lld: listfattr %s buffer length %d %d\n",
 		       procid, opno, f.path, buffer_len, e);
@@ -4305,10 +8345,11 @@ mkdir_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = mkdir_path(&f, 0777) < 0 ? errno : 0;
+	e = mkdir_path(&f, 0777) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e == 0)
 		add_to_flist(FT_DIR, id, parid, 0);
+	trace_op(OP_MKDIR, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v) {
 		printf("%d/%lld: mkdir %s %d\n", procid, opno, f.path, e);
 		printf("%d/%lld: mkdir add id=%d,parent=%d\n", procid, opno, id, parid);
@@ -4343,10 +8384,11 @@ mknod_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = mknod_path(&f, S_IFCHR|0444, 0) < 0 ? errno : 0;
+	e = mknod_path(&f, S_IFCHR|0444, 0) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e == 0)
 		add_to_flist(FT_DEV, id, parid, 0);
+	trace_op(OP_MKNOD, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v) {
 		printf("%d/%lld: mknod %s %d\n", procid, opno, f.path, e);
 		printf("%d/%lld: mknod add id=%d,parent=%d\n", procid, opno, id, parid);
@@ -4390,7 +8432,7 @@ do_mmap(opnum_t opno, long r, int prot)
 		return;
 	}
 	fd = open_path(&f, O_RDWR);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -4418,13 +8460,15 @@ do_mmap(opnum_t opno, long r, int prot)
 	}
 
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % stb.st_size);
+	off = pick_off(lr, stb.st_size);
 	off = rounddown_64(off, sysconf(_SC_PAGE_SIZE));
 	len = (size_t)(random() % MIN(stb.st_size - off, FILELEN_MAX)) + 1;
+	if (verify && (prot & PROT_WRITE) && len > VERIFY_BLOCK)
+		len = rounddown_64(len, VERIFY_BLOCK);
 
 	flags = (random() % 2) ? MAP_SHARED : MAP_PRIVATE;
 	addr = mmap(NULL, len, prot, flags, fd, off);
-	e = (addr == MAP_FAILED) ? errno : 0;
+	e = (addr == MAP_FAILED) ? op_failed(errno) : 0;
 	if (e) {
 		if (v)
 			printf("%d/%lld: do_mmap - mmap failed %s%s [%lld,%d,%s] %d\n",
@@ -4438,12 +8482,18 @@ do_mmap(opnum_t opno, long r, int prot)
 	if (prot & PROT_WRITE) {
 		if ((e = sigsetjmp(sigbus_jmpbuf, 1)) == 0) {
 			sigbus_jmp = &sigbus_jmpbuf;
-			memset(addr, nameseq & 0xff, len);
+			fill_buf(addr, off, len, stb.st_ino);
 		}
+		/* a private mapping leaves the file as it was */
+		if (e)
+			verify_forget(stb.st_ino, off, len);
+		else if (flags == MAP_SHARED)
+			verify_wrote(addr, stb.st_ino, off, len, len);
 	} else {
 		char *buf;
 		if ((buf = malloc(len)) != NULL) {
 			memcpy(buf, addr, len);
+			verify_check(opno, f.path, stb.st_ino, buf, off, len);
 			free(buf);
 		}
 	}
@@ -4451,6 +8501,9 @@ do_mmap(opnum_t opno, long r, int prot)
 	/* set NULL to stop other functions from doing siglongjmp */
 	sigbus_jmp = NULL;
 
+	trace_op((prot & PROT_WRITE) ? OP_MWRITE : OP_MREAD, opno, f.path, NULL,
+		 off, 0, len, (flags << 8) | (nsp->nameseq & 0xff),
+		 e ? op_failed(EFAULT) : 0);
 	if (v)
 		printf("%d/%lld: %s %s%s [%lld,%d,%s] %s\n",
 		       procid, opno, (prot & PROT_WRITE) ? "mwrite" : "mread",
@@ -4483,7 +8536,7 @@ void
 punch_f(opnum_t opno, long r)
 {
 #ifdef HAVE_LINUX_FALLOC_H
-	do_fallocate(opno, r, FALLOC_FL_PUNCH_HOLE);
+	do_fallocate(OP_PUNCH, opno, r, FALLOC_FL_PUNCH_HOLE);
 #endif
 }
 
@@ -4491,7 +8544,7 @@ void
 zero_f(opnum_t opno, long r)
 {
 #ifdef HAVE_LINUX_FALLOC_H
-	do_fallocate(opno, r, FALLOC_FL_ZERO_RANGE);
+	do_fallocate(OP_ZERO, opno, r, FALLOC_FL_ZERO_RANGE);
 #endif
 }
 
@@ -4499,7 +8552,7 @@ void
 collapse_f(opnum_t opno, long r)
 {
 #ifdef HAVE_LINUX_FALLOC_H
-	do_fallocate(opno, r, FALLOC_FL_COLLAPSE_RANGE);
+	do_fallocate(OP_COLLAPSE, opno, r, FALLOC_FL_COLLAPSE_RANGE);
 #endif
 }
 
@@ -4507,7 +8560,7 @@ void
 insert_f(opnum_t opno, long r)
 {
 #ifdef HAVE_LINUX_FALLOC_H
-	do_fallocate(opno, r, FALLOC_FL_INSERT_RANGE);
+	do_fallocate(OP_INSERT, opno, r, FALLOC_FL_INSERT_RANGE);
 #endif
 }
 
@@ -4516,7 +8569,7 @@ unshare_f(opnum_t opno, long r)
 {
 #ifdef HAVE_LINUX_FALLOC_H
 # ifdef FALLOC_FL_UNSHARE_RANGE
-	do_fallocate(opno, r, FALLOC_FL_UNSHARE_RANGE);
+	do_fallocate(OP_UNSHARE, opno, r, FALLOC_FL_UNSHARE_RANGE);
 # endif
 #endif
 }
@@ -4528,6 +8581,7 @@ read_f(opnum_t opno, long r)
 	int		e;
 	pathname_t	f;
 	int		fd;
+	ssize_t		n;
 	size_t		len;
 	int64_t		lr;
 	off64_t		off;
@@ -4543,7 +8597,7 @@ read_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_RDONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -4570,12 +8624,15 @@ read_f(opnum_t opno, long r)
 		return;
 	}
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % stb.st_size);
+	off = pick_off(lr, stb.st_size);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	buf = malloc(len);
-	e = read(fd, buf, len) < 0 ? errno : 0;
+	n = read(fd, buf, len);
+	e = n < 0 ? op_failed(errno) : 0;
+	verify_check(opno, f.path, stb.st_ino, buf, off, n);
 	free(buf);
+	trace_op(OP_READ, opno, f.path, NULL, off, 0, len, 0, e);
 	if (v)
 		printf("%d/%lld: read %s%s [%lld,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off, (int)len, e);
@@ -4598,7 +8655,7 @@ readlink_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = readlink_path(&f, buf, PATH_MAX) < 0 ? errno : 0;
+	e = readlink_path(&f, buf, PATH_MAX) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (v)
 		printf("%d/%lld: readlink %s %d\n", procid, opno, f.path, e);
@@ -4612,6 +8669,7 @@ readv_f(opnum_t opno, long r)
 	int		e;
 	pathname_t	f;
 	int		fd;
+	ssize_t		n;
 	size_t		len;
 	int64_t		lr;
 	off64_t		off;
@@ -4632,7 +8690,7 @@ readv_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_RDONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -4659,9 +8717,9 @@ readv_f(opnum_t opno, long r)
 		return;
 	}
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % stb.st_size);
+	off = pick_off(lr, stb.st_size);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
 	buf = malloc(len);
 
 	iovcnt = (random() % MIN(len, IOV_MAX)) + 1;
@@ -4674,9 +8732,12 @@ readv_f(opnum_t opno, long r)
 		iovb += iovl;
 	}
 
-	e = readv(fd, iov, iovcnt) < 0 ? errno : 0;
+	n = readv(fd, iov, iovcnt);
+	e = n < 0 ? op_failed(errno) : 0;
+	verify_check(opno, f.path, stb.st_ino, buf, off, n);
 	free(iov);
 	free(buf);
+	trace_op(OP_READV, opno, f.path, NULL, off, iovcnt, iovl * iovcnt, 0, e);
 	if (v)
 		printf("%d/%lld: readv %s%s [%lld,%d,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off, (int)iovl,
@@ -4691,6 +8752,7 @@ read_dontcache_f(opnum_t opno, long r)
 	int		e;
 	pathname_t	f;
 	int		fd;
+	ssize_t		n;
 	int64_t		lr;
 	off64_t		off;
 	struct stat64	stb;
@@ -4707,7 +8769,7 @@ read_dontcache_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_RDONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -4734,16 +8796,22 @@ read_dontcache_f(opnum_t opno, long r)
 		return;
 	}
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % stb.st_size);
-	iov.iov_len = (random() % FILELEN_MAX) + 1;
+	off = pick_off(lr, stb.st_size);
+	iov.iov_len = pick_len();
 	iov.iov_base = malloc(iov.iov_len);
 	flags = have_rwf_dontcache ? RWF_DONTCACHE : 0;
-	e = preadv2(fd, &iov, 1, off, flags) < 0 ? errno : 0;
+	n = preadv2(fd, &iov, 1, off, flags);
+	e = n < 0 ? op_failed(errno) : 0;
 	if (have_rwf_dontcache && e == EOPNOTSUPP) {
 		have_rwf_dontcache = 0;
-		e = preadv2(fd, &iov, 1, off, 0) < 0 ? errno : 0;
+		op_errno = 0;
+		n = preadv2(fd, &iov, 1, off, 0);
+		e = n < 0 ? op_failed(errno) : 0;
 	}
+	verify_check(opno, f.path, stb.st_ino, iov.iov_base, off, n);
 	free(iov.iov_base);
+	trace_op(OP_READ_DONTCACHE, opno, f.path, NULL, off, 0, iov.iov_len, 0,
+		 e);
 	if (v)
 		printf("%d/%lld: read dontcache %s%s [%lld,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off,
@@ -4787,7 +8855,8 @@ removefattr_f(opnum_t opno, long r)
 		goto out;
 	}
 
-	e = removexattr(f.path, name) < 0 ? errno : 0;
+	e = removexattr(f.path, name) < 0 ? op_failed(errno) : 0;
+	trace_op(OP_REMOVEFATTR, opno, f.path, name, 0, 0, 0, 0, e);
 	if (v)
 		printf("%d/%lld: removefattr file %s name %s %d\n",
 		       procid, opno, f.path, name, e);
@@ -4806,7 +8875,7 @@ struct print_flags renameat2_flags [] = {
 	({translate_flags(mode, "|", renameat2_flags);})
 
 void
-do_renameat2(opnum_t opno, long r, int mode)
+do_renameat2(opty_t op, opnum_t opno, long r, int mode)
 {
 	fent_t		*dfep;
 	int		e;
@@ -4839,7 +8908,7 @@ do_renameat2(opnum_t opno, long r, int mode)
 	 * restrict exchange operation to files of the same type.
 	 */
 	if (mode == RENAME_EXCHANGE) {
-		which = 1 << (flp - flist);
+		which = 1 << (flp - nsp->flist);
 		init_pathname(&newf);
 		if (!get_fname(which, random(), &newf, NULL, &dfep, &v)) {
 			if (v)
@@ -4878,7 +8947,7 @@ do_renameat2(opnum_t opno, long r, int mode)
 		 * in name.
 		 */
 		init_pathname(&newf);
-		e = generate_fname(dfep, flp - flist, &newf, &id, &v1);
+		e = generate_fname(dfep, flp - nsp->flist, &newf, &id, &v1);
 		v |= v1;
 		if (!e) {
 			if (v) {
@@ -4891,12 +8960,12 @@ do_renameat2(opnum_t opno, long r, int mode)
 			return;
 		}
 	}
-	e = rename_path(&f, &newf, mode) < 0 ? errno : 0;
+	e = rename_path(&f, &newf, mode) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e == 0) {
 		int xattr_counter = fep->xattr_counter;
 		bool swap = (mode == RENAME_EXCHANGE) ? true : false;
-		int ft = flp - flist;
+		int ft = flp - nsp->flist;
 
 		oldid = fep->id;
 		oldparid = fep->parent;
@@ -4910,15 +8979,16 @@ do_renameat2(opnum_t opno, long r, int mode)
 
 		if (mode == RENAME_WHITEOUT) {
 			fep->xattr_counter = 0;
-			add_to_flist(flp - flist, id, parid, xattr_counter);
+			add_to_flist(flp - nsp->flist, id, parid, xattr_counter);
 		} else if (mode == RENAME_EXCHANGE) {
 			fep->xattr_counter = dfep->xattr_counter;
 			dfep->xattr_counter = xattr_counter;
 		} else {
-			del_from_flist(flp - flist, fep - flp->fents);
-			add_to_flist(flp - flist, id, parid, xattr_counter);
+			del_from_flist(flp - nsp->flist, fep - flp->fents);
+			add_to_flist(flp - nsp->flist, id, parid, xattr_counter);
 		}
 	}
+	trace_op(op, opno, f.path, newf.path, 0, 0, 0, mode, e);
 	if (v) {
 		printf("%d/%lld: rename(%s) %s to %s %d\n", procid,
 			opno, translate_renameat2_flags(mode), f.path,
@@ -4937,25 +9007,25 @@ do_renameat2(opnum_t opno, long r, int mode)
 void
 rename_f(opnum_t opno, long r)
 {
-	do_renameat2(opno, r, 0);
+	do_renameat2(OP_RENAME, opno, r, 0);
 }
 
 void
 rnoreplace_f(opnum_t opno, long r)
 {
-	do_renameat2(opno, r, RENAME_NOREPLACE);
+	do_renameat2(OP_RNOREPLACE, opno, r, RENAME_NOREPLACE);
 }
 
 void
 rexchange_f(opnum_t opno, long r)
 {
-	do_renameat2(opno, r, RENAME_EXCHANGE);
+	do_renameat2(OP_REXCHANGE, opno, r, RENAME_EXCHANGE);
 }
 
 void
 rwhiteout_f(opnum_t opno, long r)
 {
-	do_renameat2(opno, r, RENAME_WHITEOUT);
+	do_renameat2(OP_RWHITEOUT, opno, r, RENAME_WHITEOUT);
 }
 
 void
@@ -4979,7 +9049,7 @@ resvsp_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_RDWR);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -4998,12 +9068,12 @@ resvsp_f(opnum_t opno, long r)
 	}
 	inode_info(st, sizeof(st), &stb, v);
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = (off64_t)(lr % file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
 	fl.l_whence = SEEK_SET;
 	fl.l_start = off;
 	fl.l_len = (off64_t)(random() % (1024 * 1024));
-	e = xfsctl(f.path, fd, XFS_IOC_RESVSP64, &fl) < 0 ? errno : 0;
+	e = xfsctl(f.path, fd, XFS_IOC_RESVSP64, &fl) < 0 ? op_failed(errno) : 0;
 	if (v)
 		printf("%d/%lld: xfsctl(XFS_IOC_RESVSP64) %s%s [%lld,%lld] %d\n",
 		       procid, opno, f.path, st,
@@ -5029,13 +9099,14 @@ rmdir_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = rmdir_path(&f) < 0 ? errno : 0;
+	e = rmdir_path(&f) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e == 0) {
 		oldid = fep->id;
 		oldparid = fep->parent;
-		del_from_flist(FT_DIR, fep - flist[FT_DIR].fents);
+		del_from_flist(FT_DIR, fep - nsp->flist[FT_DIR].fents);
 	}
+	trace_op(OP_RMDIR, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v) {
 		printf("%d/%lld: rmdir %s %d\n", procid, opno, f.path, e);
 		if (e == 0)
@@ -5058,11 +9129,13 @@ setattr_f(opnum_t opno, long r)
 	if (!get_fname(FT_ANYm, r, &f, NULL, NULL, &v))
 		append_pathname(&f, ".");
 	fd = open_path(&f, O_RDWR);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 
 	fl = attr_mask & (uint)random();
 	e = ioctl(fd, FS_IOC_SETFLAGS, &fl);
+	if (e < 0)
+		op_failed(errno);
 	if (v)
 		printf("%d/%lld: setattr %s %x %d\n", procid, opno, f.path, fl, e);
 	free_pathname(&f);
@@ -5132,9 +9205,10 @@ setfattr_f(opnum_t opno, long r)
 		goto out;
 	}
 
-	e = setxattr(f.path, name, value, value_len, flag) < 0 ? errno : 0;
+	e = setxattr(f.path, name, value, value_len, flag) < 0 ? op_failed(errno) : 0;
 	if (e == 0)
 		fep->xattr_counter++;
+	trace_op(OP_SETFATTR, opno, f.path, name, 0, 0, value_len, flag, e);
 	if (v)
 		printf("%d/%lld: setfattr file %s name %s flag %s value length %d: %d\n",
 		       procid, opno, f.path, name, xattr_flag_to_string(flag),
@@ -5208,8 +9282,9 @@ stat_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = lstat64_path(&f, &stb) < 0 ? errno : 0;
+	e = lstat64_path(&f, &stb) < 0 ? op_failed(errno) : 0;
 	check_cwd();
+	trace_op(OP_STAT, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v)
 		printf("%d/%lld: stat %s %d\n", procid, opno, f.path, e);
 	free_pathname(&f);
@@ -5282,7 +9357,7 @@ subvol_delete_f(opnum_t opno, long r)
 		oldid = fep->id;
 		oldparid = fep->parent;
 		delete_subvol_children(oldid);
-		del_from_flist(FT_SUBVOL, fep - flist[FT_SUBVOL].fents);
+		del_from_flist(FT_SUBVOL, fep - nsp->flist[FT_SUBVOL].fents);
 	}
 	if (v) {
 		printf("%d/%lld: subvol_delete %s %d(%s)\n", procid, opno, f.path,
@@ -5332,10 +9407,11 @@ symlink_f(opnum_t opno, long r)
 	val[len] = '\0';
 	for (i = 10; i < len - 1; i += 10)
 		val[i] = '/';
-	e = symlink_path(val, &f) < 0 ? errno : 0;
+	e = symlink_path(val, &f) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e == 0)
 		add_to_flist(FT_SYM, id, parid, 0);
+	trace_op(OP_SYMLINK, opno, f.path, val, 0, 0, 0, 0, e);
 	free(val);
 	if (v) {
 		printf("%d/%lld: symlink %s %d\n", procid, opno, f.path, e);
@@ -5354,8 +9430,9 @@ sync_f(opnum_t opno, long r)
 	fd = open(homedir, O_RDONLY|O_DIRECTORY);
 	if (fd < 0)
 		goto use_sync;
-	e = syncfs(fd) < 0 ? errno : 0;
+	e = syncfs(fd) < 0 ? op_failed(errno) : 0;
 	close(fd);
+	trace_op(OP_SYNC, opno, NULL, NULL, 0, 0, 0, 0, e);
 	if (verbose)
 		printf("%d/%lld: syncfs %d\n", procid, opno, e);
 	return;
@@ -5384,7 +9461,7 @@ truncate_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = stat64_path(&f, &stb) < 0 ? errno : 0;
+	e = stat64_path(&f, &stb) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e > 0) {
 		if (v)
@@ -5395,10 +9472,13 @@ truncate_f(opnum_t opno, long r)
 	}
 	inode_info(st, sizeof(st), &stb, v);
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = (off64_t)(lr % file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
-	e = truncate64_path(&f, off) < 0 ? errno : 0;
+	if (verify)
+		off = rounddown_64(off, VERIFY_BLOCK);
+	e = truncate64_path(&f, off) < 0 ? op_failed(errno) : 0;
 	check_cwd();
+	trace_op(OP_TRUNCATE, opno, f.path, NULL, off, 0, 0, 0, e);
 	if (v)
 		printf("%d/%lld: truncate %s%s %lld %d\n", procid, opno, f.path,
 		       st, (long long)off, e);
@@ -5423,13 +9503,14 @@ unlink_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	e = unlink_path(&f) < 0 ? errno : 0;
+	e = unlink_path(&f) < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (e == 0) {
 		oldid = fep->id;
 		oldparid = fep->parent;
-		del_from_flist(flp - flist, fep - flp->fents);
+		del_from_flist(flp - nsp->flist, fep - flp->fents);
 	}
+	trace_op(OP_UNLINK, opno, f.path, NULL, 0, 0, 0, 0, e);
 	if (v) {
 		printf("%d/%lld: unlink %s %d\n", procid, opno, f.path, e);
 		if (e == 0)
@@ -5460,7 +9541,7 @@ unresvsp_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_RDWR);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -5479,12 +9560,12 @@ unresvsp_f(opnum_t opno, long r)
 	}
 	inode_info(st, sizeof(st), &stb, v);
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = (off64_t)(lr % file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
 	fl.l_whence = SEEK_SET;
 	fl.l_start = off;
 	fl.l_len = (off64_t)(random() % (1 << 20));
-	e = xfsctl(f.path, fd, XFS_IOC_UNRESVSP64, &fl) < 0 ? errno : 0;
+	e = xfsctl(f.path, fd, XFS_IOC_UNRESVSP64, &fl) < 0 ? op_failed(errno) : 0;
 	if (v)
 		printf("%d/%lld: xfsctl(XFS_IOC_UNRESVSP64) %s%s [%lld,%lld] %d\n",
 		       procid, opno, f.path, st,
@@ -5517,6 +9598,7 @@ write_f(opnum_t opno, long r)
 	pathname_t	f;
 	int		fd;
 	size_t		len;
+	ssize_t		n;
 	int64_t		lr;
 	off64_t		off;
 	struct stat64	stb;
@@ -5531,7 +9613,7 @@ write_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_WRONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -5550,14 +9632,22 @@ write_f(opnum_t opno, long r)
 	}
 	inode_info(st, sizeof(st), &stb, v);
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = pick_off(lr, file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
+	if (verify)
+		off = rounddown_64(off, VERIFY_BLOCK);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
+	if (verify)
+		len = roundup_64(len, VERIFY_BLOCK);
 	buf = malloc(len);
-	memset(buf, nameseq & 0xff, len);
-	e = write(fd, buf, len) < 0 ? errno : 0;
+	fill_buf(buf, off, len, stb.st_ino);
+	n = write(fd, buf, len);
+	e = n < 0 ? op_failed(errno) : 0;
+	verify_wrote(buf, stb.st_ino, off, len, n);
 	free(buf);
+	trace_op(OP_WRITE, opno, f.path, NULL, off, 0, len,
+		 nsp->nameseq & 0xff, e);
 	if (v)
 		printf("%d/%lld: write %s%s [%lld,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off, (int)len, e);
@@ -5573,6 +9663,7 @@ writev_f(opnum_t opno, long r)
 	pathname_t	f;
 	int		fd;
 	size_t		len;
+	ssize_t		n;
 	int64_t		lr;
 	off64_t		off;
 	struct stat64	stb;
@@ -5592,7 +9683,7 @@ writev_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_WRONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -5611,12 +9702,16 @@ writev_f(opnum_t opno, long r)
 	}
 	inode_info(st, sizeof(st), &stb, v);
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = pick_off(lr, file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
+	if (verify)
+		off = rounddown_64(off, VERIFY_BLOCK);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = pick_len();
+	if (verify)
+		len = roundup_64(len, VERIFY_BLOCK);
 	buf = malloc(len);
-	memset(buf, nameseq & 0xff, len);
+	fill_buf(buf, off, len, stb.st_ino);
 
 	iovcnt = (random() % MIN(len, IOV_MAX)) + 1;
 	iov = calloc(iovcnt, sizeof(struct iovec));
@@ -5627,10 +9722,16 @@ writev_f(opnum_t opno, long r)
 		(iov + i)->iov_len  = iovl;
 		iovb += iovl;
 	}
+	if (verify)	/* don't leave a part block off the end */
+		(iov + iovcnt - 1)->iov_len += len - iovb;
 
-	e = writev(fd, iov, iovcnt) < 0 ? errno : 0;
+	n = writev(fd, iov, iovcnt);
+	e = n < 0 ? op_failed(errno) : 0;
+	verify_wrote(buf, stb.st_ino, off, len, n);
 	free(buf);
 	free(iov);
+	trace_op(OP_WRITEV, opno, f.path, NULL, off, iovcnt, iovl * iovcnt,
+		 nsp->nameseq & 0xff, e);
 	if (v)
 		printf("%d/%lld: writev %s%s [%lld,%d,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off, (int)iovl,
@@ -5645,6 +9746,7 @@ write_dontcache_f(opnum_t opno, long r)
 	int		e;
 	pathname_t	f;
 	int		fd;
+	ssize_t		n;
 	int64_t		lr;
 	off64_t		off;
 	struct stat64	stb;
@@ -5661,7 +9763,7 @@ write_dontcache_f(opnum_t opno, long r)
 		return;
 	}
 	fd = open_path(&f, O_WRONLY);
-	e = fd < 0 ? errno : 0;
+	e = fd < 0 ? op_failed(errno) : 0;
 	check_cwd();
 	if (fd < 0) {
 		if (v)
@@ -5680,18 +9782,28 @@ write_dontcache_f(opnum_t opno, long r)
 	}
 	inode_info(st, sizeof(st), &stb, v);
 	lr = ((int64_t)random() << 32) + random();
-	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
+	off = pick_off(lr, file_limit(stb.st_size, stb.st_ino));
 	off %= maxfsize;
-	iov.iov_len = (random() % FILELEN_MAX) + 1;
+	iov.iov_len = pick_len();
+	if (verify) {
+		off = rounddown_64(off, VERIFY_BLOCK);
+		iov.iov_len = roundup_64(iov.iov_len, VERIFY_BLOCK);
+	}
 	iov.iov_base = malloc(iov.iov_len);
-	memset(iov.iov_base, nameseq & 0xff, iov.iov_len);
+	fill_buf(iov.iov_base, off, iov.iov_len, stb.st_ino);
 	flags = have_rwf_dontcache ? RWF_DONTCACHE : 0;
-	e = pwritev2(fd, &iov, 1, off, flags) < 0 ? errno : 0;
+	n = pwritev2(fd, &iov, 1, off, flags);
+	e = n < 0 ? op_failed(errno) : 0;
 	if (have_rwf_dontcache && e == EOPNOTSUPP) {
 		have_rwf_dontcache = 0;
-		e = pwritev2(fd, &iov, 1, off, 0) < 0 ? errno : 0;
+		op_errno = 0;
+		n = pwritev2(fd, &iov, 1, off, 0);
+		e = n < 0 ? op_failed(errno) : 0;
 	}
+	verify_wrote(iov.iov_base, stb.st_ino, off, iov.iov_len, n);
 	free(iov.iov_base);
+	trace_op(OP_WRITE_DONTCACHE, opno, f.path, NULL, off, 0, iov.iov_len,
+		 nsp->nameseq & 0xff, e);
 	if (v)
 		printf("%d/%lld: write dontcache %s%s [%lld,%d] %d\n",
 		       procid, opno, f.path, st, (long long)off,
@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <pthread.h>
 #ifdef AIO
 #include <libaio.h>
 #endif
@@ -41,6 +42,7 @@
 #endif
 #include <sys/syscall.h>
 #include "statx.h"
+#include "latency.h"
 
 #ifndef MAP_FILE
 # define MAP_FILE 0
@@ -72,15 +74,17 @@ enum opflags {
 struct log_entry {
 	int	operation;
 	int	nr_args;
-	int	args[4];
+	long	args[4];
 	enum opflags flags;
+	int	file;		/* index of the file, with --files */
+	int	from;		/* and of the source of a range op */
 };
 
 #define	LOGSIZE	10000
 
-struct log_entry	oplog[LOGSIZE];	/* the log */
-int			logptr = 0;	/* current position in log */
-int			logcount = 0;	/* total ops */
+__thread struct log_entry	oplog[LOGSIZE];	/* the log */
+__thread int		logptr = 0;	/* current position in log */
+__thread int		logcount = 0;	/* total ops */
 
 /*
  * The operation matrix is complex due to conditional execution of different
@@ -144,21 +148,21 @@ enum {
 #define PAGE_MASK       (PAGE_SIZE - 1)
 
 char	*original_buf;			/* a pointer to the original data */
-char	*good_buf;			/* a pointer to the correct data */
-char	*temp_buf;			/* a pointer to the current data */
-char	*fname;				/* name of our test file */
+__thread char	*good_buf;		/* a pointer to the correct data */
+__thread char	*temp_buf;		/* a pointer to the current data */
+__thread char	*fname;			/* name of our test file */
 char	*bname;				/* basename of our test file */
 char	*logdev;			/* -i flag */
 char	*logid;				/* -j flag */
 char	dname[1024];			/* -P flag */
 char	goodfile[PATH_MAX];
 int	dirpath = 0;			/* -P flag */
-int	fd;				/* fd for our test file */
+__thread int	fd;			/* fd for our test file */
 
 blksize_t	block_size = 0;
-off_t		file_size = 0;
-off_t		biggest = 0;
-long long	testcalls = 0;		/* calls to function "test" */
+__thread off_t	file_size = 0;
+__thread off_t	biggest = 0;
+__thread long long	testcalls = 0;	/* calls to function "test" */
 
 long long	simulatedopcount = 0;	/* -b flag */
 int	closeprob = 0;			/* -c flag */
@@ -180,7 +184,7 @@ int	writebdy = 1;			/* -w flag */
 long	monitorstart = -1;		/* -m flag */
 long	monitorend = -1;		/* -m flag */
 int	lite = 0;			/* -L flag */
-long long numops = -1;			/* -N flag */
+__thread long long numops = -1;		/* -N flag */
 int	randomoplen = 1;		/* -O flag disables it */
 int	seed = 1;			/* -S flag */
 int     mapped_writes = 1;              /* -W flag disables */
@@ -193,13 +197,14 @@ int	collapse_range_calls = 1;	/* -C flag disables */
 int	insert_range_calls = 1;		/* -I flag disables */
 int	mapped_reads = 1;		/* -R flag disables it */
 int	check_file = 0;			/* -X flag enables */
+int	full_check = 100;		/* --full-check */
 int	clone_range_calls = 1;		/* -J flag disables */
 int	dedupe_range_calls = 1;		/* -B flag disables */
 int	copy_range_calls = 1;		/* -E flag disables */
 int	exchange_range_calls = 1;	/* -0 flag disables */
 int	integrity = 0;			/* -i flag */
 int	pollute_eof = 0;		/* -e flag */
-int	fsxgoodfd = 0;
+__thread int	fsxgoodfd = 0;
 int	o_direct;			/* -Z */
 int	aio = 0;
 int	uring = 0;
@@ -207,6 +212,28 @@ int	mark_nr = 0;
 int	dontcache_io = 1;
 int	hugepages = 0;                  /* -h flag */
 int	do_atomic_writes = 1;		/* -a flag disables */
+int	large_file = 0;			/* --large */
+unsigned long	model_window;		/* with it, bytes of good_buf */
+int	iodepth = 1;			/* --iodepth */
+int	io_inflight;			/* IOs it has submitted, not reaped */
+int	io_queued;			/* test()'s op was left in flight */
+
+/*
+ * --report: what each kind of op has done.
+ */
+struct opstat {
+	unsigned long long	count;
+	unsigned long long	bytes;
+	unsigned long long	ns;		/* total latency */
+	unsigned long long	max_ns;
+	unsigned long long	hist[LAT_BUCKETS];
+};
+
+FILE		*report_fp;
+struct timespec	report_start;
+__thread struct timespec	op_start;	/* when test() began its op */
+struct opstat	*opstats;		/* OP_MAX_INTEGRITY for each thread */
+__thread struct opstat	*my_opstats;
 
 /* User for atomic writes */
 int awu_min = 0;
@@ -224,7 +251,13 @@ struct hugepages_collapse_info hugepages_info;
 int page_size;
 int page_mask;
 int mmap_mask;
-int fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags);
+int fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned long offset, int flags);
+void gendata(char *original_buf, char *good_buf, unsigned long offset,
+	     unsigned long size);
+struct io_slot *io_order(int rw, unsigned long offset, unsigned long len);
+void io_queue(struct io_slot *s, int rw, unsigned long offset,
+	      unsigned long len, int flags);
+void io_drain(void);
 #define READ 0
 #define WRITE 1
 #define fsxread(a,b,c,d,f)	fsx_rw(READ, a,b,c,d,f)
@@ -236,9 +269,48 @@ const char *replayops = NULL;
 const char *recordops = NULL;
 FILE *	fsxlogf = NULL;
 FILE *	replayopsf = NULL;
-char opsfile[PATH_MAX];
-int badoff = -1;
-int closeopen = 0;
+__thread char opsfile[PATH_MAX];
+__thread long badoff = -1;
+__thread int closeopen = 0;
+
+/* Ranges -X has yet to re-read; past DIRTY_MAX they are merged into one. */
+#define DIRTY_MAX	8
+
+struct dirty_range {
+	unsigned long	start;
+	unsigned long	end;
+};
+
+/*
+ * With --files each test file has its own fd and model.  The one a thread
+ * is working on is loaded into its fd, file_size, good_buf and so on, and
+ * saved back here when it moves on to another of its files.
+ */
+struct fsx_file {
+	char		*name;
+	char		*goodname;	/* its .fsxgood */
+	int		fd;
+	int		goodfd;
+	off_t		size;
+	off_t		biggest;
+	char		*good_buf;
+	struct extent	*extents;
+	int		nextents;
+	int		maxextents;
+	struct dirty_range	dirty[DIRTY_MAX];
+	int		ndirty;
+	int		checks_left;	/* until -X next reads it all */
+};
+
+struct fsx_file	*files;
+int		nfiles = 1;		/* --files */
+int		nthreads = 1;		/* --threads */
+long long	thread_numops;		/* -N for each of them */
+char		*thread_opsfile;	/* and the --record-ops prefix */
+__thread struct fsx_file	*cur_file;	/* loaded, see above */
+__thread struct fsx_file	*src_file;	/* of a range op */
+__thread struct fsx_file	**my_files;	/* the ones this thread owns */
+__thread int	my_nfiles;
 
 static void *round_ptr_up(void *ptr, unsigned long align, unsigned long offset)
 {
@@ -334,7 +406,7 @@ static int op_code(const char *name)
 }
 
 void
-log5(int operation, int arg0, int arg1, int arg2, enum opflags flags)
+log5(int operation, long arg0, long arg1, long arg2, enum opflags flags)
 {
 	struct log_entry *le;
 
@@ -348,6 +420,8 @@ log5(int operation, int arg0, int arg1, int arg2, enum opflags flags)
 	le->args[3] = file_size;
 	le->nr_args = 4;
 	le->flags = flags;
+	le->file = cur_file - files;
+	le->from = src_file - files;
 	logptr++;
 	logcount++;
 	if (logptr >= LOGSIZE)
@@ -355,7 +429,7 @@ log5(int operation, int arg0, int arg1, int arg2, enum opflags flags)
 }
 
 void
-log4(int operation, int arg0, int arg1, enum opflags flags)
+log4(int operation, long arg0, long arg1, enum opflags flags)
 {
 	struct log_entry *le;
 
@@ -368,12 +442,38 @@ log4(int operation, int arg0, int arg1, enum opflags flags)
 	le->args[2] = file_size;
 	le->nr_args = 3;
 	le->flags = flags;
+	le->file = cur_file - files;
+	le->from = src_file - files;
 	logptr++;
 	logcount++;
 	if (logptr >= LOGSIZE)
 		logptr = 0;
 }
 
+/* One line of a .fsxops file, as read_op() reads it back. */
+void
+write_op(FILE *f, struct log_entry *lp, bool overlap)
+{
+	int j;
+
+	if (lp->flags & FL_SKIPPED)
+		fprintf(f, "skip ");
+	fprintf(f, "%s", op_name(lp->operation));
+	for (j = 0; j < lp->nr_args; j++)
+		fprintf(f, " 0x%lx", lp->args[j]);
+	if (lp->flags & FL_KEEP_SIZE)
+		fprintf(f, " keep_size");
+	if (lp->flags & FL_CLOSE_OPEN)
+		fprintf(f, " close_open");
+	if (lp->flags & FL_UNSHARE)
+		fprintf(f, " unshare");
+	if (nfiles > 1)
+		fprintf(f, " file=%d from=%d", lp->file, lp->from);
+	if (overlap)
+		fprintf(f, " *");
+	fprintf(f, "\n");
+}
+
 void
 logdump(void)
 {
@@ -412,14 +512,14 @@ logdump(void)
 
 		switch (lp->operation) {
 		case OP_MAPREAD:
-			prt("MAPREAD  0x%x thru 0x%x\t(0x%x bytes)",
+			prt("MAPREAD  0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t***RRRR***");
 			break;
 		case OP_MAPWRITE:
-			prt("MAPWRITE 0x%x thru 0x%x\t(0x%x bytes)",
+			prt("MAPWRITE 0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
@@ -427,7 +527,7 @@ logdump(void)
 			break;
 		case OP_READ:
 		case OP_READ_DONTCACHE:
-			prt("READ     0x%x thru 0x%x\t(0x%x bytes)",
+			prt("READ     0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
@@ -436,7 +536,7 @@ logdump(void)
 		case OP_WRITE_DONTCACHE:
 		case OP_WRITE_ATOMIC:
 		case OP_WRITE:
-			prt("WRITE    0x%x thru 0x%x\t(0x%x bytes)",
+			prt("WRITE    0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (lp->args[0] > lp->args[2])
@@ -451,7 +551,7 @@ logdump(void)
 			break;
 		case OP_TRUNCATE:
 			down = lp->args[1] < lp->args[2];
-			prt("TRUNCATE %s\tfrom 0x%x to 0x%x",
+			prt("TRUNCATE %s\tfrom 0x%lx to 0x%lx",
 			    down ? "DOWN" : "UP", lp->args[2], lp->args[1]);
 			overlap = badoff >= lp->args[1 + !down] &&
 				  badoff < lp->args[1 + !!down];
@@ -460,7 +560,7 @@ logdump(void)
 			break;
 		case OP_FALLOCATE:
 			/* 0: offset 1: length 2: where alloced */
-			prt("FALLOC   0x%x thru 0x%x\t(0x%x bytes) ",
+			prt("FALLOC   0x%lx thru 0x%lx\t(0x%lx bytes) ",
 				lp->args[0], lp->args[0] + lp->args[1],
 				lp->args[1]);
 			if (lp->args[0] + lp->args[1] <= lp->args[2])
@@ -473,35 +573,35 @@ logdump(void)
 				prt("\t******FFFF");
 			break;
 		case OP_PUNCH_HOLE:
-			prt("PUNCH    0x%x thru 0x%x\t(0x%x bytes)",
+			prt("PUNCH    0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******PPPP");
 			break;
 		case OP_ZERO_RANGE:
-			prt("ZERO     0x%x thru 0x%x\t(0x%x bytes)",
+			prt("ZERO     0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******ZZZZ");
 			break;
 		case OP_COLLAPSE_RANGE:
-			prt("COLLAPSE 0x%x thru 0x%x\t(0x%x bytes)",
+			prt("COLLAPSE 0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******CCCC");
 			break;
 		case OP_INSERT_RANGE:
-			prt("INSERT 0x%x thru 0x%x\t(0x%x bytes)",
+			prt("INSERT 0x%lx thru 0x%lx\t(0x%lx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******IIII");
 			break;
 		case OP_EXCHANGE_RANGE:
-			prt("XCHG 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("XCHG 0x%lx thru 0x%lx\t(0x%lx bytes) to 0x%lx thru 0x%lx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -515,7 +615,7 @@ logdump(void)
 				prt("\t******XXXX");
 			break;
 		case OP_CLONE_RANGE:
-			prt("CLONE 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("CLONE 0x%lx thru 0x%lx\t(0x%lx bytes) to 0x%lx thru 0x%lx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -529,7 +629,7 @@ logdump(void)
 				prt("\t******JJJJ");
 			break;
 		case OP_DEDUPE_RANGE:
-			prt("DEDUPE 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("DEDUPE 0x%lx thru 0x%lx\t(0x%lx bytes) to 0x%lx thru 0x%lx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -543,7 +643,7 @@ logdump(void)
 				prt("\t******BBBB");
 			break;
 		case OP_COPY_RANGE:
-			prt("COPY 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("COPY 0x%lx thru 0x%lx\t(0x%lx bytes) to 0x%lx thru 0x%lx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -566,6 +666,11 @@ logdump(void)
 		}
 
 	    skipped:
+		if (nfiles > 1) {
+			prt("\tfile %d", lp->file);
+			if (lp->from != lp->file)
+				prt(" from %d", lp->from);
+		}
 		if (lp->flags & FL_CLOSE_OPEN)
 			prt("\n\t\tCLOSE/OPEN");
 		prt("\n");
@@ -573,24 +678,8 @@ logdump(void)
 		if (i == LOGSIZE)
 			i = 0;
 
-		if (logopsf) {
-			int j;
-
-			if (lp->flags & FL_SKIPPED)
-				fprintf(logopsf, "skip ");
-			fprintf(logopsf, "%s", op_name(lp->operation));
-			for (j = 0; j < lp->nr_args; j++)
-				fprintf(logopsf, " 0x%x", lp->args[j]);
-			if (lp->flags & FL_KEEP_SIZE)
-				fprintf(logopsf, " keep_size");
-			if (lp->flags & FL_CLOSE_OPEN)
-				fprintf(logopsf, " close_open");
-			if (lp->flags & FL_UNSHARE)
-				fprintf(logopsf, " unshare");
-			if (overlap)
-				fprintf(logopsf, " *");
-			fprintf(logopsf, "\n");
-		}
+		if (logopsf)
+			write_op(logopsf, lp, overlap);
 	}
 
 	if (logopsf) {
@@ -644,6 +733,420 @@ save_buffer(char *buffer, off_t bufferlength, int fd)
 }
 
 
+/*
+ * With --large the file is modelled as a sorted array of the extents that
+ * hold data instead of a copy of it; everything else reads as zeroes.  An
+ * extent records the op that wrote it and the offset it was written at,
+ * which is all it takes to regenerate the data after clones and shifts.
+ */
+struct extent {
+	unsigned long	start;		/* file range [start, end) */
+	unsigned long	end;
+	unsigned long	src;		/* offset the data was generated for */
+	long long	opno;		/* by this op */
+};
+
+__thread struct extent	*extents;
+__thread int	nextents;
+__thread int	maxextents;
+
+/* Save the file being worked on and load f (if any) in its place. */
+void
+file_switch(struct fsx_file *f)
+{
+	if (f == cur_file)
+		return;
+	if (cur_file) {
+		cur_file->fd = fd;
+		cur_file->goodfd = fsxgoodfd;
+		cur_file->size = file_size;
+		cur_file->biggest = biggest;
+		cur_file->good_buf = good_buf;
+		cur_file->extents = extents;
+		cur_file->nextents = nextents;
+		cur_file->maxextents = maxextents;
+	}
+	cur_file = f;
+	if (!f)
+		return;
+	fname = f->name;
+	fd = f->fd;
+	fsxgoodfd = f->goodfd;
+	file_size = f->size;
+	biggest = f->biggest;
+	good_buf = f->good_buf;
+	extents = f->extents;
+	nextents = f->nextents;
+	maxextents = f->maxextents;
+}
+
+/* The source file of a clone, dedupe, copy or exchange. */
+static int
+src_fd(void)
+{
+	return src_file == cur_file ? fd : src_file->fd;
+}
+
+static off_t
+src_size(void)
+{
+	return src_file == cur_file ? file_size : src_file->size;
+}
+
+/*
+ * What op opno wrote at offsets src..src+len: gendata()'s pattern, with a
+ * hash of the offset standing in for original_buf.  The hash is a multiply,
+ * so it steps by a constant from one odd offset to the next.
+ */
+#define LARGE_HASH	0x9e3779b97f4a7c15ULL
+
+void
+large_gendata(char *buf, unsigned long src, unsigned long len, long long opno)
+{
+	unsigned long i = !(src % 2);
+	unsigned long long h = (src + i) * LARGE_HASH;
+
+	if (filldata) {
+		memset(buf, filldata, len);
+		return;
+	}
+	memset(buf, opno % 256, len);
+	for (; i < len; i += 2, h += 2 * LARGE_HASH)
+		buf[i] += h >> 56;
+}
+
+/* Index of the first extent ending after off. */
+static int
+ext_index(unsigned long off)
+{
+	int lo = 0, hi = nextents, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (extents[mid].end > off)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static void
+ext_insert(int i, const struct extent *e)
+{
+	if (nextents == maxextents) {
+		maxextents = maxextents ? maxextents * 2 : 1024;
+		extents = realloc(extents, maxextents * sizeof(*extents));
+		if (!extents) {
+			prterr("ext_insert: realloc");
+			exit(101);
+		}
+	}
+	memmove(&extents[i + 1], &extents[i],
+		(nextents - i) * sizeof(*extents));
+	extents[i] = *e;
+	nextents++;
+}
+
+/* Split the extent straddling off; return the index of the first after. */
+static int
+ext_split(unsigned long off)
+{
+	int i = ext_index(off);
+	struct extent e;
+
+	if (i < nextents && extents[i].start < off) {
+		e = extents[i];
+		extents[i].end = off;
+		e.src += off - e.start;
+		e.start = off;
+		ext_insert(++i, &e);
+	}
+	return i;
+}
+
+/* Drop everything in off..off+len; return where it was. */
+static int
+ext_clear(unsigned long off, unsigned long len)
+{
+	int i = ext_split(off);
+	int j = ext_split(off + len);
+
+	if (j < nextents)
+		memmove(&extents[i], &extents[j],
+			(nextents - j) * sizeof(*extents));
+	nextents -= j - i;
+	return i;
+}
+
+/* Copy out the extents in off..off+len, relative to off. */
+static int
+ext_get(unsigned long off, unsigned long len, struct extent **ep)
+{
+	int i, first = ext_index(off);
+	int n = 0;
+	struct extent *e;
+
+	while (first + n < nextents && extents[first + n].start < off + len)
+		n++;
+	e = malloc((n + 1) * sizeof(*e));
+	if (!e) {
+		prterr("ext_get: malloc");
+		exit(101);
+	}
+	for (i = 0; i < n; i++) {
+		e[i] = extents[first + i];
+		if (e[i].start < off) {
+			e[i].src += off - e[i].start;
+			e[i].start = off;
+		}
+		if (e[i].end > off + len)
+			e[i].end = off + len;
+		e[i].start -= off;
+		e[i].end -= off;
+	}
+	*ep = e;
+	return n;
+}
+
+/* Put back extents from ext_get() at off, which must be clear. */
+static void
+ext_put(unsigned long off, struct extent *e, int n)
+{
+	int i = ext_index(off), k;
+
+	for (k = 0; k < n; k++) {
+		e[k].start += off;
+		e[k].end += off;
+		ext_insert(i + k, &e[k]);
+	}
+}
+
+static void
+ext_shift(int i, long delta)
+{
+	for (; i < nextents; i++) {
+		extents[i].start += delta;
+		extents[i].end += delta;
+	}
+}
+
+/* Note that f's offset..offset+size changed, for check_contents(). */
+void
+mark_dirty(struct fsx_file *f, unsigned long offset, unsigned long size)
+{
+	struct dirty_range n = { offset, offset + size };
+	struct dirty_range *d, *e;
+	unsigned long gap, best = ULONG_MAX;
+	int i, j, bi = 0, bj = 0;
+
+	if (!check_file || !size)
+		return;
+	for (i = 0; i < f->ndirty; i++) {
+		d = &f->dirty[i];
+		if (n.start <= d->end && n.end >= d->start)
+			goto merge;
+	}
+	if (f->ndirty < DIRTY_MAX) {
+		f->dirty[f->ndirty++] = n;
+		return;
+	}
+	/*
+	 * Out of slots: merge the two ranges, the new one included, with the
+	 * smallest gap between them rather than reading everything in between.
+	 */
+	for (i = 0; i < f->ndirty; i++) {
+		for (j = i + 1; j <= f->ndirty; j++) {
+			d = &f->dirty[i];
+			e = j < f->ndirty ? &f->dirty[j] : &n;
+			gap = MAX(d->start, e->start) - MIN(d->end, e->end);
+			if (gap < best) {
+				best = gap;
+				bi = i;
+				bj = j;
+			}
+		}
+	}
+	d = &f->dirty[bi];
+	if (bj < f->ndirty) {
+		e = &f->dirty[bj];
+		d->start = MIN(d->start, e->start);
+		d->end = MAX(d->end, e->end);
+		*e = n;
+		return;
+	}
+merge:
+	d->start = MIN(d->start, n.start);
+	d->end = MAX(d->end, n.end);
+}
+
+/*
+ * The model of what the file should hold: good_buf, or with --large the
+ * extent map.  These keep the two in step for each kind of change.
+ */
+void
+model_write(unsigned long offset, unsigned long size)
+{
+	struct extent e = { offset, offset + size, offset, testcalls };
+
+	mark_dirty(cur_file, offset, size);
+	if (!large_file)
+		gendata(original_buf, good_buf, offset, size);
+	else
+		ext_insert(ext_clear(offset, size), &e);
+}
+
+void
+model_zero(unsigned long offset, unsigned long size)
+{
+	mark_dirty(cur_file, offset, size);
+	if (!large_file)
+		memset(good_buf + offset, '\0', size);
+	else
+		ext_clear(offset, size);
+}
+
+void
+model_copy(unsigned long dest, unsigned long offset, unsigned long size)
+{
+	struct fsx_file *dst_file = cur_file;
+	struct extent *e;
+	int n;
+
+	mark_dirty(cur_file, dest, size);
+	if (!large_file) {
+		memcpy(good_buf + dest, src_file == cur_file ? good_buf + offset :
+		       src_file->good_buf + offset, size);
+		return;
+	}
+	file_switch(src_file);
+	n = ext_get(offset, size, &e);
+	file_switch(dst_file);
+	ext_clear(dest, size);
+	ext_put(dest, e, n);
+	free(e);
+}
+
+void
+model_exchange(unsigned long offset, unsigned long dest, unsigned long size,
+	       char *tmp)
+{
+	struct fsx_file *dst_file = cur_file;
+	struct extent *e1, *e2;
+	char *src_buf;
+	int n1, n2;
+
+	mark_dirty(src_file, offset, size);
+	mark_dirty(cur_file, dest, size);
+	if (!large_file) {
+		src_buf = src_file == cur_file ? good_buf : src_file->good_buf;
+		memcpy(tmp, src_buf + offset, size);
+		memcpy(src_buf + offset, good_buf + dest, size);
+		memcpy(good_buf + dest, tmp, size);
+		return;
+	}
+	file_switch(src_file);
+	n1 = ext_get(offset, size, &e1);
+	ext_clear(offset, size);
+	file_switch(dst_file);
+	n2 = ext_get(dest, size, &e2);
+	ext_clear(dest, size);
+	ext_put(dest, e1, n1);
+	file_switch(src_file);
+	ext_put(offset, e2, n2);
+	file_switch(dst_file);
+	free(e1);
+	free(e2);
+}
+
+void
+model_collapse(unsigned long offset, unsigned long size)
+{
+	mark_dirty(cur_file, offset, ULONG_MAX - offset);
+	if (!large_file)
+		memmove(good_buf + offset, good_buf + offset + size,
+			file_size - offset - size);
+	else
+		ext_shift(ext_clear(offset, size), -(long)size);
+}
+
+void
+model_insert(unsigned long offset, unsigned long size)
+{
+	mark_dirty(cur_file, offset, ULONG_MAX - offset);
+	if (!large_file) {
+		memmove(good_buf + offset + size, good_buf + offset,
+			file_size - offset);
+		memset(good_buf + offset, '\0', size);
+	} else {
+		ext_shift(ext_split(offset), size);
+	}
+}
+
+/*
+ * The expected contents of offset..offset+size.  With --large they are
+ * regenerated into good_buf, which then only holds model_window bytes and
+ * is overwritten by the next call.
+ */
+char *
+model_data(unsigned long offset, unsigned long size)
+{
+	unsigned long start, end;
+	int i;
+
+	if (!large_file)
+		return good_buf + offset;
+
+	memset(good_buf, '\0', size);
+	for (i = ext_index(offset);
+	     i < nextents && extents[i].start < offset + size; i++) {
+		start = MAX(extents[i].start, offset);
+		end = MIN(extents[i].end, offset + size);
+		large_gendata(good_buf + start - offset,
+			      extents[i].src + start - extents[i].start,
+			      end - start, extents[i].opno);
+	}
+	return good_buf;
+}
+
+/*
+ * Write the expected file out to fd, sparsely with --large.  Returns -1 if
+ * that didn't work.
+ */
+int
+model_save(int fd)
+{
+	unsigned long off, len;
+	int i, n;
+
+	if (!large_file) {
+		save_buffer(good_buf, file_size, fd);
+		return 0;
+	}
+	if (fd <= 0)
+		return 0;
+	if (ftruncate(fd, 0) == -1) {
+		prterr("model_save: ftruncate");
+		return -1;
+	}
+	for (i = 0; i < nextents; i++) {
+		for (off = extents[i].start; off < extents[i].end; off += len) {
+			len = MIN(extents[i].end - off, model_window);
+			n = pwrite(fd, model_data(off, len), len, off);
+			if (n != len) {
+				prterr("model_save: pwrite");
+				return -1;
+			}
+		}
+	}
+	if (ftruncate(fd, file_size) == -1) {
+		prterr("model_save: ftruncate");
+		return -1;
+	}
+	return 0;
+}
+
+
 void
 report_failure(int status)
 {
@@ -651,10 +1154,10 @@ report_failure(int status)
 	
 	if (fsxgoodfd) {
 		if (good_buf) {
-			save_buffer(good_buf, file_size, fsxgoodfd);
+			model_save(fsxgoodfd);
 			prt("Correct content saved for comparison\n");
 			prt("(maybe hexdump \"%s\" vs \"%s\")\n",
-			    fname, goodfile);
+			    fname, cur_file->goodname);
 		}
 		close(fsxgoodfd);
 	}
@@ -697,33 +1200,34 @@ dump_fsync_buffer(void)
 		exit(212);
 	}
 
-	save_buffer(good_buf, file_size, good_fd);
+	model_save(good_fd);
 	close(good_fd);
 	prt("Dumped fsync buffer to %s\n", fname_buffer + dirpath);
 }
 
 void
-check_buffers(char *buf, unsigned offset, unsigned size)
+check_buffers(char *buf, unsigned long offset, unsigned long size)
 {
 	unsigned char c, t;
 	unsigned i = 0;
 	unsigned n = 0;
 	unsigned op = 0;
 	unsigned bad = 0;
+	char *good = model_data(offset, size);
 
-	if (memcmp(good_buf + offset, buf, size) != 0) {
-		prt("READ BAD DATA: offset = 0x%x, size = 0x%x, fname = %s\n",
+	if (memcmp(good, buf, size) != 0) {
+		prt("READ BAD DATA: offset = 0x%lx, size = 0x%lx, fname = %s\n",
 		    offset, size, fname);
 		prt("%-10s  %-6s  %-6s  %s\n", "OFFSET", "GOOD", "BAD", "RANGE");
 		while (size > 0) {
-			c = good_buf[offset];
+			c = good[i];
 			t = buf[i];
 			if (c != t) {
 			        if (n < 16) {
 					bad = short_at(&buf[i]);
-				        prt("0x%-8x  0x%04x  0x%04x  0x%x\n",
+				        prt("0x%-8lx  0x%04x  0x%04x  0x%x\n",
 					    offset,
-					    short_at(&good_buf[offset]), bad,
+					    short_at(&good[i]), bad,
 					    n);
 					op = buf[offset & 1 ? i+1 : i];
 					if (op)
@@ -791,10 +1295,10 @@ ftruncate_err:
 }
 
 void
-doflush(unsigned offset, unsigned size)
+doflush(unsigned long offset, unsigned long size)
 {
-	unsigned pg_offset;
-	unsigned map_size;
+	unsigned long pg_offset;
+	unsigned long map_size;
 	char    *p;
 
 	if (o_direct == O_DIRECT)
@@ -820,7 +1324,7 @@ doflush(unsigned offset, unsigned size)
 }
 
 void
-doread(unsigned offset, unsigned size, int flags)
+doread(unsigned long offset, unsigned long size, int flags)
 {
 	unsigned iret;
 
@@ -851,14 +1355,19 @@ doread(unsigned offset, unsigned size, int flags)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld read\t0x%x thru\t0x%x\t(0x%x bytes)\n", testcalls,
+		prt("%lld read\t0x%lx thru\t0x%lx\t(0x%lx bytes)\n", testcalls,
 		    offset, offset + size - 1, size);
+	if (iodepth > 1) {	/* checked when it completes */
+		io_queue(io_order(READ, offset, size), READ, offset, size,
+			 flags);
+		return;
+	}
 	iret = fsxread(fd, temp_buf, size, offset, flags);
 	if (iret != size) {
 		if (iret == -1)
 			prterr("doread: read");
 		else
-			prt("short read: 0x%x bytes instead of 0x%x\n",
+			prt("short read: 0x%x bytes instead of 0x%lx\n",
 			    iret, size);
 		report_failure(141);
 	}
@@ -866,7 +1375,7 @@ doread(unsigned offset, unsigned size, int flags)
 }
 
 void
-check_eofpage(char *s, unsigned offset, char *p, int size)
+check_eofpage(char *s, unsigned long offset, char *p, int size)
 {
 	unsigned long last_page, should_be_zero;
 
@@ -884,46 +1393,141 @@ check_eofpage(char *s, unsigned offset, char *p, int size)
 	     should_be_zero < last_page + page_size;
 	     should_be_zero++)
 		if (*(char *)should_be_zero) {
-			prt("Mapped %s: non-zero data past EOF (0x%llx) page offset 0x%x is 0x%04x\n",
+			prt("Mapped %s: non-zero data past EOF (0x%llx) page offset 0x%lx is 0x%04x\n",
 			    s, file_size - 1, should_be_zero & page_mask,
 			    short_at(should_be_zero));
 			report_failure(205);
 		}
 }
 
+/* Read offset..end back a window at a time and compare it to the model. */
+static void
+check_read(char *buf, unsigned long buflen, unsigned long offset,
+	   unsigned long end)
+{
+	unsigned long len;
+	unsigned iret;
+
+	offset = rounddown_64(offset, readbdy);
+	for (; offset < end; offset += len) {
+		len = MIN(end - offset, buflen);
+		iret = fsxread(fd, buf, len, offset, 0);
+		if (iret != len) {
+			if (iret == -1)
+				prterr("check_contents: read");
+			else
+				prt("short check read: 0x%x bytes instead of 0x%lx\n",
+				    iret, len);
+			report_failure(141);
+		}
+		check_buffers(buf, offset, len);
+	}
+}
+
+/*
+ * A hole in the --large model.  Only what SEEK_DATA says is allocated in
+ * it gets read, as fallocate, zero range and block rounding can leave
+ * zeroed data there; the rest of the hole costs a single lseek.
+ */
+static void
+check_hole(char *buf, unsigned long buflen, unsigned long offset,
+	   unsigned long end)
+{
+	off_t data, hole;
+
+	while (offset < end) {
+		data = lseek(fd, offset, SEEK_DATA);
+		if (data == (off_t)-1) {
+			if (errno == ENXIO)
+				return;
+			/* no SEEK_DATA here: it all has to be read */
+			check_read(buf, buflen, offset, end);
+			return;
+		}
+		if (data >= end)
+			return;
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == (off_t)-1 || hole > end)
+			hole = end;
+		check_read(buf, buflen, data,
+			   MIN(roundup_64(hole, readbdy), end));
+		offset = hole;
+	}
+}
+
+/*
+ * Check offset..end of the file.  With --large only the modelled extents
+ * are read back, and the holes between them are checked with SEEK_DATA.
+ */
+static void
+check_range(char *buf, unsigned long buflen, unsigned long offset,
+	    unsigned long end)
+{
+	unsigned long next;
+	int i;
+
+	if (!large_file) {
+		check_read(buf, buflen, offset, end);
+		return;
+	}
+	for (i = ext_index(offset); offset < end; i++) {
+		next = i < nextents ? MIN(MAX(extents[i].start, offset), end) :
+				      end;
+		check_hole(buf, buflen, offset, next);
+		if (next == end)
+			break;
+		offset = MIN(roundup_64(extents[i].end, readbdy), end);
+		check_read(buf, buflen, next, offset);
+	}
+}
+
 void
 check_contents(void)
 {
-	static char *check_buf;
-	unsigned offset = 0;
-	unsigned size = file_size;
-	unsigned map_offset;
-	unsigned map_size;
+	static __thread char *check_buf;
+	static __thread unsigned long check_len;
+	struct fsx_file *f = cur_file;
+	unsigned long offset, end;
+	unsigned long size = file_size;
+	unsigned long map_offset;
+	unsigned long map_size;
 	char *p;
-	unsigned iret;
+	int i;
 
+	/* read it back a window at a time when the file is modelled sparsely */
 	if (!check_buf) {
-		check_buf = (char *) malloc(maxfilelen + writebdy);
+		check_len = large_file ? model_window : maxfilelen;
+		check_buf = (char *) malloc(check_len + writebdy);
 		assert(check_buf != NULL);
 		check_buf = round_ptr_up(check_buf, writebdy, 0);
-		memset(check_buf, '\0', maxfilelen);
+		memset(check_buf, '\0', check_len);
 	}
 
 	if (o_direct)
 		size -= size % readbdy;
-	if (size == 0)
+	if (size == 0) {
+		f->ndirty = 0;
 		return;
+	}
 
-	iret = fsxread(fd, check_buf, size, offset, 0);
-	if (iret != size) {
-		if (iret == -1)
-			prterr("check_contents: read");
-		else
-			prt("short check read: 0x%x bytes instead of 0x%x\n",
-			    iret, size);
-		report_failure(141);
+	/*
+	 * Only what the ops since the last check changed needs reading back,
+	 * but every --full-check'th time, and after a close/open, read it all.
+	 */
+	if (f->checks_left-- <= 0) {
+		f->dirty[0].start = 0;
+		f->dirty[0].end = size;
+		f->ndirty = 1;
+		f->checks_left = full_check - 1;
 	}
-	check_buffers(check_buf, offset, size);
+	for (i = 0; i < f->ndirty; i++) {
+		offset = rounddown_64(f->dirty[i].start, readbdy);
+		end = roundup_64(MIN(f->dirty[i].end, size), readbdy);
+		if (offset < size)
+			check_range(check_buf, check_len, offset,
+				    MIN(end, size));
+	}
+	f->ndirty = 0;
 
 	/* Map eof page, check it */
 	map_offset = size - (size & PAGE_MASK);
@@ -945,10 +1549,10 @@ check_contents(void)
 }
 
 void
-domapread(unsigned offset, unsigned size)
+domapread(unsigned long offset, unsigned long size)
 {
-	unsigned pg_offset;
-	unsigned map_size;
+	unsigned long pg_offset;
+	unsigned long map_size;
 	char    *p;
 
 	offset -= offset % readbdy;
@@ -976,7 +1580,7 @@ domapread(unsigned offset, unsigned size)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld mapread\t0x%x thru\t0x%x\t(0x%x bytes)\n", testcalls,
+		prt("%lld mapread\t0x%lx thru\t0x%lx\t(0x%lx bytes)\n", testcalls,
 		    offset, offset + size - 1, size);
 
 	pg_offset = offset & PAGE_MASK;
@@ -1000,17 +1604,36 @@ domapread(unsigned offset, unsigned size)
 }
 
 
+/*
+ * Eight bytes at a time: the op number in each byte, plus original_buf in
+ * the odd offsets, added bytewise with no carries between the bytes.
+ */
 void
-gendata(char *original_buf, char *good_buf, unsigned offset, unsigned size)
+gendata(char *original_buf, char *good_buf, unsigned long offset, unsigned long size)
 {
+	static const unsigned char odd_lanes[2][8] = {
+		{ 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff },
+		{ 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0 },
+	};
+	const unsigned long long low7 = 0x7f7f7f7f7f7f7f7fULL;
+	unsigned long long op, odd, orig, sum;
+
+	if (filldata) {
+		memset(good_buf + offset, filldata, size);
+		return;
+	}
+	op = (unsigned long long)(testcalls % 256) * 0x0101010101010101ULL;
+	memcpy(&odd, odd_lanes[offset % 2], sizeof(odd));
+	for (; size >= sizeof(sum); offset += sizeof(sum), size -= sizeof(sum)) {
+		memcpy(&orig, original_buf + offset, sizeof(orig));
+		orig &= odd;
+		sum = ((op & low7) + (orig & low7)) ^ ((op ^ orig) & ~low7);
+		memcpy(good_buf + offset, &sum, sizeof(sum));
+	}
 	while (size--) {
-		if (filldata) {
-			good_buf[offset] = filldata;
-		} else {
-			good_buf[offset] = testcalls % 256;
-			if (offset % 2)
-				good_buf[offset] += original_buf[offset];
-		}
+		good_buf[offset] = testcalls % 256;
+		if (offset % 2)
+			good_buf[offset] += original_buf[offset];
 		offset++;
 	}
 }
@@ -1022,11 +1645,11 @@ gendata(char *original_buf, char *good_buf, unsigned offset, unsigned size)
  * be detected.
  */
 void
-pollute_eofpage(unsigned int maxoff)
+pollute_eofpage(unsigned long maxoff)
 {
-	unsigned offset = file_size;
-	unsigned pg_offset;
-	unsigned write_size;
+	unsigned long offset = file_size;
+	unsigned long pg_offset;
+	unsigned long write_size;
 	char    *p;
 
 	/*
@@ -1050,7 +1673,7 @@ pollute_eofpage(unsigned int maxoff)
 	     (monitorstart == -1 ||
 	     (offset + write_size > monitorstart &&
 	      (monitorend == -1 || offset <= monitorend)))))) {
-		prt("%lld pollute_eof\t0x%x thru\t0x%x\t(0x%x bytes)\n",
+		prt("%lld pollute_eof\t0x%lx thru\t0x%lx\t(0x%lx bytes)\n",
 			testcalls, offset, offset + write_size - 1, write_size);
 	}
 
@@ -1066,7 +1689,10 @@ pollute_eofpage(unsigned int maxoff)
 	 * good buffer because the upcoming operation is expected to zero this
 	 * range of the file.
 	 */
-	gendata(original_buf, p, pg_offset, write_size);
+	if (large_file)
+		large_gendata(p + pg_offset, offset, write_size, testcalls);
+	else
+		gendata(original_buf, p, pg_offset, write_size);
 
 	if (munmap(p, PAGE_SIZE) != 0)
 		prterr("pollute_eofpage: munmap");
@@ -1077,11 +1703,11 @@ pollute_eofpage(unsigned int maxoff)
  * EOF, zero the range from EOF to offset in the good buffer.
  */
 void
-update_file_size(unsigned offset, unsigned size)
+update_file_size(unsigned long offset, unsigned long size)
 {
 	if (offset > file_size) {
 		pollute_eofpage(offset + size);
-		memset(good_buf + file_size, '\0', offset - file_size);
+		model_zero(file_size, offset - file_size);
 	}
 	file_size = offset + size;
 }
@@ -1106,9 +1732,10 @@ static int rounddown_pow_of_2(int n) {
 }
 
 void
-dowrite(unsigned offset, unsigned size, int flags)
+dowrite(unsigned long offset, unsigned long size, int flags)
 {
 	unsigned iret;
+	struct io_slot *slot = NULL;
 
 	offset -= offset % writebdy;
 	if (o_direct)
@@ -1146,7 +1773,11 @@ dowrite(unsigned offset, unsigned size, int flags)
 	else
 		log4(OP_WRITE, offset, size, FL_NONE);
 
-	gendata(original_buf, good_buf, offset, size);
+	/* before the model moves on under any reads still in flight */
+	if (iodepth > 1 && !(flags & RWF_ATOMIC) &&
+	    testcalls > simulatedopcount)
+		slot = io_order(WRITE, offset, size);
+	model_write(offset, size);
 	if (offset + size > file_size) {
 		update_file_size(offset, size);
 		if (lite) {
@@ -1164,17 +1795,24 @@ dowrite(unsigned offset, unsigned size, int flags)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld write\t0x%x thru\t0x%x\t(0x%x bytes)\tdontcache=%d atomic_wr=%d\n", testcalls,
+		prt("%lld write\t0x%lx thru\t0x%lx\t(0x%lx bytes)\tdontcache=%d atomic_wr=%d\n", testcalls,
 		    offset, offset + size - 1, size, (flags & RWF_DONTCACHE) != 0,
 		    (flags & RWF_ATOMIC) != 0);
-	iret = fsxwrite(fd, good_buf + offset, size, offset, flags);
-	if (iret != size) {
-		if (iret == -1)
-			prterr("dowrite: write");
-		else
-			prt("short write: 0x%x bytes instead of 0x%x\n",
-			    iret, size);
-		report_failure(151);
+	if (slot) {
+		io_queue(slot, WRITE, offset, size, flags);
+		if (do_fsync || flush)
+			io_drain();
+	} else {
+		iret = fsxwrite(fd, model_data(offset, size), size, offset,
+				flags);
+		if (iret != size) {
+			if (iret == -1)
+				prterr("dowrite: write");
+			else
+				prt("short write: 0x%x bytes instead of 0x%lx\n",
+				    iret, size);
+			report_failure(151);
+		}
 	}
 	if (do_fsync) {
 		if (fsync(fd)) {
@@ -1189,10 +1827,10 @@ dowrite(unsigned offset, unsigned size, int flags)
 
 
 void
-domapwrite(unsigned offset, unsigned size)
+domapwrite(unsigned long offset, unsigned long size)
 {
-	unsigned pg_offset;
-	unsigned map_size;
+	unsigned long pg_offset;
+	unsigned long map_size;
 	off_t    cur_filesize;
 	char    *p;
 
@@ -1207,7 +1845,7 @@ domapwrite(unsigned offset, unsigned size)
 
 	log4(OP_MAPWRITE, offset, size, FL_NONE);
 
-	gendata(original_buf, good_buf, offset, size);
+	model_write(offset, size);
 	if (offset + size > file_size) {
 		update_file_size(offset, size);
 		if (lite) {
@@ -1225,7 +1863,7 @@ domapwrite(unsigned offset, unsigned size)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld mapwrite\t0x%x thru\t0x%x\t(0x%x bytes)\n", testcalls,
+		prt("%lld mapwrite\t0x%lx thru\t0x%lx\t(0x%lx bytes)\n", testcalls,
 		    offset, offset + size - 1, size);
 
 	if (file_size > cur_filesize) {
@@ -1243,7 +1881,7 @@ domapwrite(unsigned offset, unsigned size)
 	        prterr("domapwrite: mmap");
 		report_failure(202);
 	}
-	memcpy(p + pg_offset, good_buf + offset, size);
+	memcpy(p + pg_offset, model_data(offset, size), size);
 	if (msync(p, map_size, MS_SYNC) != 0) {
 		prterr("domapwrite: msync");
 		report_failure(203);
@@ -1259,22 +1897,26 @@ domapwrite(unsigned offset, unsigned size)
 
 
 void
-dotruncate(unsigned size)
+dotruncate(unsigned long size)
 {
-	int oldsize = file_size;
+	unsigned long oldsize = file_size;
 
 	size -= size % truncbdy;
 	if (size > biggest) {
 		biggest = size;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("truncating to largest ever: 0x%x\n", size);
+			prt("truncating to largest ever: 0x%lx\n", size);
 	}
 
 	log4(OP_TRUNCATE, 0, size, FL_NONE);
 
 	/* pollute the current EOF before a truncate down */
-	if (size < file_size)
+	if (size < file_size) {
 		pollute_eofpage(maxfilelen);
+		/* the sparse model doesn't keep data beyond EOF */
+		if (large_file)
+			model_zero(size, file_size - size);
+	}
 	update_file_size(size, 0);
 
 	if (testcalls <= simulatedopcount)
@@ -1283,10 +1925,10 @@ dotruncate(unsigned size)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      size <= monitorend)))
-		prt("%lld trunc\tfrom 0x%x to 0x%x\n", testcalls, oldsize,
+		prt("%lld trunc\tfrom 0x%lx to 0x%lx\n", testcalls, oldsize,
 				size);
 	if (ftruncate(fd, (off_t)size) == -1) {
-	        prt("ftruncate1: %x\n", size);
+	        prt("ftruncate1: %lx\n", size);
 		prterr("dotruncate: ftruncate");
 		report_failure(160);
 	}
@@ -1294,11 +1936,11 @@ dotruncate(unsigned size)
 
 #ifdef FALLOC_FL_PUNCH_HOLE
 void
-do_punch_hole(unsigned offset, unsigned length)
+do_punch_hole(unsigned long offset, unsigned long length)
 {
-	unsigned end_offset;
-	int max_offset = 0;
-	int max_len = 0;
+	unsigned long end_offset;
+	unsigned long max_offset = 0;
+	unsigned long max_len = 0;
 	int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
 
 	if (length == 0) {
@@ -1325,11 +1967,11 @@ do_punch_hole(unsigned offset, unsigned length)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld punch\tfrom 0x%x to 0x%x, (0x%x bytes)\n", testcalls,
+		prt("%lld punch\tfrom 0x%lx to 0x%lx, (0x%lx bytes)\n", testcalls,
 			offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("punch hole: 0x%x to 0x%x\n", offset, offset + length);
+		prt("punch hole: 0x%lx to 0x%lx\n", offset, offset + length);
 		prterr("do_punch_hole: fallocate");
 		report_failure(161);
 	}
@@ -1338,12 +1980,12 @@ do_punch_hole(unsigned offset, unsigned length)
 	max_offset = offset < file_size ? offset : file_size;
 	max_len = max_offset + length <= file_size ? length :
 			file_size - max_offset;
-	memset(good_buf + max_offset, '\0', max_len);
+	model_zero(max_offset, max_len);
 }
 
 #else
 void
-do_punch_hole(unsigned offset, unsigned length)
+do_punch_hole(unsigned long offset, unsigned long length)
 {
 	return;
 }
@@ -1351,9 +1993,9 @@ do_punch_hole(unsigned offset, unsigned length)
 
 #ifdef FALLOC_FL_ZERO_RANGE
 void
-do_zero_range(unsigned offset, unsigned length, int keep_size)
+do_zero_range(unsigned long offset, unsigned long length, int keep_size)
 {
-	unsigned end_offset;
+	unsigned long end_offset;
 	int mode = FALLOC_FL_ZERO_RANGE;
 
 	if (keep_size)
@@ -1372,7 +2014,7 @@ do_zero_range(unsigned offset, unsigned length, int keep_size)
 	if (end_offset > biggest) {
 		biggest = end_offset;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("zero_range to largest ever: 0x%x\n", end_offset);
+			prt("zero_range to largest ever: 0x%lx\n", end_offset);
 	}
 
 	/*
@@ -1393,21 +2035,21 @@ do_zero_range(unsigned offset, unsigned length, int keep_size)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld zero\tfrom 0x%x to 0x%x, (0x%x bytes)\n", testcalls,
+		prt("%lld zero\tfrom 0x%lx to 0x%lx, (0x%lx bytes)\n", testcalls,
 			offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("zero range: 0x%x to 0x%x\n", offset, offset + length);
+		prt("zero range: 0x%lx to 0x%lx\n", offset, offset + length);
 		prterr("do_zero_range: fallocate");
 		report_failure(161);
 	}
 
-	memset(good_buf + offset, '\0', length);
+	model_zero(offset, length);
 }
 
 #else
 void
-do_zero_range(unsigned offset, unsigned length, int keep_size)
+do_zero_range(unsigned long offset, unsigned long length, int keep_size)
 {
 	return;
 }
@@ -1415,9 +2057,9 @@ do_zero_range(unsigned offset, unsigned length, int keep_size)
 
 #ifdef FALLOC_FL_COLLAPSE_RANGE
 void
-do_collapse_range(unsigned offset, unsigned length)
+do_collapse_range(unsigned long offset, unsigned long length)
 {
-	unsigned end_offset;
+	unsigned long end_offset;
 	int mode = FALLOC_FL_COLLAPSE_RANGE;
 
 	if (length == 0) {
@@ -1446,23 +2088,22 @@ do_collapse_range(unsigned offset, unsigned length)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld collapse\tfrom 0x%x to 0x%x, (0x%x bytes)\n",
+		prt("%lld collapse\tfrom 0x%lx to 0x%lx, (0x%lx bytes)\n",
 				testcalls, offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("collapse range: 0x%x to 0x%x\n", offset, offset + length);
+		prt("collapse range: 0x%lx to 0x%lx\n", offset, offset + length);
 		prterr("do_collapse_range: fallocate");
 		report_failure(161);
 	}
 
-	memmove(good_buf + offset, good_buf + end_offset,
-		file_size - end_offset);
+	model_collapse(offset, length);
 	file_size -= length;
 }
 
 #else
 void
-do_collapse_range(unsigned offset, unsigned length)
+do_collapse_range(unsigned long offset, unsigned long length)
 {
 	return;
 }
@@ -1470,9 +2111,9 @@ do_collapse_range(unsigned offset, unsigned length)
 
 #ifdef FALLOC_FL_INSERT_RANGE
 void
-do_insert_range(unsigned offset, unsigned length)
+do_insert_range(unsigned long offset, unsigned long length)
 {
-	unsigned end_offset;
+	unsigned long end_offset;
 	int mode = FALLOC_FL_INSERT_RANGE;
 
 	if (length == 0) {
@@ -1501,24 +2142,22 @@ do_insert_range(unsigned offset, unsigned length)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld insert\tfrom 0x%x to 0x%x, (0x%x bytes)\n", testcalls,
+		prt("%lld insert\tfrom 0x%lx to 0x%lx, (0x%lx bytes)\n", testcalls,
 			offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("insert range: 0x%x to 0x%x\n", offset, offset + length);
+		prt("insert range: 0x%lx to 0x%lx\n", offset, offset + length);
 		prterr("do_insert_range: fallocate");
 		report_failure(161);
 	}
 
-	memmove(good_buf + end_offset, good_buf + offset,
-		file_size - offset);
-	memset(good_buf + offset, '\0', length);
+	model_insert(offset, length);
 	file_size += length;
 }
 
 #else
 void
-do_insert_range(unsigned offset, unsigned length)
+do_insert_range(unsigned long offset, unsigned long length)
 {
 	return;
 }
@@ -1548,10 +2187,10 @@ test_exchange_range(void)
 }
 
 void
-do_exchange_range(unsigned offset, unsigned length, unsigned dest)
+do_exchange_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	struct xfs_exchange_range	fsr = {
-		.file1_fd = fd,
+		.file1_fd = src_fd(),
 		.file1_offset = offset,
 		.file2_offset = dest,
 		.length = length,
@@ -1565,7 +2204,7 @@ do_exchange_range(unsigned offset, unsigned length, unsigned dest)
 		return;
 	}
 
-	if ((loff_t)offset >= file_size || (loff_t)dest >= file_size) {
+	if ((loff_t)offset >= src_size() || (loff_t)dest >= file_size) {
 		if (!quiet && testcalls > simulatedopcount)
 			prt("skipping exchange range behind EOF\n");
 		log5(OP_EXCHANGE_RANGE, offset, length, dest, FL_SKIPPED);
@@ -1588,21 +2227,19 @@ do_exchange_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu swap\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lu swap\tfrom 0x%lx to 0x%lx, (0x%lx bytes) at 0x%lx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
 	if (ioctl(fd, XFS_IOC_EXCHANGE_RANGE, &fsr) == -1) {
-		prt("exchange range: 0x%x to 0x%x at 0x%x\n", offset,
+		prt("exchange range: 0x%lx to 0x%lx at 0x%lx\n", offset,
 				offset + length, dest);
 		prterr("do_exchange_range: XFS_IOC_EXCHANGE_RANGE");
 		report_failure(161);
 		goto out_free;
 	}
 
-	memcpy(p, good_buf + offset, length);
-	memcpy(good_buf + offset, good_buf + dest, length);
-	memcpy(good_buf + dest, p, length);
+	model_exchange(offset, dest, length, p);
 out_free:
 	free(p);
 }
@@ -1615,7 +2252,7 @@ test_exchange_range(void)
 }
 
 void
-do_exchange_range(unsigned offset, unsigned length, unsigned dest)
+do_exchange_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	return;
 }
@@ -1642,10 +2279,10 @@ test_clone_range(void)
 }
 
 void
-do_clone_range(unsigned offset, unsigned length, unsigned dest)
+do_clone_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	struct file_clone_range	fcr = {
-		.src_fd = fd,
+		.src_fd = src_fd(),
 		.src_offset = offset,
 		.src_length = length,
 		.dest_offset = dest,
@@ -1658,7 +2295,7 @@ do_clone_range(unsigned offset, unsigned length, unsigned dest)
 		return;
 	}
 
-	if ((loff_t)offset >= file_size) {
+	if ((loff_t)offset >= src_size()) {
 		if (!quiet && testcalls > simulatedopcount)
 			prt("skipping clone range behind EOF\n");
 		log5(OP_CLONE_RANGE, offset, length, dest, FL_SKIPPED);
@@ -1668,7 +2305,7 @@ do_clone_range(unsigned offset, unsigned length, unsigned dest)
 	if (dest + length > biggest) {
 		biggest = dest + length;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("cloning to largest ever: 0x%x\n", dest + length);
+			prt("cloning to largest ever: 0x%lx\n", dest + length);
 	}
 
 	log5(OP_CLONE_RANGE, offset, length, dest, FL_NONE);
@@ -1682,18 +2319,18 @@ do_clone_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu clone\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lu clone\tfrom 0x%lx to 0x%lx, (0x%lx bytes) at 0x%lx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
 	if (ioctl(fd, FICLONERANGE, &fcr) == -1) {
-		prt("clone range: 0x%x to 0x%x at 0x%x\n", offset,
+		prt("clone range: 0x%lx to 0x%lx at 0x%lx\n", offset,
 				offset + length, dest);
 		prterr("do_clone_range: FICLONERANGE");
 		report_failure(161);
 	}
 
-	memcpy(good_buf + dest, good_buf + offset, length);
+	model_copy(dest, offset, length);
 }
 
 #else
@@ -1704,7 +2341,7 @@ test_clone_range(void)
 }
 
 void
-do_clone_range(unsigned offset, unsigned length, unsigned dest)
+do_clone_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	return;
 }
@@ -1767,7 +2404,7 @@ test_dedupe_range(void)
 }
 
 void
-do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
+do_dedupe_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	struct file_dedupe_range *fdr;
 
@@ -1778,7 +2415,7 @@ do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
 		return;
 	}
 
-	if ((loff_t)offset >= file_size) {
+	if ((loff_t)offset >= src_size()) {
 		if (!quiet && testcalls > simulatedopcount)
 			prt("skipping dedupe range behind EOF\n");
 		log5(OP_DEDUPE_RANGE, offset, length, dest, FL_SKIPPED);
@@ -1793,7 +2430,7 @@ do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu dedupe\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lu dedupe\tfrom 0x%lx to 0x%lx, (0x%lx bytes) at 0x%lx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
@@ -1812,14 +2449,14 @@ do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
 	fdr->info[0].dest_fd = fd;
 	fdr->info[0].dest_offset = dest;
 
-	if (ioctl(fd, FIDEDUPERANGE, fdr) == -1) {
-		prt("dedupe range: 0x%x to 0x%x at 0x%x\n", offset,
+	if (ioctl(src_fd(), FIDEDUPERANGE, fdr) == -1) {
+		prt("dedupe range: 0x%lx to 0x%lx at 0x%lx\n", offset,
 				offset + length, dest);
 		prterr("do_dedupe_range(0): FIDEDUPERANGE");
 		report_failure(161);
 	} else if (fdr->info[0].status < 0) {
 		errno = -fdr->info[0].status;
-		prt("dedupe range: 0x%x to 0x%x at 0x%x\n", offset,
+		prt("dedupe range: 0x%lx to 0x%lx at 0x%lx\n", offset,
 				offset + length, dest);
 		prterr("do_dedupe_range(1): FIDEDUPERANGE");
 		report_failure(161);
@@ -1836,7 +2473,7 @@ test_dedupe_range(void)
 }
 
 void
-do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
+do_dedupe_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	return;
 }
@@ -1893,7 +2530,7 @@ test_copy_range(void)
 }
 
 void
-do_copy_range(unsigned offset, unsigned length, unsigned dest)
+do_copy_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	loff_t o1, o2;
 	size_t olen;
@@ -1907,7 +2544,7 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 		return;
 	}
 
-	if ((loff_t)offset >= file_size) {
+	if ((loff_t)offset >= src_size()) {
 		if (!quiet && testcalls > simulatedopcount)
 			prt("skipping copy range behind EOF\n");
 		log5(OP_COPY_RANGE, offset, length, dest, FL_SKIPPED);
@@ -1917,7 +2554,7 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 	if (dest + length > biggest) {
 		biggest = dest + length;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("copying to largest ever: 0x%x\n", dest + length);
+			prt("copying to largest ever: 0x%lx\n", dest + length);
 	}
 
 	log5(OP_COPY_RANGE, offset, length, dest, FL_NONE);
@@ -1931,7 +2568,7 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu copy\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lu copy\tfrom 0x%lx to 0x%lx, (0x%lx bytes) at 0x%lx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
@@ -1940,12 +2577,13 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 	olen = length;
 
 	while (olen > 0) {
-		nr = syscall(__NR_copy_file_range, fd, &o1, fd, &o2, olen, 0);
+		nr = syscall(__NR_copy_file_range, src_fd(), &o1, fd, &o2,
+			     olen, 0);
 		if (nr < 0) {
 			if (errno != EAGAIN || tries++ >= 300)
 				break;
 		} else if (nr > olen) {
-			prt("copy range: 0x%x to 0x%x at 0x%x\n", offset,
+			prt("copy range: 0x%lx to 0x%lx at 0x%lx\n", offset,
 					offset + length, dest);
 			prt("do_copy_range: asked %u, copied %u??\n",
 					olen, nr);
@@ -1954,13 +2592,13 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 			olen -= nr;
 	}
 	if (nr < 0) {
-		prt("copy range: 0x%x to 0x%x at 0x%x\n", offset,
+		prt("copy range: 0x%lx to 0x%lx at 0x%lx\n", offset,
 				offset + length, dest);
 		prterr("do_copy_range:");
 		report_failure(161);
 	}
 
-	memcpy(good_buf + dest, good_buf + offset, length);
+	model_copy(dest, offset, length);
 }
 
 #else
@@ -1971,7 +2609,7 @@ test_copy_range(void)
 }
 
 void
-do_copy_range(unsigned offset, unsigned length, unsigned dest)
+do_copy_range(unsigned long offset, unsigned long length, unsigned long dest)
 {
 	return;
 }
@@ -1980,9 +2618,10 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 #ifdef HAVE_LINUX_FALLOC_H
 /* fallocate is basically a no-op unless extending, then a lot like a truncate */
 void
-do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
+do_preallocate(unsigned long offset, unsigned long length, int keep_size,
+	       int unshare)
 {
-	unsigned end_offset;
+	unsigned long end_offset;
 	enum opflags opflags = FL_NONE;
 	int mode = 0;
 
@@ -2009,7 +2648,7 @@ do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
 	if (end_offset > biggest) {
 		biggest = end_offset;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("fallocating to largest ever: 0x%x\n", end_offset);
+			prt("fallocating to largest ever: 0x%lx\n", end_offset);
 	}
 
 	/*
@@ -2021,7 +2660,7 @@ do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
 	log4(OP_FALLOCATE, offset, length, opflags);
 
 	if (end_offset > file_size) {
-		memset(good_buf + file_size, '\0', end_offset - file_size);
+		model_zero(file_size, end_offset - file_size);
 		update_file_size(offset, length);
 	}
 
@@ -2031,17 +2670,18 @@ do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend)))
-		prt("%lld falloc\tfrom 0x%x to 0x%x (0x%x bytes)\n", testcalls,
+		prt("%lld falloc\tfrom 0x%lx to 0x%lx (0x%lx bytes)\n", testcalls,
 				offset, offset + length, length);
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-	        prt("fallocate: 0x%x to 0x%x\n", offset, offset + length);
+	        prt("fallocate: 0x%lx to 0x%lx\n", offset, offset + length);
 		prterr("do_preallocate: fallocate");
 		report_failure(161);
 	}
 }
 #else
 void
-do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
+do_preallocate(unsigned long offset, unsigned long length, int keep_size,
+	       int unshare)
 {
 	return;
 }
@@ -2072,6 +2712,11 @@ writefileimage()
 {
 	ssize_t iret;
 
+	if (large_file) {
+		if (model_save(fd))
+			report_failure(172);
+		return;
+	}
 	if (lseek(fd, (off_t)0, SEEK_SET) == (off_t)-1) {
 		prterr("writefileimage: lseek");
 		report_failure(171);
@@ -2101,6 +2746,7 @@ docloseopen(void)
 
 	if (debug)
 		prt("%lld close/open\n", testcalls);
+	io_drain();
 	if (close(fd)) {
 		prterr("docloseopen: close");
 		report_failure(180);
@@ -2114,6 +2760,7 @@ docloseopen(void)
 		prterr("docloseopen: open");
 		report_failure(182);
 	}
+	cur_file->checks_left = 0;	/* it all came back from disk */
 }
 
 void
@@ -2156,21 +2803,128 @@ do {						\
 	TRIM_LEN(off, len, size);		\
 } while (0)
 
+unsigned long long
+lat_percentile(struct opstat *os, int permille)
+{
+	return lat_hist_percentile(os->hist, os->count, os->max_ns, permille);
+}
+
+/* Account for an op of bytes started at start that has just finished. */
 void
-cleanup(int sig)
+opstat_add(int op, unsigned long long bytes, struct timespec *start)
 {
-	if (sig)
-		prt("signal %d\n", sig);
-	prt("testcalls = %lld\n", testcalls);
-	exit(sig);
+	struct opstat		*os;
+	struct timespec		now;
+	unsigned long long	ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+	os = &my_opstats[op];
+	os->count++;
+	os->bytes += bytes;
+	os->ns += ns;
+	if (ns > os->max_ns)
+		os->max_ns = ns;
+	os->hist[lat_bucket(ns)]++;
 }
 
-static int
-op_args_count(int operation)
+/*
+ * Account for the op test() started at op_start, if it logged one that
+ * it didn't skip.  Its bytes are the length of the range it read, wrote
+ * or changed; truncate and fsync don't count any.  One left in flight is
+ * counted by io_wait_one when it completes.
+ */
+void
+opstat_count(int logged)
 {
-	switch (operation) {
-	case OP_EXCHANGE_RANGE:
-	case OP_CLONE_RANGE:
+	struct log_entry	*lp = &oplog[(logptr + LOGSIZE - 1) % LOGSIZE];
+
+	if (logcount == logged || (lp->flags & FL_SKIPPED) || io_queued)
+		return;
+	opstat_add(lp->operation,
+		   lp->operation != OP_TRUNCATE && lp->operation != OP_FSYNC ?
+		   lp->args[1] : 0, &op_start);
+}
+
+/* Write a line of JSON with what each op and each thread has done. */
+void
+report_print(void)
+{
+	struct timespec		now;
+	struct opstat		sum;
+	struct opstat		*os;
+	unsigned long long	total;
+	double			elapsed;
+	const char		*sep;
+	int			b, i, op;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - report_start.tv_sec) +
+		(now.tv_nsec - report_start.tv_nsec) / 1e9;
+	fprintf(report_fp, "{\"elapsed\": %.3f, \"threads\": [", elapsed);
+	for (i = 0; i < nthreads; i++) {
+		total = 0;
+		for (op = 0; op < OP_MAX_INTEGRITY; op++)
+			total += opstats[i * OP_MAX_INTEGRITY + op].count;
+		fprintf(report_fp, "%s{\"id\": %d, \"ops\": %llu, \"ops_per_sec\": %.1f}",
+			i ? ", " : "", i, total, total / elapsed);
+	}
+	fprintf(report_fp, "], \"ops\": {");
+	sep = "";
+	for (op = 0; op < OP_MAX_INTEGRITY; op++) {
+		memset(&sum, 0, sizeof(sum));
+		for (i = 0; i < nthreads; i++) {
+			os = &opstats[i * OP_MAX_INTEGRITY + op];
+			sum.count += os->count;
+			sum.bytes += os->bytes;
+			sum.ns += os->ns;
+			sum.max_ns = MAX(sum.max_ns, os->max_ns);
+			for (b = 0; b < LAT_BUCKETS; b++)
+				sum.hist[b] += os->hist[b];
+		}
+		if (!sum.count)
+			continue;
+		fprintf(report_fp, "%s\"%s\": {\"count\": %llu, \"ops_per_sec\": %.1f, "
+			"\"bytes\": %llu, \"mb_per_sec\": %.2f, "
+			"\"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+			"\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, "
+			"\"hist\": [",
+			sep, op_name(op), sum.count, sum.count / elapsed,
+			sum.bytes, sum.bytes / elapsed / (1024 * 1024),
+			sum.ns / sum.count, lat_percentile(&sum, 500),
+			lat_percentile(&sum, 900), lat_percentile(&sum, 990),
+			lat_percentile(&sum, 999), sum.max_ns);
+		sep = "";
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			if (!sum.hist[b])
+				continue;
+			fprintf(report_fp, "%s[%llu, %llu]", sep,
+				lat_bucket_ns(b), sum.hist[b]);
+			sep = ", ";
+		}
+		fprintf(report_fp, "]}");
+		sep = ", ";
+	}
+	fprintf(report_fp, "}}\n");
+	fflush(report_fp);
+}
+
+void
+cleanup(int sig)
+{
+	if (sig)
+		prt("signal %d\n", sig);
+	prt("testcalls = %lld\n", testcalls);
+	exit(sig);
+}
+
+static int
+op_args_count(int operation)
+{
+	switch (operation) {
+	case OP_EXCHANGE_RANGE:
+	case OP_CLONE_RANGE:
 	case OP_DEDUPE_RANGE:
 	case OP_COPY_RANGE:
 		return 4;
@@ -2231,6 +2985,12 @@ read_op(struct log_entry *log_entry)
 				log_entry->flags |= FL_UNSHARE;
 			else if (strcmp(str, "*") == 0)
 				;  /* overlap marker; ignore */
+			else if (sscanf(str, "file=%d", &log_entry->file) == 1 &&
+				 log_entry->file >= 0 && log_entry->file < nfiles)
+				;
+			else if (sscanf(str, "from=%d", &log_entry->from) == 1 &&
+				 log_entry->from >= 0 && log_entry->from < nfiles)
+				;
 			else
 				goto fail;
 		}
@@ -2254,6 +3014,20 @@ range_overlaps(
 	return llabs((unsigned long long)off1 - off0) < size;
 }
 
+/*
+ * random() only reaches 2GB, so files allowed to be bigger than that get
+ * a second call for the high bits.
+ */
+static unsigned long
+random_offset(void)
+{
+	unsigned long off = random();
+
+	if (maxfilelen > RAND_MAX)
+		off = off << 31 | random();
+	return off;
+}
+
 static void generate_dest_range(bool bdy_align,
 				unsigned long max_range_end,
 				unsigned long *src_offset,
@@ -2262,7 +3036,7 @@ static void generate_dest_range(bool bdy_align,
 {
 	int tries = 0;
 
-	TRIM_OFF_LEN(*src_offset, *size, file_size);
+	TRIM_OFF_LEN(*src_offset, *size, src_size());
 	if (bdy_align) {
 		*src_offset = rounddown_64(*src_offset, readbdy);
 		if (o_direct)
@@ -2277,16 +3051,25 @@ static void generate_dest_range(bool bdy_align,
 			*size = 0;
 			break;
 		}
-		*dst_offset = random();
+		*dst_offset = random_offset();
 		TRIM_OFF(*dst_offset, max_range_end);
 		if (bdy_align)
 			*dst_offset = rounddown_64(*dst_offset, writebdy);
 		else
 			*dst_offset = rounddown_64(*dst_offset, block_size);
-	} while (range_overlaps(*src_offset, *dst_offset, *size) ||
+	} while ((src_file == cur_file &&
+		  range_overlaps(*src_offset, *dst_offset, *size)) ||
 		 *dst_offset + *size > max_range_end);
 }
 
+/* With several files of its own a thread may copy between them. */
+static void
+pick_src_file(void)
+{
+	if (my_nfiles > 1)
+		src_file = my_files[random() % my_nfiles];
+}
+
 int
 test(void)
 {
@@ -2296,6 +3079,7 @@ test(void)
 	unsigned long	op;
 	int		keep_size = 0;
 	int		unshare = 0;
+	int		logged = logcount;
 
 	if (simulatedopcount > 0 && testcalls == simulatedopcount)
 		writefileimage();
@@ -2312,6 +3096,8 @@ test(void)
 		struct log_entry log_entry;
 
 		while (read_op(&log_entry)) {
+			file_switch(&files[log_entry.file]);
+			src_file = &files[log_entry.from];
 			if (log_entry.flags & FL_SKIPPED) {
 				log4(log_entry.operation,
 				     log_entry.args[0], log_entry.args[1],
@@ -2331,11 +3117,15 @@ test(void)
 		return 0;
 	}
 
+	if (my_nfiles > 1)
+		file_switch(my_files[random() % my_nfiles]);
+	src_file = cur_file;
+
 	rv = random();
 	if (closeprob)
 		closeopen = (rv >> 3) < (1 << 28) / closeprob;
 
-	offset = random();
+	offset = random_offset();
 	offset2 = 0;
 	size = maxoplen;
 	if (randomoplen)
@@ -2352,7 +3142,7 @@ test(void)
 	switch(op) {
 	case OP_TRUNCATE:
 		if (!style)
-			size = random() % maxfilelen;
+			size = random_offset() % maxfilelen;
 		break;
 	case OP_FALLOCATE:
 		if (fallocate_calls && size) {
@@ -2367,15 +3157,19 @@ test(void)
 			keep_size = random() % 2;
 		break;
 	case OP_CLONE_RANGE:
+		pick_src_file();
 		generate_dest_range(false, maxfilelen, &offset, &size, &offset2);
 		break;
 	case OP_DEDUPE_RANGE:
+		pick_src_file();
 		generate_dest_range(false, file_size, &offset, &size, &offset2);
 		break;
 	case OP_COPY_RANGE:
+		pick_src_file();
 		generate_dest_range(true, maxfilelen, &offset, &size, &offset2);
 		break;
 	case OP_EXCHANGE_RANGE:
+		pick_src_file();
 		generate_dest_range(false, file_size, &offset, &size, &offset2);
 		break;
 	}
@@ -2453,6 +3247,14 @@ have_op:
 		break;
 	}
 
+	/* only plain reads and writes go alongside the IOs in flight */
+	if (io_inflight && op != OP_READ && op != OP_READ_DONTCACHE &&
+	    op != OP_WRITE && op != OP_WRITE_DONTCACHE)
+		io_drain();
+
+	if (report_fp)
+		clock_gettime(CLOCK_MONOTONIC, &op_start);
+	io_queued = 0;
 	switch (op) {
 	case OP_READ:
 		TRIM_OFF_LEN(offset, size, file_size);
@@ -2594,19 +3396,261 @@ have_op:
 		report_failure(42);
 		break;
 	}
+	if (report_fp && testcalls > simulatedopcount)
+		opstat_count(logged);
 
-	if (check_file && testcalls > simulatedopcount)
+	/* the checks read what the IOs in flight are still writing */
+	if (check_file && testcalls > simulatedopcount) {
+		io_drain();
 		check_contents();
+	}
 
 out:
 	if (closeopen)
 		docloseopen();
-	if (sizechecks && testcalls > simulatedopcount)
+	if (sizechecks && testcalls > simulatedopcount) {
+		io_drain();
 		check_size();
+	}
 	return 1;
 }
 
 
+/*
+ * --minimize: shrink a failing --replay-ops sequence by delta debugging.
+ * Each candidate sequence is replayed by a fresh fsx, run with the same
+ * options on a scratch file of its own, min_jobs of them at a time.  A
+ * candidate counts as failing if it exits with the status the whole
+ * sequence did.
+ */
+int	min_jobs;			/* --minimize */
+char	**min_argv;			/* the options to run them with */
+int	min_argc;
+
+struct min_cand {
+	int	lo, hi;			/* a chunk of the current ops, */
+	bool	complement;		/* or everything but that chunk */
+};
+
+/* Start replaying cand of ops[cur[]] on scratch file number slot. */
+static pid_t
+min_spawn(int slot, struct log_entry *ops, int *cur, int ncur,
+	  struct min_cand *cand, char *fname_arg)
+{
+	char	scratch[PATH_MAX], opsname[PATH_MAX + 8], replay[PATH_MAX + 24];
+	char	**av;
+	FILE	*f;
+	pid_t	pid;
+	int	i, j;
+
+	snprintf(scratch, sizeof(scratch), "%s.min%d", fname_arg, slot);
+	snprintf(opsname, sizeof(opsname), "%s.ops", scratch);
+	snprintf(replay, sizeof(replay), "--replay-ops=%s", opsname);
+	f = fopen(opsname, "w");
+	if (!f) {
+		prterr(opsname);
+		exit(93);
+	}
+	for (i = 0; i < ncur; i++)
+		if ((i >= cand->lo && i < cand->hi) != cand->complement)
+			write_op(f, &ops[cur[i]], false);
+	if (fclose(f)) {
+		prterr(opsname);
+		exit(93);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		prterr("min_spawn: fork");
+		exit(101);
+	}
+	if (pid)
+		return pid;
+
+	av = calloc(min_argc + 2, sizeof(*av));
+	if (!av)
+		_exit(101);
+	av[0] = min_argv[0];
+	av[1] = replay;
+	for (i = 1, j = 2; i < min_argc; i++) {
+		if (min_argv[i] == fname_arg)
+			av[j++] = scratch;
+		else if (strncmp(min_argv[i], "--replay-ops", 12) == 0) {
+			if (!strchr(min_argv[i], '='))
+				i++;
+		} else if (strncmp(min_argv[i], "--minimize", 10) != 0 &&
+			   /* the jobs at once would all write the same files */
+			   strncmp(min_argv[i], "--record-ops", 12) != 0 &&
+			   strncmp(min_argv[i], "--report", 8) != 0)
+			av[j++] = min_argv[i];
+	}
+	if (!freopen("/dev/null", "w", stdout) ||
+	    !freopen("/dev/null", "w", stderr))
+		_exit(101);
+	execv("/proc/self/exe", av);
+	_exit(127);
+}
+
+/*
+ * Replay the candidates in order and return the first to fail with
+ * status, or -1 if none do.
+ */
+static int
+min_try(struct log_entry *ops, int *cur, int ncur, struct min_cand *cands,
+	int ncands, int status, char *fname_arg)
+{
+	pid_t	pids[min_jobs];
+	int	st[min_jobs];
+	int	base, k, n;
+
+	for (base = 0; base < ncands; base += min_jobs) {
+		n = MIN(min_jobs, ncands - base);
+		for (k = 0; k < n; k++)
+			pids[k] = min_spawn(k, ops, cur, ncur,
+					    &cands[base + k], fname_arg);
+		for (k = 0; k < n; k++)
+			if (waitpid(pids[k], &st[k], 0) < 0)
+				st[k] = -1;
+		for (k = 0; k < n; k++)
+			if (st[k] != -1 && WIFEXITED(st[k]) &&
+			    WEXITSTATUS(st[k]) == status)
+				return base + k;
+	}
+	return -1;
+}
+
+/* Remove what the replays left behind on the scratch files. */
+static void
+min_cleanup(char *fname_arg)
+{
+	static const char *const sfx[] = {
+		".fsxgood", ".fsxlog", ".fsxops",
+	};
+	char	scratch[PATH_MAX], logs[PATH_MAX + 1024];
+	char	path[PATH_MAX + 1024 + 24];
+	int	k, i, n;
+
+	for (k = 0; k < min_jobs; k++) {
+		/* the scratch file and its logs, wherever -P put them */
+		snprintf(scratch, sizeof(scratch), "%s.min%d", fname_arg, k);
+		snprintf(logs, sizeof(logs), "%s%s", dname,
+			 dirpath ? basename(scratch) : scratch);
+		unlink(scratch);
+		snprintf(path, sizeof(path), "%s.ops", scratch);
+		unlink(path);
+		for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); i++) {
+			snprintf(path, sizeof(path), "%s%s", logs, sfx[i]);
+			unlink(path);
+		}
+		/* and with --files, fname.minK.N and the logs named after them */
+		for (n = 0; nfiles > 1 && n < nfiles; n++) {
+			snprintf(path, sizeof(path), "%s.%d", scratch, n);
+			unlink(path);
+			for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); i++) {
+				snprintf(path, sizeof(path), "%s.%d%s", logs,
+					 n, sfx[i]);
+				unlink(path);
+			}
+		}
+	}
+}
+
+int
+minimize(char *fname_arg)
+{
+	struct log_entry	*ops = NULL, le;
+	struct min_cand		*cands, whole;
+	char			outname[PATH_MAX];
+	int			nops = 0, maxops = 0;
+	int			*cur, ncur, n, i, found, status, st;
+	FILE			*f;
+
+	while (read_op(&le)) {
+		if (le.flags & FL_SKIPPED)
+			continue;
+		if (nops == maxops) {
+			maxops = maxops ? maxops * 2 : 1024;
+			ops = realloc(ops, maxops * sizeof(*ops));
+			if (!ops) {
+				prterr("minimize: realloc");
+				exit(101);
+			}
+		}
+		ops[nops++] = le;
+	}
+	cur = malloc((nops + 1) * sizeof(*cur));
+	cands = malloc((2 * nops + 2) * sizeof(*cands));
+	if (!cur || !cands) {
+		prterr("minimize: malloc");
+		exit(101);
+	}
+	for (ncur = 0; ncur < nops; ncur++)
+		cur[ncur] = ncur;
+
+	/* what does the whole sequence fail with? */
+	whole.lo = 0;
+	whole.hi = ncur;
+	whole.complement = false;
+	if (waitpid(min_spawn(0, ops, cur, ncur, &whole, fname_arg),
+		    &st, 0) < 0 || !WIFEXITED(st) || !WEXITSTATUS(st)) {
+		prt("minimize: %s doesn't fail when replayed\n", replayops);
+		min_cleanup(fname_arg);
+		status = 1;
+		goto out;
+	}
+	status = WEXITSTATUS(st);
+	prt("minimize: %d ops fail with status %d\n", ncur, status);
+
+	n = 2;
+	while (ncur >= 2) {
+		/* the n chunks first, then what's left without each */
+		for (i = 0; i < n; i++) {
+			cands[i].lo = cands[n + i].lo = (long long)i * ncur / n;
+			cands[i].hi = cands[n + i].hi =
+				(long long)(i + 1) * ncur / n;
+			cands[i].complement = false;
+			cands[n + i].complement = true;
+		}
+		found = min_try(ops, cur, ncur, cands, n == 2 ? 2 : 2 * n,
+				status, fname_arg);
+		if (found >= 0) {
+			struct min_cand *c = &cands[found];
+			int j = 0;
+
+			for (i = 0; i < ncur; i++)
+				if ((i >= c->lo && i < c->hi) != c->complement)
+					cur[j++] = cur[i];
+			ncur = j;
+			n = c->complement ? MAX(n - 1, 2) : 2;
+			if (!quiet)
+				prt("minimize: down to %d ops\n", ncur);
+		} else if (n < ncur) {
+			n = MIN(2 * n, ncur);
+		} else
+			break;
+	}
+	min_cleanup(fname_arg);
+
+	snprintf(outname, sizeof(outname), "%s.min", replayops);
+	f = fopen(outname, "w");
+	if (!f) {
+		prterr(outname);
+		status = 1;
+		goto out;
+	}
+	for (i = 0; i < ncur; i++)
+		write_op(f, &ops[cur[i]], false);
+	fclose(f);
+	prt("minimize: %d of the %d ops still fail with status %d, "
+	    "saved to \"%s\"\n", ncur, nops, status, outname);
+	status = 0;
+out:
+	free(cands);
+	free(cur);
+	free(ops);
+	return status;
+}
+
 void
 usage(void)
 {
@@ -2617,6 +3661,8 @@ usage(void)
 	   [-r readbdy] [-s style] [-t truncbdy] [-w writebdy]\n\
 	   [-A|-U] [-D startingop] [-N numops] [-P dirpath] [-S seed]\n\
 	   [--replay-ops=opsfile] [--record-ops[=opsfile]] [--duration=seconds]\n\
+	   [--large] [--files=n] [--threads=m] [--full-check=n] [--iodepth=n]\n\
+	   [--report[=file]] [--minimize[=jobs]]\n\
 	   ... fname\n\
 	-a: disable atomic writes\n\
 	-b opnum: beginning operation number (default 1)\n\
@@ -2690,11 +3736,26 @@ usage(void)
 	-R: read() system calls only (mapped reads disabled)\n\
 	-S seed: for random # generator (default 1) 0 gets timestamp\n\
 	-W: mapped write operations DISabled\n\
-	-X: Read file and compare to good buffer after every operation\n\
+	-X: Read back what each operation changed and compare to good buffer\n\
 	-Z: O_DIRECT (use -R, -W, -r and -w too, excludes dontcache IO)\n\
 	--replay-ops=opsfile: replay ops from recorded .fsxops file\n\
 	--record-ops[=opsfile]: dump ops file also on success. optionally specify ops file name\n\
 	--duration=seconds: ignore any -N setting and run for this many seconds\n\
+	--large: model the file as the extents written rather than a copy of it,\n\
+	    so -l can be far bigger than memory (excludes -k)\n\
+	--files=n: test fname.0 to fname.n-1, with range ops between them\n\
+	    (excludes -b, -h, -i, -k, -L and -x)\n\
+	--threads=m: share the --files out between m threads, each with its\n\
+	    own .fsxops (excludes -A, -U and --replay-ops)\n\
+	--full-check=n: have -X read back the whole file every n operations\n\
+	    and after each close/open (default 100)\n\
+	--iodepth=n: with -A or -U, keep up to n reads and writes in flight and\n\
+	    check them as they complete (max 1024, excludes --files)\n\
+	--report[=file]: at exit, write each op's count, bytes, latency\n\
+	    percentiles and histogram as a line of JSON to file (default stdout)\n\
+	--minimize[=jobs]: shrink the failing --replay-ops sequence to a small\n\
+	    one that still fails, replaying jobs candidates at a time on\n\
+	    fname.minN scratch files, and save it to opsfile.min\n\
 	fname: this filename is REQUIRED (no default)\n");
 	exit(90);
 }
@@ -2724,6 +3785,16 @@ getnum(char *s, char **e)
 			ret *= 1024*1024;
 			*e = *e + 1;
 			break;
+		case 'g':
+		case 'G':
+			ret *= 1024*1024*1024;
+			*e = *e + 1;
+			break;
+		case 't':
+		case 'T':
+			ret *= 1024LL*1024*1024*1024;
+			*e = *e + 1;
+			break;
 		case 'w':
 		case 'W':
 			ret *= 4;
@@ -2733,6 +3804,32 @@ getnum(char *s, char **e)
 	return (ret);
 }
 
+/*
+ * --iodepth: with -A or -U, reads and writes are submitted and left in
+ * flight, up to iodepth of them, and checked as they complete.  An IO is
+ * never in flight alongside an overlapping write, so the model holds what
+ * each should see.  Every other kind of op waits for them all first, as
+ * do -X and the size checks, and --report counts their latency when they
+ * complete.
+ */
+struct io_slot {
+	int		rw;		/* READ or WRITE, -1 when free */
+	int		flags;
+	unsigned long	offset;
+	unsigned long	len;
+	unsigned long	done;		/* io_uring IOs can come back short */
+	unsigned long	lo, hi;		/* later IOs mustn't overlap this */
+	long long	opno;
+	struct timespec	start;		/* for --report, when its op began */
+	char		*buf;
+	struct iovec	iov;
+#ifdef AIO
+	struct iocb	iocb;
+#endif
+};
+
+struct io_slot	*io_slots;
+
 #ifdef AIO
 
 #define QSZ     1024
@@ -2753,7 +3850,7 @@ aio_setup()
 }
 
 int
-aio_rw(int rw, int fd, char *buf, unsigned len, unsigned offset)
+aio_rw(int rw, int fd, char *buf, unsigned len, unsigned long offset)
 {
 	struct io_event event;
 	static struct timespec ts;
@@ -2818,9 +3915,65 @@ out_error:
 	errno = -ret;
 	return -1;
 }
+
+int
+aio_queue_io(struct io_slot *s)
+{
+	struct iocb *iocbs[] = { &s->iocb };
+	int ret;
+
+	if (s->rw == READ)
+		io_prep_pread(&s->iocb, fd, s->buf, s->len, s->offset);
+	else
+		io_prep_pwrite(&s->iocb, fd, s->buf, s->len, s->offset);
+	s->iocb.data = s;
+
+	ret = io_submit(io_ctx, 1, iocbs);
+	if (ret != 1) {
+		fprintf(stderr, "aio_queue_io: io_submit failed: %s\n",
+				strerror(-ret));
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+struct io_slot *
+aio_reap_io(long *res)
+{
+	struct io_event event;
+	struct timespec ts = { 30, 0 };
+	int ret;
+
+	ret = io_getevents(io_ctx, 1, 1, &event, &ts);
+	if (ret != 1) {
+		if (ret == 0)
+			fprintf(stderr, "aio_reap_io: no events available\n");
+		else
+			fprintf(stderr, "aio_reap_io: io_getevents failed: %s\n",
+					strerror(-ret));
+		return NULL;
+	}
+	*res = (long)event.res;		/* signed, see aio_rw() */
+	return event.data;
+}
 #else
 int
-aio_rw(int rw, int fd, char *buf, unsigned len, unsigned offset)
+aio_rw(int rw, int fd, char *buf, unsigned len, unsigned long offset)
+{
+	fprintf(stderr, "io_rw: need AIO support!\n");
+	exit(111);
+}
+
+int
+aio_queue_io(struct io_slot *s)
+{
+	fprintf(stderr, "io_rw: need AIO support!\n");
+	exit(111);
+}
+
+struct io_slot *
+aio_reap_io(long *res)
 {
 	fprintf(stderr, "io_rw: need AIO support!\n");
 	exit(111);
@@ -2847,7 +4000,7 @@ uring_setup()
 }
 
 int
-uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
+uring_rw(int rw, int fd, char *buf, unsigned len, unsigned long offset, int flags)
 {
 	struct io_uring_sqe     *sqe;
 	struct io_uring_cqe     *cqe;
@@ -2856,7 +4009,7 @@ uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
 	int res = 0;
 	char *p = buf;
 	unsigned l = len;
-	unsigned o = offset;
+	unsigned long o = offset;
 
 	/*
 	 * Due to io_uring tries non-blocking IOs (especially read), that
@@ -2925,20 +4078,217 @@ uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
 	errno = -ret;
 	return -1;
 }
+
+int
+uring_queue_io(struct io_slot *s)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		fprintf(stderr, "uring_queue_io: io_uring_get_sqe failed\n");
+		errno = EBUSY;
+		return -1;
+	}
+	s->iov.iov_base = s->buf + s->done;
+	s->iov.iov_len = s->len - s->done;
+	if (s->rw == READ)
+		io_uring_prep_readv(sqe, fd, &s->iov, 1, s->offset + s->done);
+	else
+		io_uring_prep_writev(sqe, fd, &s->iov, 1, s->offset + s->done);
+	sqe->rw_flags = s->flags;
+	io_uring_sqe_set_data(sqe, s);
+
+	ret = io_uring_submit(&ring);
+	if (ret != 1) {
+		fprintf(stderr, "uring_queue_io: io_uring_submit failed: %s\n",
+				strerror(-ret));
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+struct io_slot *
+uring_reap_io(long *res)
+{
+	struct io_uring_cqe *cqe;
+	struct io_slot *s;
+	int ret;
+
+	ret = io_uring_wait_cqe(&ring, &cqe);
+	if (ret != 0) {
+		fprintf(stderr, "uring_reap_io: io_uring_wait_cqe failed: %s\n",
+				strerror(-ret));
+		return NULL;
+	}
+	s = io_uring_cqe_get_data(cqe);
+	*res = cqe->res;
+	io_uring_cqe_seen(&ring, cqe);
+	return s;
+}
 #else
 int
-uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
+uring_rw(int rw, int fd, char *buf, unsigned len, unsigned long offset, int flags)
+{
+	fprintf(stderr, "io_rw: need IO_URING support!\n");
+	exit(111);
+}
+
+int
+uring_queue_io(struct io_slot *s)
+{
+	fprintf(stderr, "io_rw: need IO_URING support!\n");
+	exit(111);
+}
+
+struct io_slot *
+uring_reap_io(long *res)
 {
 	fprintf(stderr, "io_rw: need IO_URING support!\n");
 	exit(111);
 }
 #endif
 
+void
+iodepth_setup(void)
+{
+	int align = MAX(readbdy, writebdy);
+	char *buf;
+	int i;
+
+	io_slots = calloc(iodepth, sizeof(*io_slots));
+	if (!io_slots) {
+		prterr("iodepth_setup: calloc");
+		exit(101);
+	}
+	for (i = 0; i < iodepth; i++) {
+		buf = malloc(maxoplen + align);
+		if (!buf) {
+			prterr("iodepth_setup: malloc");
+			exit(101);
+		}
+		io_slots[i].buf = round_ptr_up(buf, align, 0);
+		io_slots[i].rw = -1;
+	}
+}
+
+/* Wait for any IO in flight to complete, and check what it did. */
+void
+io_wait_one(void)
+{
+	struct io_slot *s;
+	long res = 0;
+
+	s = aio ? aio_reap_io(&res) : uring_reap_io(&res);
+	if (!s)
+		report_failure(142);
+	if (uring && res > 0 && s->done + res < s->len) {
+		s->done += res;		/* short, go again for the rest */
+		if (uring_queue_io(s)) {
+			prterr("io_wait_one: resubmit");
+			report_failure(142);
+		}
+		return;
+	}
+	if (res < 0 || s->done + res != s->len) {
+		prt("%s from op %lld: 0x%lx thru 0x%lx\n",
+		    s->rw == READ ? "read" : "write", s->opno,
+		    s->offset, s->offset + s->len - 1);
+		if (res < 0) {
+			errno = -res;
+			prterr("io_wait_one");
+		} else
+			prt("short %s: 0x%lx bytes instead of 0x%lx\n",
+			    s->rw == READ ? "read" : "write",
+			    s->done + res, s->len);
+		report_failure(s->rw == READ ? 141 : 151);
+	}
+	if (debug)
+		prt("%lld %s done\t0x%lx thru\t0x%lx\n", s->opno,
+		    s->rw == READ ? "read" : "write",
+		    s->offset, s->offset + s->len - 1);
+	if (s->rw == READ)
+		check_buffers(s->buf, s->offset, s->len);
+	if (report_fp)
+		opstat_add(s->rw == READ ? OP_READ : OP_WRITE, s->len,
+			   &s->start);
+	s->rw = -1;
+	io_inflight--;
+}
+
+void
+io_drain(void)
+{
+	while (io_inflight)
+		io_wait_one();
+}
+
+/*
+ * Wait until an IO to offset..offset+len can go: there is a free slot for
+ * it and nothing in flight that it must be ordered against.
+ */
+struct io_slot *
+io_order(int rw, unsigned long offset, unsigned long len)
+{
+	unsigned long lo = offset;
+	struct io_slot *s;
+	int i;
+
+	/* a write past EOF moves it, which everything else then sees */
+	if (rw == WRITE && offset + len > file_size) {
+		io_drain();
+		lo = MIN(offset, file_size);
+	}
+again:
+	for (i = 0; i < iodepth; i++) {
+		s = &io_slots[i];
+		if (s->rw != -1 && (rw == WRITE || s->rw == WRITE) &&
+		    lo < s->hi && offset + len > s->lo) {
+			io_wait_one();
+			goto again;
+		}
+	}
+	while (io_inflight == iodepth)
+		io_wait_one();
+	for (s = io_slots; s->rw != -1; s++)
+		;
+	s->lo = lo;
+	s->hi = offset + len;
+	return s;
+}
+
+/* Submit an IO to the slot io_order() gave out. */
+void
+io_queue(struct io_slot *s, int rw, unsigned long offset, unsigned long len,
+	 int flags)
+{
+	s->rw = rw;
+	s->flags = flags;
+	s->offset = offset;
+	s->len = len;
+	s->done = 0;
+	s->opno = testcalls;
+	s->start = op_start;
+	if (rw == WRITE)
+		memcpy(s->buf, model_data(offset, len), len);
+	if (aio ? aio_queue_io(s) : uring_queue_io(s)) {
+		prterr("io_queue");
+		report_failure(rw == READ ? 141 : 151);
+	}
+	io_inflight++;
+	io_queued = 1;
+}
+
 int
-fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
+fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned long offset, int flags)
 {
 	int ret;
 
+	if (io_inflight)
+		io_drain();
+
 	if (aio) {
 		ret = aio_rw(rw, fd, buf, len, offset);
 	} else if (uring) {
@@ -3096,18 +4446,21 @@ init_hugepages_buf(unsigned len, int hugepage_size, int alignment, long *buf_siz
 static void
 init_buffers(void)
 {
+	unsigned long good_len = large_file ? model_window : maxfilelen;
 	int i;
 
-	original_buf = (char *) malloc(maxfilelen);
-	for (i = 0; i < maxfilelen; i++)
-		original_buf[i] = random() % 256;
+	if (!large_file) {
+		original_buf = (char *) malloc(maxfilelen);
+		for (i = 0; i < maxfilelen; i++)
+			original_buf[i] = random() % 256;
+	}
 	if (hugepages) {
 		long hugepage_size = get_hugepage_size();
 		if (hugepage_size == -1) {
 			prterr("get_hugepage_size()");
 			exit(102);
 		}
-		good_buf = init_hugepages_buf(maxfilelen, hugepage_size, writebdy,
+		good_buf = init_hugepages_buf(good_len, hugepage_size, writebdy,
 					      &hugepages_info.good_buf_size);
 		if (!good_buf) {
 			prterr("init_hugepages_buf failed for good_buf");
@@ -3123,7 +4476,7 @@ init_buffers(void)
 		}
 		hugepages_info.orig_temp_buf = temp_buf;
 	} else {
-		unsigned long good_buf_len = maxfilelen + writebdy;
+		unsigned long good_buf_len = good_len + writebdy;
 		unsigned long temp_buf_len = maxoplen + readbdy;
 
 		good_buf = calloc(1, good_buf_len);
@@ -3133,10 +4486,130 @@ init_buffers(void)
 	temp_buf = round_ptr_up(temp_buf, readbdy, 0);
 }
 
+/* The rest of the --files, after init_buffers() has set up the first. */
+void
+open_file(struct fsx_file *f, int i, int o_flags)
+{
+	unsigned long good_len = large_file ? model_window : maxfilelen;
+	char *buf;
+
+	f->fd = open(f->name, o_flags, 0666);
+	if (f->fd < 0) {
+		prterr(f->name);
+		exit(91);
+	}
+	if (dirpath)
+		i = asprintf(&f->goodname, "%s%s.%d.fsxgood", dname, bname, i);
+	else
+		i = asprintf(&f->goodname, "%s.fsxgood", f->name);
+	if (i < 0) {
+		prterr("asprintf");
+		exit(101);
+	}
+	f->goodfd = open(f->goodname, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (f->goodfd < 0) {
+		prterr(f->goodname);
+		exit(92);
+	}
+	buf = calloc(1, good_len + writebdy);
+	if (!buf) {
+		prterr("open_file: calloc");
+		exit(101);
+	}
+	f->good_buf = round_ptr_up(buf, writebdy, 0);
+}
+
+/* Thread t of nthreads owns files t, t + nthreads, ... */
+void
+own_files(int t)
+{
+	int i;
+
+	my_files = calloc(nfiles, sizeof(*my_files));
+	if (!my_files) {
+		prterr("own_files: calloc");
+		exit(101);
+	}
+	for (i = t; i < nfiles; i += nthreads)
+		my_files[my_nfiles++] = &files[i];
+	file_switch(my_files[0]);
+}
+
+long long	*thread_calls;
+
+void *
+fsx_thread(void *arg)
+{
+	long t = (long)arg;
+	char *buf;
+
+	numops = thread_numops;
+	snprintf(opsfile, sizeof(opsfile), "%s.%ld", thread_opsfile, t);
+	unlink(opsfile);
+	buf = calloc(1, maxoplen + readbdy);
+	if (!buf) {
+		prterr("fsx_thread: calloc");
+		exit(101);
+	}
+	temp_buf = round_ptr_up(buf, readbdy, 0);
+	if (opstats)
+		my_opstats = opstats + t * OP_MAX_INTEGRITY;
+	own_files(t);
+
+	while (keep_running())
+		if (!test())
+			break;
+
+	file_switch(NULL);
+	thread_calls[t] = testcalls;
+	if (recordops)
+		logdump();
+	return NULL;
+}
+
+void
+run_threads(void)
+{
+	pthread_t *tids;
+	long t;
+	int ret;
+
+	tids = calloc(nthreads, sizeof(*tids));
+	thread_calls = calloc(nthreads, sizeof(*thread_calls));
+	if (!tids || !thread_calls) {
+		prterr("run_threads: calloc");
+		exit(101);
+	}
+	file_switch(NULL);
+	thread_numops = numops;
+	thread_opsfile = opsfile;
+	for (t = 0; t < nthreads; t++) {
+		ret = pthread_create(&tids[t], NULL, fsx_thread, (void *)t);
+		if (ret) {
+			errno = ret;
+			prterr("pthread_create");
+			exit(101);
+		}
+	}
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(tids[t], NULL);
+		testcalls += thread_calls[t];
+	}
+	free(tids);
+	free(thread_calls);
+}
+
 static struct option longopts[] = {
 	{"replay-ops", required_argument, 0, 256},
 	{"record-ops", optional_argument, 0, 255},
 	{"duration", optional_argument, 0, 254},
+	{"large", no_argument, 0, 253},
+	{"files", required_argument, 0, 252},
+	{"threads", required_argument, 0, 251},
+	{"full-check", required_argument, 0, 250},
+	{"iodepth", required_argument, 0, 249},
+	{"report", optional_argument, 0, 248},
+	{"minimize", optional_argument, 0, 247},
 	{ }
 };
 
@@ -3149,10 +4622,20 @@ main(int argc, char **argv)
 	struct stat statbuf;
 	int o_flags = O_RDWR|O_CREAT|O_TRUNC;
 	long long duration;
+	char *report_name = NULL;
 
 	logfile[0] = 0;
 	dname[0] = 0;
 
+	/* getopt shuffles argv, --minimize wants it as it was */
+	min_argc = argc;
+	min_argv = malloc((argc + 1) * sizeof(*argv));
+	if (!min_argv) {
+		prterr("malloc");
+		exit(101);
+	}
+	memcpy(min_argv, argv, (argc + 1) * sizeof(*argv));
+
 	page_size = getpagesize();
 	page_mask = page_size - 1;
 	mmap_mask = page_mask;
@@ -3397,6 +4880,37 @@ main(int argc, char **argv)
 		case 256:  /* --replay-ops */
 			replayops = optarg;
 			break;
+		case 253:  /* --large */
+			large_file = 1;
+			break;
+		case 252:  /* --files */
+			nfiles = getnum(optarg, &endp);
+			if (nfiles <= 0)
+				usage();
+			break;
+		case 251:  /* --threads */
+			nthreads = getnum(optarg, &endp);
+			if (nthreads <= 0)
+				usage();
+			break;
+		case 250:  /* --full-check */
+			full_check = getnum(optarg, &endp);
+			if (full_check <= 0)
+				usage();
+			break;
+		case 249:  /* --iodepth */
+			iodepth = getnum(optarg, &endp);
+			if (iodepth <= 0 || iodepth > 1024)
+				usage();
+			break;
+		case 248:  /* --report */
+			report_name = optarg ? optarg : "-";
+			break;
+		case 247:  /* --minimize */
+			min_jobs = optarg ? getnum(optarg, &endp) : 1;
+			if (min_jobs <= 0)
+				usage();
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -3416,8 +4930,65 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	fname = argv[0];
-	tmp = strdup(fname);
+	if (large_file && !lite && !(o_flags & O_TRUNC)) {
+		fprintf(stderr, "-k can't be used with --large\n");
+		usage();
+	}
+
+	if (nthreads > nfiles) {
+		fprintf(stderr, "--threads can't be more than --files\n");
+		usage();
+	}
+
+	if (nfiles > 1 && (simulatedopcount || hugepages || integrity ||
+			   lite || !(o_flags & O_TRUNC) || prealloc)) {
+		fprintf(stderr, "--files can't be used with -b, -h, -i, -k, "
+			"-L or -x\n");
+		usage();
+	}
+
+	if (nthreads > 1 && (aio || uring || replayops)) {
+		fprintf(stderr, "--threads can't be used with -A, -U or "
+			"--replay-ops\n");
+		usage();
+	}
+
+	if (iodepth > 1 && (!(aio || uring) || nfiles > 1)) {
+		fprintf(stderr, "--iodepth needs -A or -U, and can't be used "
+			"with --files\n");
+		usage();
+	}
+
+	if (min_jobs) {
+		if (!replayops) {
+			fprintf(stderr, "--minimize needs --replay-ops\n");
+			usage();
+		}
+		replayopsf = fopen(replayops, "r");
+		if (!replayopsf) {
+			prterr(replayops);
+			exit(93);
+		}
+		exit(minimize(argv[0]));
+	}
+
+	files = calloc(nfiles, sizeof(*files));
+	if (!files) {
+		prterr("calloc");
+		exit(101);
+	}
+	for (i = 0; i < nfiles; i++) {
+		if (nfiles == 1)
+			files[i].name = argv[0];
+		else if (asprintf(&files[i].name, "%s.%d", argv[0], i) < 0) {
+			prterr("asprintf");
+			exit(101);
+		}
+	}
+	files[0].goodname = goodfile;
+	cur_file = src_file = &files[0];
+	fname = files[0].name;
+	tmp = strdup(argv[0]);
 	if (!tmp) {
 		prterr("strdup");
 		exit(101);
@@ -3467,7 +5038,8 @@ main(int argc, char **argv)
 #endif
 
 	if (dirpath) {
-		snprintf(goodfile, sizeof(goodfile), "%s%s.fsxgood", dname, bname);
+		snprintf(goodfile, sizeof(goodfile), "%s%s%s.fsxgood", dname,
+			 bname, nfiles > 1 ? ".0" : "");
 		snprintf(logfile, sizeof(logfile), "%s%s.fsxlog", dname, bname);
 		if (!*opsfile)
 			snprintf(opsfile, sizeof(opsfile), "%s%s.fsxops", dname, bname);
@@ -3521,8 +5093,28 @@ main(int argc, char **argv)
 			exit(95);
 		}
 	}
+	/* a window for regenerating reads, checks and writes into */
+	model_window = roundup_64(MAX(maxoplen, 1024 * 1024), readbdy);
 	init_buffers();
-	if (lite) {	/* zero entire existing file */
+	if (iodepth > 1)
+		iodepth_setup();
+	if (report_name) {
+		report_fp = strcmp(report_name, "-") ?
+			fopen(report_name, "a") : stdout;
+		opstats = calloc(nthreads * OP_MAX_INTEGRITY, sizeof(*opstats));
+		if (!report_fp || !opstats) {
+			prterr(report_name);
+			exit(93);
+		}
+		my_opstats = opstats;
+	}
+	if (lite && large_file) {	/* zero it by punching it out */
+		if (ftruncate(fd, 0) || ftruncate(fd, maxfilelen)) {
+			prterr(fname);
+			warn("main: ftruncate");
+			exit(98);
+		}
+	} else if (lite) {	/* zero entire existing file */
 		ssize_t written;
 
 		written = write(fd, good_buf, (size_t)maxfilelen);
@@ -3554,6 +5146,12 @@ main(int argc, char **argv)
 
 		check_trunc_hack();
 	}
+	for (i = 1; i < nfiles; i++) {
+		open_file(&files[i], i, o_flags);
+		file_switch(&files[i]);
+		check_trunc_hack();
+	}
+	file_switch(&files[0]);
 
 	if (fallocate_calls)
 		fallocate_calls = test_fallocate(0);
@@ -3582,17 +5180,29 @@ main(int argc, char **argv)
 	if (do_atomic_writes)
 		do_atomic_writes = test_atomic_writes();
 
-	while (keep_running())
-		if (!test())
-			break;
+	clock_gettime(CLOCK_MONOTONIC, &report_start);
+	if (nthreads > 1)
+		run_threads();
+	else {
+		own_files(0);
+		while (keep_running())
+			if (!test())
+				break;
+		io_drain();
+	}
 
 	free(tmp);
-	if (close(fd)) {
-		prterr("close");
-		report_failure(99);
+	for (i = 0; i < nfiles; i++) {
+		file_switch(&files[i]);
+		if (close(fd)) {
+			prterr("close");
+			report_failure(99);
+		}
 	}
 	prt("All %lld operations completed A-OK!\n", testcalls);
-	if (recordops)
+	if (report_fp)
+		report_print();
+	if (recordops && nthreads == 1)
 		logdump();
 
 	fclose(fsxlogf);